@@ -0,0 +1,13 @@
+#ifndef CACHE_OPS_H
+#define CACHE_OPS_H
+
+#include "types.h"
+
+/* Records a range of the message being processed that has been modified by us */
+void cache_dirty_add(const void *addr, u32 size);
+/* Flushes all the ranges recorded so far with a single cache operation */
+void cache_dirty_flush(void);
+
+void cache_invalidate(const void *addr, u32 size);
+
+#endif
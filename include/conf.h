@@ -6,7 +6,7 @@
 
 /* From libogc/gc/ogc/conf.h */
 
-#define CONF_SIZE	0x4000
+#define CONF_PATH	"/shared2/sys/SYSCONF"
 
 #define CONF_EBADFILE	-0x6001
 #define CONF_ENOENT		-0x6002
@@ -53,7 +53,8 @@ struct conf_pads_cmp_setting {
 	struct conf_pads_cmp_entry entries[6];
 } ATTRIBUTE_PACKED;
 
-int conf_get(u8 *conf, const char *name, void *buffer, u32 length);
-int conf_set(u8 *conf, const char *name,  const void *buffer, u32 length);
+/* fd is an open SYSCONF file. Returns the item length or a CONF_E* error */
+int conf_get(int fd, const char *name, void *buffer, u32 length);
+int conf_set(int fd, const char *name, const void *buffer, u32 length);
 
 #endif
@@ -3,10 +3,15 @@
 
 #include "hci.h"
 #include "input_device.h"
+#include "l2cap.h"
 #include "types.h"
+#include "utils.h"
 #include "wiimote.h"
 #include "wiimote_crypto.h"
 
+/* Largest L2CAP frame the host can send us (we request that MTU for our channels) */
+#define FAKE_WIIMOTE_L2CAP_FRAME_MAX	(sizeof(l2cap_hdr_t) + WII_REQUEST_MTU)
+
 typedef enum {
 	BASEBAND_STATE_INACTIVE,
 	BASEBAND_STATE_REQUEST_CONNECTION,
@@ -33,31 +38,70 @@ typedef struct {
 	u16 remote_mtu;
 } l2cap_channel_info_t;
 
-typedef struct fake_wiimote_t {
+/* Pending work of a fake Wiimote, kept up to date by whatever causes it. Ticks only
+ * visit the fake Wiimotes that have some */
+#define FAKE_WIIMOTE_WORK_CON_REQ	BIT(0) /* Connection request to send */
+#define FAKE_WIIMOTE_WORK_LINKING	BIT(1) /* L2CAP channels being set up */
+#define FAKE_WIIMOTE_WORK_INPUT		BIT(2) /* Input changes not reported yet */
+#define FAKE_WIIMOTE_WORK_READ_REQ	BIT(3) /* Memory read request in progress */
+#define FAKE_WIIMOTE_WORK_EXT_CHANGE	BIT(4) /* Extension port event to report */
+#define FAKE_WIIMOTE_WORK_CONTINUOUS	BIT(5) /* Continuous reporting mode */
+
+/* Sections of the data report changed since it was last encoded */
+#define FAKE_WIIMOTE_REPORT_DIRTY_BTN	BIT(0)
+#define FAKE_WIIMOTE_REPORT_DIRTY_ACC	BIT(1)
+#define FAKE_WIIMOTE_REPORT_DIRTY_IR	BIT(2)
+#define FAKE_WIIMOTE_REPORT_DIRTY_EXT	BIT(3)
+#define FAKE_WIIMOTE_REPORT_DIRTY_ALL	(FAKE_WIIMOTE_REPORT_DIRTY_BTN | \
+					 FAKE_WIIMOTE_REPORT_DIRTY_ACC | \
+					 FAKE_WIIMOTE_REPORT_DIRTY_IR  | \
+					 FAKE_WIIMOTE_REPORT_DIRTY_EXT)
+
+/* Largest data report (0x34, 0x37 and 0x3d) */
+#define FAKE_WIIMOTE_REPORT_MAX_SIZE	21
+
+/* Fields checked on every tick. The manager keeps them in one contiguous array separate
+ * from the (much larger) rest of the state, so polling all the fake Wiimotes only touches
+ * a couple of cache lines */
+typedef struct {
 	bool active;
+	u8 work; /* FAKE_WIIMOTE_WORK_* */
+	u8 baseband_state; /* baseband_state_e */
+	u8 acl_state; /* acl_state_e */
+	bool input_dirty;
+	u8 reporting_mode;
+	bool reporting_continuous;
+	u16 hci_con_handle;
+	u16 buttons;
+	u16 num_completed_acl_data_packets;
+} fake_wiimote_hot_t;
+
+typedef struct fake_wiimote_t {
+	fake_wiimote_hot_t *hot;
 	bdaddr_t bdaddr;
 	/* Bluetooth connection state */
-	u16 hci_con_handle;
-	baseband_state_e baseband_state;
-	acl_state_e acl_state;
 	l2cap_channel_info_t psm_sdp_chn;
 	l2cap_channel_info_t psm_hid_cntl_chn;
 	l2cap_channel_info_t psm_hid_intr_chn;
-	u32 num_completed_acl_data_packets;
+	/* L2CAP frame being reassembled from the ACL fragments sent by the host */
+	u8 acl_reassembly_buf[FAKE_WIIMOTE_L2CAP_FRAME_MAX];
+	u16 acl_reassembly_len;
 	/* Associated input device with this fake Wiimote */
 	input_device_t *input_device;
-	/* Reporting mode */
-	u8 reporting_mode;
-	bool reporting_continuous;
+	/* Data report builder and report size for the current reporting mode */
+	void (*build_report)(struct fake_wiimote_t *wiimote, u8 *report_data);
+	u8 report_size;
+	/* Sections present in the reports of the current reporting mode */
+	u8 report_sections;
+	/* Last encoded data report. Only its dirty sections are encoded again */
+	u8 last_report[FAKE_WIIMOTE_REPORT_MAX_SIZE];
+	u8 report_dirty;
 	/* Status */
 	struct {
 		u8 leds : 4;
 		u8 ir : 1;
 		u8 speaker : 1;
 	} status;
-	/* Buttons */
-	u16 buttons;
-	bool input_dirty;
 	/* Accelerometer */
 	u16 acc_x, acc_y, acc_z;
 	/* Rumble */
@@ -69,6 +113,9 @@ typedef struct fake_wiimote_t {
 	/* Extension */
 	struct wiimote_extension_registers_t extension_regs;
 	struct wiimote_encryption_key_t extension_key;
+	/* Encrypted copy of the extension registers. It's kept up to date as the registers
+	 * change, and rebuilt when the key changes (while extension_key_dirty is set) */
+	u8 extension_regs_encrypted[sizeof(struct wiimote_extension_registers_t)];
 	bool extension_key_dirty;
 	enum wiimote_ext_e cur_extension;
 	enum wiimote_ext_e new_extension;
@@ -84,16 +131,18 @@ typedef struct fake_wiimote_t {
 } fake_wiimote_t;
 
 /** Used by the Fake Wiimote manager **/
-void fake_wiimote_init(fake_wiimote_t *wiimote, const bdaddr_t *bdaddr);
+void fake_wiimote_init(fake_wiimote_t *wiimote, fake_wiimote_hot_t *hot, const bdaddr_t *bdaddr);
 void fake_wiimote_init_state(fake_wiimote_t *wiimote, input_device_t *input_device);
 void fake_wiimote_handle_hci_cmd_accept_con(fake_wiimote_t *wiimote, u8 role);
 void fake_wiimote_release_input_device(fake_wiimote_t *wiimote);
 int fake_wiimote_disconnect(fake_wiimote_t *wiimote);
 void fake_wiimote_tick(fake_wiimote_t *wiimote);
+bool fake_wiimote_needs_tick(const fake_wiimote_t *wiimote);
 void fake_wiimote_handle_acl_data_out_request_from_host(fake_wiimote_t *wiimote,
 							const hci_acldata_hdr_t *acl);
 
 /** Used by the input devices **/
+void fake_wiimote_handle_input_event(fake_wiimote_t *wiimote);
 void fake_wiimote_set_extension(fake_wiimote_t *wiimote, enum wiimote_ext_e ext);
 void fake_wiimote_report_input(fake_wiimote_t *wiimote, u16 buttons);
 void fake_wiimote_report_accelerometer(fake_wiimote_t *wiimote, u16 acc_x, u16 acc_y, u16 acc_z);
@@ -103,9 +152,25 @@ void fake_wiimote_report_input_ext(fake_wiimote_t *wiimote, u16 buttons,
 
 /* Helper functions */
 
+static inline bool fake_wiimote_hot_is_connected(const fake_wiimote_hot_t *hot)
+{
+	return hot->active && (hot->baseband_state == BASEBAND_STATE_COMPLETE);
+}
+
+static inline bool fake_wiimote_hot_has_work(const fake_wiimote_hot_t *hot)
+{
+	u8 work = hot->work;
+
+	/* Input changes can't be sent while data reporting is disabled */
+	if (hot->reporting_mode == INPUT_REPORT_ID_REPORT_DISABLED)
+		work &= ~FAKE_WIIMOTE_WORK_INPUT;
+
+	return hot->active && (work != 0);
+}
+
 static inline bool fake_wiimote_is_connected(const fake_wiimote_t *wiimote)
 {
-	return wiimote->active && (wiimote->baseband_state == BASEBAND_STATE_COMPLETE);
+	return fake_wiimote_hot_is_connected(wiimote->hot);
 }
 
 #endif
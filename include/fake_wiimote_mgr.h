@@ -4,13 +4,19 @@
 #include "fake_wiimote.h"
 #include "hci.h"
 
-#define MAX_FAKE_WIIMOTES	2
+#define MAX_FAKE_WIIMOTES	4
 
 #define FAKE_WIIMOTE_BDADDR(i) ((bdaddr_t){.b = {0xFE, 0xED, 0xBA, 0xDF, 0x00, 0xD0 + i}})
 
 /** Used by the main event loop **/
 void fake_wiimote_mgr_init(void);
 void fake_wiimote_mgr_tick_devices(void);
+bool fake_wiimote_mgr_any_active(void);
+bool fake_wiimote_mgr_any_connected(void);
+bool fake_wiimote_mgr_needs_tick(void);
+
+/** Used by the fake Wiimotes **/
+u32 fake_wiimote_mgr_num_connected(void);
 
 /** Used by the HCI state tracker **/
 
@@ -20,4 +26,8 @@ bool fake_wiimote_mgr_handle_hci_cmd_from_host(const hci_cmd_hdr_t *hdr);
 /* Processes and returns true if the HCI connection handle belongs to a fake wiimote */
 bool fake_wiimote_mgr_handle_acl_data_out_request_from_host(u16 hci_con_handle, const hci_acldata_hdr_t *hdr);
 
+/* Moves the unreported completed packet counts of the fake Wiimotes to the entries of a
+ * Number Of Completed Packets event from the controller. Returns the number of entries used */
+u8 fake_wiimote_mgr_piggyback_num_compl_pkts(hci_num_compl_pkts_info *info, u8 max_entries);
+
 #endif
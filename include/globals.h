@@ -4,5 +4,44 @@
 #include "types.h"
 
 extern u8 g_sensor_bar_position_top;
+/* Number of periodic timer ticks skipped because devices were idle or absent */
+extern u32 g_periodic_timer_ticks_saved;
+/* Number of times the periodic timer rate was re-evaluated */
+extern u32 g_periodic_timer_rate_updates;
+/* Number of messages that had to wait because the ReadyQ was full / that were dropped */
+extern u32 g_ready_msgs_deferred;
+extern u32 g_ready_msgs_dropped;
+/* Number of undelivered data reports replaced by a newer one of the same connection */
+extern u32 g_ready_msgs_coalesced;
+/* Number of host ACL buffers that OH1 filled directly, without a copy */
+extern u32 g_acl_in_passthrough;
+/* Number of HCI commands answered from the cached controller info */
+extern u32 g_hci_cmd_cache_hits;
+/* Number of packets whose connection handles didn't need a rewrite thanks to identity mapping */
+extern u32 g_hci_con_handles_identity;
+/* Number of L2CAP frames from the host reassembled from ACL fragments,
+ * and number of ACL fragments (start packets included) we injected */
+extern u32 g_acl_frames_reassembled;
+extern u32 g_acl_fragments_injected;
+/* Number of L2CAP payload bytes copied from the caller's buffer into injected packets.
+ * HID reports don't add to it: they are built in place */
+extern u32 g_l2cap_bytes_copied;
+/* Number of fake Wiimotes visited by the periodic ticks, in total and on the last one */
+extern u32 g_fake_wiimote_tick_visits;
+extern u32 g_fake_wiimote_last_tick_visits;
+/* Number of controller Number Of Completed Packets events that also carried the counts
+ * of the fake Wiimotes, which saved injecting an event of our own */
+extern u32 g_num_compl_pkts_piggybacked;
+/* Number of memory read replies sent in a burst, on top of the one per tick */
+extern u32 g_read_replies_burst;
+/* Number of recorded dirty ranges, cache flushes and invalidations, and invalidations
+ * skipped because the data hadn't been read yet */
+extern u32 g_cache_dirty_ranges;
+extern u32 g_cache_flushes;
+extern u32 g_cache_invalidations;
+extern u32 g_cache_invalidations_skipped;
+
+/* Queue ID created by OH1 that receives ipcmessages from /dev/usb/oh1 */
+extern int orig_msg_queueid;
 
 #endif
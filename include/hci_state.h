@@ -3,17 +3,30 @@
 
 #include <stdbool.h>
 
+/* Real connections use their physical handle as virtual handle (so no translation is needed),
+ * except when it falls in this range, which is reserved for the fake Wiimotes' handles */
+#define HCI_RESERVED_CON_HANDLE_BASE	0x0EE0
+#define HCI_RESERVED_CON_HANDLE_COUNT	32
+
 void hci_state_reset(void);
 
 /* Used by fake Wiimote manager */
 u16 hci_con_handle_virt_alloc(void);
+void hci_con_handle_virt_free(u16 virt);
 bool hci_can_request_connection(void);
 
+/* Used by the injection helpers */
+u16 hci_state_get_max_acl_size(void);
+
+/* Used by the fake Wiimotes. The number of ACL packets the host can buffer, 0 if unknown */
+u16 hci_state_get_host_num_acl_pkts(void);
+
 /* Used by the main request-handling loop */
 
 void hci_state_handle_hci_cmd_from_host(void *data, u32 length, bool *fwd_to_usb);
-void hci_state_handle_hci_event_from_controller(void *data, u32 length);
-void hci_state_handle_acl_data_in_response_from_controller(void *data, u32 length);
+/* These get the size of the buffer holding the data, and return its (new) length */
+u32 hci_state_handle_hci_event_from_controller(void *data, u32 length, u32 size);
+u32 hci_state_handle_acl_data_in_response_from_controller(void *data, u32 length, u32 size);
 void hci_state_handle_acl_data_out_request_from_host(void *data, u32 length, bool *fwd_to_usb);
 
 #endif
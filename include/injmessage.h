@@ -17,6 +17,7 @@ bool is_message_injected(const void *msg);
 /* HCI event injection helpers */
 int inject_hci_event_command_status(u16 opcode);
 int inject_hci_event_command_compl(u16 opcode, const void *payload, u32 payload_size);
+int inject_hci_event_inquiry_compl(u8 status);
 int inject_hci_event_con_req(const bdaddr_t *bdaddr, u8 uclass0, u8 uclass1, u8 uclass2, u8 link_type);
 int inject_hci_event_discon_compl(u16 con_handle, u8 status, u8 reason);
 int inject_hci_event_con_compl(const bdaddr_t *bdaddr, u16 con_handle, u8 status);
@@ -33,6 +34,8 @@ int inject_hci_event_read_remote_ver_info_compl(u16 con_handle, u8 lmp_version,
 int inject_hci_event_read_clock_offset_compl(u16 con_handle, u16 clock_offset);
 
 /* L2CAP injection helpers */
+void *inject_l2cap_packet_alloc(u16 hci_con_handle, u16 dcid, u16 size, void **payload);
+int inject_l2cap_packet_submit(void *msg);
 int inject_l2cap_packet(u16 hci_con_handle, u16 dcid, const void *data, u16 size);
 int inject_l2cap_connect_req(u16 hci_con_handle, u16 psm, u16 scid);
 int inject_l2cap_disconnect_req(u16 hci_con_handle, u16 dcid, u16 scid);
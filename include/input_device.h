@@ -12,16 +12,26 @@ typedef struct input_device_ops_t {
 	int (*set_leds)(void *usrdata, int leds);
 	int (*set_rumble)(void *usrdata, bool rumble_on);
 	bool (*report_input)(void *usrdata);
+	/* Called from the main loop once the input device is gone, its usrdata can be reused */
+	void (*removed)(void *usrdata);
 } input_device_ops_t;
 
 void input_devices_init(void);
 void input_devices_tick(void);
+bool input_devices_any_valid(void);
+bool input_devices_need_tick(void);
 
 /** Used by input devices **/
 
 bool input_devices_add(void *usrdata, const input_device_ops_t *ops,
 		       input_device_t **assigned_input_device);
 void input_devices_remove(input_device_t *input_device);
+void input_device_post_input_event(input_device_t *input_device);
+
+/** Used by the main event loop **/
+
+bool input_device_is_input_event_cookie(const void *msg);
+void input_device_handle_input_event(input_device_t *input_device);
 
 /** Used by fake Wiimotes and fake Wiimote manager **/
 
@@ -0,0 +1,82 @@
+#ifndef MSG_RING_H
+#define MSG_RING_H
+
+#include "syscalls.h"
+#include "types.h"
+
+/* Single-owner ring buffer of message pointers. Unlike IOS message queues, pushing and
+ * popping doesn't require a syscall, but it must only be accessed from the OH1 thread.
+ * Zero-initialized rings are empty. */
+
+#define MSG_RING_SIZE	16 /* Must be a power of 2 */
+
+typedef struct {
+	void *entries[MSG_RING_SIZE];
+	/* Free running indices, wrapped when accessing the entries */
+	u8 head;
+	u8 tail;
+} msg_ring_t;
+
+static inline u32 msg_ring_count(const msg_ring_t *ring)
+{
+	return (u8)(ring->tail - ring->head);
+}
+
+static inline bool msg_ring_is_empty(const msg_ring_t *ring)
+{
+	return ring->head == ring->tail;
+}
+
+static inline bool msg_ring_is_full(const msg_ring_t *ring)
+{
+	return msg_ring_count(ring) == MSG_RING_SIZE;
+}
+
+static inline int msg_ring_push(msg_ring_t *ring, void *msg)
+{
+	if (msg_ring_is_full(ring))
+		return IOS_EQUEUEFULL;
+
+	ring->entries[ring->tail++ & (MSG_RING_SIZE - 1)] = msg;
+	return IOS_OK;
+}
+
+static inline void *msg_ring_peek(const msg_ring_t *ring)
+{
+	if (msg_ring_is_empty(ring))
+		return NULL;
+
+	return ring->entries[ring->head & (MSG_RING_SIZE - 1)];
+}
+
+/* Returns the i-th oldest entry */
+static inline void *msg_ring_at(const msg_ring_t *ring, u32 i)
+{
+	return ring->entries[(u8)(ring->head + i) & (MSG_RING_SIZE - 1)];
+}
+
+/* Replaces the i-th oldest entry */
+static inline void msg_ring_set(msg_ring_t *ring, u32 i, void *msg)
+{
+	ring->entries[(u8)(ring->head + i) & (MSG_RING_SIZE - 1)] = msg;
+}
+
+/* Removes the i-th oldest entry keeping the order of the rest */
+static inline void msg_ring_remove(msg_ring_t *ring, u32 i)
+{
+	for (; i > 0; i--) {
+		ring->entries[(u8)(ring->head + i) & (MSG_RING_SIZE - 1)] =
+			ring->entries[(u8)(ring->head + i - 1) & (MSG_RING_SIZE - 1)];
+	}
+	ring->head++;
+}
+
+static inline void *msg_ring_pop(msg_ring_t *ring)
+{
+	if (msg_ring_is_empty(ring))
+		return NULL;
+
+	return ring->entries[ring->head++ & (MSG_RING_SIZE - 1)];
+}
+
+#endif
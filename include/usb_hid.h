@@ -10,7 +10,10 @@
 typedef struct usb_device_driver_t usb_device_driver_t;
 
 typedef struct {
-	bool valid;
+	/* Cleared by the main loop once it has removed the input device of a disconnected
+	 * device, so that the slot isn't reused while the main loop can still use it */
+	volatile bool valid;
+	bool disconnected;
 	bool suspended;
 	/* VID and PID */
 	u16 vid;
@@ -6,8 +6,18 @@
 #include <string.h>
 #include "hci.h"
 
+/* The Wii is big-endian. The host tests may get these from <endian.h> already */
+#ifndef le16toh
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define le16toh(x) ((u16)(x))
+#define htole16(x) ((u16)(x))
+#define be16toh(x) __builtin_bswap16(x)
+#else
 #define le16toh(x) __builtin_bswap16(x)
 #define htole16(x) __builtin_bswap16(x)
+#define be16toh(x) ((u16)(x))
+#endif
+#endif
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
 
@@ -17,6 +27,14 @@
 #define ROUNDUP32(x)	(((u32)(x) + 0x1f) & ~0x1f)
 #define ROUNDDOWN32(x)	(((u32)(x) - 0x1f) & ~0x1f)
 
+/* CLZ only exists in ARM mode on the ARM926, in Thumb mode it's a libgcc call.
+ * Hot functions that count leading zeros are built as ARM code. */
+#ifdef __thumb__
+#define ATTRIBUTE_ARM_CODE	__attribute__((target("arm"), noinline))
+#else
+#define ATTRIBUTE_ARM_CODE
+#endif
+
 #define UNUSED(x) (void)(x)
 #define MEMBER_SIZE(type, member) sizeof(((type *)0)->member)
 
@@ -58,7 +76,20 @@ static inline void reverse_memcpy(void *restrict dst, const void *restrict src,
 }
 
 /* Message injection helpers */
+void *claim_usb_intr_pending_msg(void **data, u16 size);
+void *claim_usb_bulk_in_pending_msg(void **data, u16 size);
+/* Messages allocated from the heap have to reserve their room in the ReadyQ first.
+ * Injecting a message releases its reservation */
+bool usb_intr_ready_queue_reserve(u32 num);
+bool usb_bulk_in_ready_queue_reserve(u32 num);
+void usb_intr_ready_queue_unreserve(u32 num);
+void usb_bulk_in_ready_queue_unreserve(u32 num);
 int inject_msg_to_usb_intr_ready_queue(void *msg);
 int inject_msg_to_usb_bulk_in_ready_queue(void *msg);
+/* Host buffers waiting on the PendingQ. Messages injected now are copied straight into them */
+u32 usb_bulk_in_pending_msgs(void);
+
+/* Makes the main loop re-evaluate the periodic timer rate before the next message */
+void periodic_timer_request_update(void);
 
 #endif
@@ -1,6 +1,7 @@
 #ifndef WIIMOTE_H
 #define WIIMOTE_H
 
+#include <stddef.h>
 #include "types.h"
 #include "utils.h"
 
@@ -400,104 +401,54 @@ static_assert(sizeof(union wiimote_usable_eeprom_data_t) == EEPROM_FREE_SIZE);
 
 /* Helper inline functions */
 
-static inline bool input_report_has_btn(u8 rpt_id)
-{
-	switch (rpt_id) {
-	case INPUT_REPORT_ID_EXP21:
-		return false;
-	default:
-		return true;
-	}
-}
-
-static inline u8 input_report_acc_size(u8 rpt_id)
-{
-	switch (rpt_id) {
-	case INPUT_REPORT_ID_BTN_ACC:
-	case INPUT_REPORT_ID_BTN_ACC_IR:
-	case INPUT_REPORT_ID_BTN_ACC_EXP:
-	case INPUT_REPORT_ID_BTN_ACC_IR_EXP:
-		return 3;
-	default:
-		return 0;
-	}
-}
-
-static inline u8 input_report_acc_offset(u8 rpt_id)
-{
-	switch (rpt_id) {
-	case INPUT_REPORT_ID_BTN_ACC:
-	case INPUT_REPORT_ID_BTN_ACC_IR:
-	case INPUT_REPORT_ID_BTN_ACC_EXP:
-	case INPUT_REPORT_ID_BTN_ACC_IR_EXP:
-		return 2;
-	default:
-		return 0;
-	}
-}
+/* Layout of the data reporting mode input reports (IDs 0x30 - 0x3f) */
+struct input_report_layout_t {
+	bool has_btn;
+	u8 acc_offset, acc_size;
+	u8 ext_offset, ext_size;
+	u8 ir_offset, ir_size;
+	/* Total size of the report data */
+	u8 size;
+};
 
-static inline u8 input_report_ext_size(u8 rpt_id)
-{
-	switch (rpt_id) {
-	case INPUT_REPORT_ID_BTN_EXP8:
-		return 8;
-	case INPUT_REPORT_ID_BTN_EXP19:
-		return 19;
-	case INPUT_REPORT_ID_BTN_ACC_EXP:
-		return 16;
-	case INPUT_REPORT_ID_BTN_IR_EXP:
-		return 9;
-	case INPUT_REPORT_ID_BTN_ACC_IR_EXP:
-		return 6;
-	case INPUT_REPORT_ID_EXP21:
-		return 21;
-	default:
-		return 0;
-	}
-}
+#define INPUT_REPORT_LAYOUT(btn, acc_off, acc_sz, ext_off, ext_sz, ir_off, ir_sz) \
+	{btn, acc_off, acc_sz, ext_off, ext_sz, ir_off, ir_sz, \
+	 (btn ? 2 : 0) + acc_sz + ext_sz + ir_sz}
+#define INPUT_REPORT_LAYOUT_BTN	INPUT_REPORT_LAYOUT(true, 0, 0, 0, 0, 0, 0)
+
+static const struct input_report_layout_t input_report_layouts[16] = {
+	/* 0x30 */ INPUT_REPORT_LAYOUT_BTN,
+	/* 0x31 */ INPUT_REPORT_LAYOUT(true, 2, 3, 0, 0, 0, 0),
+	/* 0x32 */ INPUT_REPORT_LAYOUT(true, 0, 0, 2, 8, 0, 0),
+	/* 0x33 */ INPUT_REPORT_LAYOUT(true, 2, 3, 0, 0, 5, 12),
+	/* 0x34 */ INPUT_REPORT_LAYOUT(true, 0, 0, 2, 19, 0, 0),
+	/* 0x35 */ INPUT_REPORT_LAYOUT(true, 2, 3, 5, 16, 0, 0),
+	/* 0x36 */ INPUT_REPORT_LAYOUT(true, 0, 0, 12, 9, 2, 10),
+	/* 0x37 */ INPUT_REPORT_LAYOUT(true, 2, 3, 15, 6, 5, 10),
+	/* 0x38 - 0x3c: Unsupported, only the buttons are reported */
+	INPUT_REPORT_LAYOUT_BTN,
+	INPUT_REPORT_LAYOUT_BTN,
+	INPUT_REPORT_LAYOUT_BTN,
+	INPUT_REPORT_LAYOUT_BTN,
+	INPUT_REPORT_LAYOUT_BTN,
+	/* 0x3d */ INPUT_REPORT_LAYOUT(false, 0, 0, 0, 21, 0, 0),
+	/* 0x3e - 0x3f: Unsupported (interleaved) */
+	INPUT_REPORT_LAYOUT_BTN,
+	INPUT_REPORT_LAYOUT_BTN,
+};
 
-static inline u8 input_report_ext_offset(u8 rpt_id)
+static inline bool input_report_id_has_layout(u8 rpt_id)
 {
-	switch (rpt_id) {
-	case INPUT_REPORT_ID_BTN_EXP8:
-	case INPUT_REPORT_ID_BTN_EXP19:
-		return 2;
-	case INPUT_REPORT_ID_BTN_ACC_EXP:
-		return 5;
-	case INPUT_REPORT_ID_BTN_IR_EXP:
-		return 12;
-	case INPUT_REPORT_ID_BTN_ACC_IR_EXP:
-		return 15;
-	case INPUT_REPORT_ID_EXP21:
-	default:
-		return 0;
-	}
+	return (u8)(rpt_id - INPUT_REPORT_ID_BTN) < ARRAY_SIZE(input_report_layouts);
 }
 
-static inline u8 input_report_ir_size(u8 rpt_id)
+static inline const struct input_report_layout_t *input_report_layout(u8 rpt_id)
 {
-	switch (rpt_id) {
-	case INPUT_REPORT_ID_BTN_ACC_IR:
-		return 12;
-	case INPUT_REPORT_ID_BTN_IR_EXP:
-	case INPUT_REPORT_ID_BTN_ACC_IR_EXP:
-		return 10;
-	default:
-		return 0;
-	}
-}
+	/* Other reporting modes only carry the buttons */
+	if (!input_report_id_has_layout(rpt_id))
+		rpt_id = INPUT_REPORT_ID_BTN;
 
-static inline u8 input_report_ir_offset(u8 rpt_id)
-{
-	switch (rpt_id) {
-	case INPUT_REPORT_ID_BTN_ACC_IR:
-	case INPUT_REPORT_ID_BTN_ACC_IR_EXP:
-		return 5;
-	case INPUT_REPORT_ID_BTN_IR_EXP:
-		return 2;
-	default:
-		return 0;
-	}
+	return &input_report_layouts[rpt_id - INPUT_REPORT_ID_BTN];
 }
 
 #endif
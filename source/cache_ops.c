@@ -0,0 +1,50 @@
+#include "cache_ops.h"
+#include "globals.h"
+#include "syscalls.h"
+#include "utils.h"
+
+/* Global variables */
+u32 g_cache_dirty_ranges;
+u32 g_cache_flushes;
+u32 g_cache_invalidations;
+u32 g_cache_invalidations_skipped;
+
+/* Cache-line-aligned span covering the ranges modified while processing the current message.
+ * They all lie within the same (small) message buffer, so a single flush of the whole span
+ * is cheaper than one flush per patched field. */
+static uintptr_t dirty_start;
+static uintptr_t dirty_end;
+
+void cache_dirty_add(const void *addr, u32 size)
+{
+	uintptr_t start = (uintptr_t)addr & ~0x1f;
+	uintptr_t end = ROUNDUP32((uintptr_t)addr + size);
+
+	g_cache_dirty_ranges++;
+
+	if (dirty_start == dirty_end) {
+		dirty_start = start;
+		dirty_end = end;
+	} else {
+		dirty_start = MIN2(dirty_start, start);
+		dirty_end = MAX2(dirty_end, end);
+	}
+}
+
+void cache_dirty_flush(void)
+{
+	if (dirty_start == dirty_end)
+		return;
+
+	os_sync_after_write((void *)dirty_start, dirty_end - dirty_start);
+	g_cache_flushes++;
+
+	dirty_start = 0;
+	dirty_end = 0;
+}
+
+void cache_invalidate(const void *addr, u32 size)
+{
+	os_sync_before_read((void *)addr, size);
+	g_cache_invalidations++;
+}
@@ -1,115 +1,185 @@
 #include <string.h>
 #include "conf.h"
+#include "syscalls.h"
+#include "utils.h"
 
-static u8 *conf_find(u8 *conf, const char *name)
-{
-	u16 count;
-	u16 *offset;
-	int nlen = strlen(name);
-	count = *((u16*)(&conf[4]));
-	offset = (u16*)&conf[6];
+/* The items are accessed directly in the SYSCONF file instead of loading
+ * the whole 16 KiB of it into memory */
 
-	while(count--) {
-		if((nlen == ((conf[*offset]&0x0F)+1)) && !memcmp(name, &conf[*offset+1], nlen))
-			return &conf[*offset];
-		offset++;
-	}
-	return NULL;
-}
+#define CONF_SEEK_SET		0
+#define CONF_COUNT_OFFSET	4
+#define CONF_OFFSETS_OFFSET	6
+#define CONF_NAME_MAX		16
+#define CONF_OFFSETS_MAX	128
+#define CONF_WINDOW_SIZE	128
 
-static s32 conf_get_length(u8 *conf, const char *name)
+struct conf_entry {
+	u8 type;
+	s32 length;
+	/* File offset of the item's data */
+	u32 data_offset;
+};
+
+/* Returns the number of bytes read, which is short at the end of the file */
+static int conf_read_upto(int fd, u32 offset, void *buffer, u32 length)
 {
-	u8 *entry;
-	int len;
+	int ret;
 
-	entry = conf_find(conf, name);
-	if(!entry)
-		return CONF_ENOENT;
+	ret = os_seek(fd, offset, CONF_SEEK_SET);
+	if (ret < 0)
+		return ret;
 
-	switch (*entry>>5) {
-	case CONF_BIGARRAY:
-		len = strlen(name);
-		return (((s32)entry[len+1] << 8) | entry[len+2]) + 1;
-	case CONF_SMALLARRAY:
-		return (s32)entry[strlen(name)+1] + 1;
-	case CONF_BYTE:
-		return 1;
-	case CONF_SHORT:
-		return 2;
-	case CONF_LONG:
-		return 4;
-	case CONF_BOOL:
-		return 1;
-	default:
-		return CONF_ENOTIMPL;
-	}
+	return os_read(fd, buffer, length);
 }
 
-int conf_get(u8 *conf, const char *name, void *buffer, u32 length)
+static int conf_read_at(int fd, u32 offset, void *buffer, u32 length)
 {
-	u8 *entry;
-	s32 len;
+	int ret;
 
-	entry = conf_find(conf, name);
-	if(!entry)
-		return CONF_ENOENT;
+	ret = conf_read_upto(fd, offset, buffer, length);
+	if (ret < 0)
+		return ret;
 
-	len = conf_get_length(conf, name);
-	if (len < 0)
-		return len;
-	else if (len > length)
-		return CONF_ETOOBIG;
+	return (ret == length) ? CONF_ERR_OK : CONF_EBADFILE;
+}
+
+static int conf_parse_entry(const u8 *hdr, int nlen, u32 offset, struct conf_entry *entry)
+{
+	entry->type = hdr[0] >> 5;
+	entry->data_offset = offset + 1 + nlen;
 
-	switch (*entry >> 5) {
+	switch (entry->type) {
 	case CONF_BIGARRAY:
-		memcpy(buffer, &entry[strlen(name)+3], len);
+		entry->length = (((s32)hdr[nlen+1] << 8) | hdr[nlen+2]) + 1;
+		entry->data_offset += 2;
 		break;
 	case CONF_SMALLARRAY:
-		memcpy(buffer, &entry[strlen(name)+2], len);
+		entry->length = (s32)hdr[nlen+1] + 1;
+		entry->data_offset += 1;
 		break;
 	case CONF_BYTE:
+		entry->length = 1;
+		break;
 	case CONF_SHORT:
+		entry->length = 2;
+		break;
 	case CONF_LONG:
+		entry->length = 4;
+		break;
 	case CONF_BOOL:
-		memset(buffer, 0, length);
-		memcpy(buffer, &entry[strlen(name)+1], len);
+		entry->length = 1;
 		break;
 	default:
 		return CONF_ENOTIMPL;
 	}
-	return len;
+
+	return CONF_ERR_OK;
 }
 
-int conf_set(u8 *conf, const char *name, const void *buffer, u32 length)
+static int conf_find(int fd, const char *name, struct conf_entry *entry)
 {
-	u8 *entry;
-	s32 len;
+	/* Item count followed by the offset table. SYSCONF has fewer items than this,
+	 * so the whole table comes with the count in a single read */
+	static u16 table[1 + CONF_OFFSETS_MAX] ATTRIBUTE_ALIGN(32);
+	/* File contents around the item headers being scanned. The items are stored in
+	 * the order of the table, so the headers of the small ones share a read */
+	static u8 window[CONF_WINDOW_SIZE] ATTRIBUTE_ALIGN(32);
+	u16 *offsets = &table[1];
+	int nlen = strlen(name);
+	/* Type and name length, name, and up to 2 bytes of array size */
+	u32 hdr_len = 1 + nlen + 2;
+	u32 window_start = 0, window_len = 0;
+	u32 count, num;
+	int ret;
 
-	entry = conf_find(conf, name);
-	if(!entry)
+	if (nlen > CONF_NAME_MAX)
 		return CONF_ENOENT;
 
-	len = conf_get_length(conf, name);
-	if (len < 0)
-		return len;
-	else if (len < length)
-		return CONF_ETOOBIG;
+	ret = conf_read_upto(fd, CONF_COUNT_OFFSET, table, sizeof(table));
+	if (ret < 0)
+		return ret;
+	else if (ret < sizeof(u16))
+		return CONF_EBADFILE;
+	count = be16toh(table[0]);
+	num = MIN2(count, CONF_OFFSETS_MAX);
+	if (ret < (1 + num) * sizeof(u16))
+		return CONF_EBADFILE;
 
-	switch (*entry >> 5) {
-	case CONF_BIGARRAY:
-		memcpy(&entry[strlen(name)+3], buffer, len);
-		break;
-	case CONF_SMALLARRAY:
-		memcpy(&entry[strlen(name)+2], buffer, len);
-		break;
-	case CONF_BYTE:
-	case CONF_SHORT:
-	case CONF_LONG:
-	case CONF_BOOL:
-		memcpy(&entry[strlen(name)+1], buffer, len);
-		break;
-	default:
-		return CONF_ENOTIMPL;
+	for (u32 i = 0; i < count; i += num) {
+		/* Only a table larger than ours is fetched a part at a time */
+		if (i > 0) {
+			num = MIN2(count - i, CONF_OFFSETS_MAX);
+			ret = conf_read_at(fd, CONF_OFFSETS_OFFSET + i * sizeof(u16), offsets,
+					   num * sizeof(u16));
+			if (ret < 0)
+				return ret;
+		}
+
+		for (u32 j = 0; j < num; j++) {
+			u32 offset = be16toh(offsets[j]);
+			const u8 *hdr;
+
+			if ((offset < window_start) || (offset + hdr_len > window_start + window_len)) {
+				ret = conf_read_upto(fd, offset, window, sizeof(window));
+				if (ret < 0)
+					return ret;
+				else if (ret < hdr_len)
+					return CONF_EBADFILE;
+				window_start = offset;
+				window_len = ret;
+			}
+
+			hdr = &window[offset - window_start];
+			if ((nlen == ((hdr[0] & 0x0F) + 1)) && !memcmp(name, &hdr[1], nlen))
+				return conf_parse_entry(hdr, nlen, offset, entry);
+		}
 	}
-	return len;
+
+	return CONF_ENOENT;
+}
+
+int conf_get(int fd, const char *name, void *buffer, u32 length)
+{
+	struct conf_entry entry;
+	int ret;
+
+	ret = conf_find(fd, name, &entry);
+	if (ret < 0)
+		return ret;
+	else if (entry.length > length)
+		return CONF_ETOOBIG;
+
+	/* Scalars are zero-extended to the size of the buffer */
+	if ((entry.type != CONF_BIGARRAY) && (entry.type != CONF_SMALLARRAY))
+		memset(buffer, 0, length);
+
+	ret = conf_read_at(fd, entry.data_offset, buffer, entry.length);
+	if (ret < 0)
+		return ret;
+
+	return entry.length;
+}
+
+int conf_set(int fd, const char *name, const void *buffer, u32 length)
+{
+	struct conf_entry entry;
+	int ret;
+
+	ret = conf_find(fd, name, &entry);
+	if (ret < 0)
+		return ret;
+	else if (entry.length < length)
+		return CONF_ETOOBIG;
+
+	ret = os_seek(fd, entry.data_offset, CONF_SEEK_SET);
+	if (ret < 0)
+		return ret;
+
+	ret = os_write(fd, (void *)buffer, entry.length);
+	if (ret < 0)
+		return ret;
+	else if (ret != entry.length)
+		return CONF_EBADFILE;
+
+	return entry.length;
 }
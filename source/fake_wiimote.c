@@ -1,5 +1,7 @@
 #include "button_map.h"
 #include "fake_wiimote.h"
+#include "fake_wiimote_mgr.h"
+#include "globals.h"
 #include "hci.h"
 #include "hci_state.h"
 #include "injmessage.h"
@@ -8,6 +10,10 @@
 #include "utils.h"
 #include "wiimote.h"
 
+/* Global variables */
+u32 g_read_replies_burst;
+u32 g_acl_frames_reassembled;
+
 /* Channel bookkeeping */
 
 static inline u16 generate_l2cap_channel_id(void)
@@ -59,47 +65,68 @@ static void l2cap_channel_info_setup(l2cap_channel_info_t *info, u16 psm, u16 lo
 
 /* HID reports */
 
-static int send_hid_data(u16 hci_con_handle, u16 dcid, u8 hid_type, const void *data, u32 size)
+/* HID packets are built in place: each layer only fills its own header and the
+ * report is written once, right after the headers, with the returned data pointer.
+ * The message must then be sent with inject_l2cap_packet_submit(). */
+
+static void *alloc_hid_data(u16 hci_con_handle, u16 dcid, u8 hid_type, u32 size, void **data)
 {
-	u8 buf[WIIMOTE_MAX_PAYLOAD];
+	u8 *buf;
+	void *msg;
 	assert(size <= (WIIMOTE_MAX_PAYLOAD - 1));
+	msg = inject_l2cap_packet_alloc(hci_con_handle, dcid, size + 1, (void **)&buf);
+	if (!msg)
+		return NULL;
 	buf[0] = hid_type;
-	memcpy(&buf[1], data, size);
-	return inject_l2cap_packet(hci_con_handle, dcid, buf, size + 1);
+	*data = &buf[1];
+	return msg;
 }
 
-static inline int send_hid_input_report(u16 hci_con_handle, u16 dcid, u8 report_id,
-					const void *data, u32 size)
+static inline void *alloc_hid_input_report(u16 hci_con_handle, u16 dcid, u8 report_id,
+					   u32 size, void **data)
 {
-	u8 buf[WIIMOTE_MAX_PAYLOAD - 1];
+	u8 *buf;
+	void *msg;
 	assert(size <= (WIIMOTE_MAX_PAYLOAD - 2));
+	msg = alloc_hid_data(hci_con_handle, dcid, (HID_TYPE_DATA << 4) | HID_PARAM_INPUT,
+			     size + 1, (void **)&buf);
+	if (!msg)
+		return NULL;
 	buf[0] = report_id;
-	memcpy(&buf[1], data, size);
-	return send_hid_data(hci_con_handle, dcid, (HID_TYPE_DATA << 4) | HID_PARAM_INPUT, buf, size + 1);
+	*data = &buf[1];
+	return msg;
 }
 
 static int wiimote_send_ack(const fake_wiimote_t *wiimote, u8 rpt_id, u8 error_code)
 {
-	struct wiimote_input_report_ack_t ack;
-	ack.buttons = wiimote->buttons;
-	ack.rpt_id = rpt_id;
-	ack.error_code = error_code;
-	return send_hid_input_report(wiimote->hci_con_handle, wiimote->psm_hid_intr_chn.remote_cid,
-				     INPUT_REPORT_ID_ACK, &ack, sizeof(ack));
+	struct wiimote_input_report_ack_t *ack;
+	void *msg = alloc_hid_input_report(wiimote->hot->hci_con_handle,
+					   wiimote->psm_hid_intr_chn.remote_cid,
+					   INPUT_REPORT_ID_ACK, sizeof(*ack), (void **)&ack);
+	if (!msg)
+		return IOS_ENOMEM;
+	ack->buttons = wiimote->hot->buttons;
+	ack->rpt_id = rpt_id;
+	ack->error_code = error_code;
+	return inject_l2cap_packet_submit(msg);
 }
 
 static int wiimote_send_input_report_status(const fake_wiimote_t *wiimote)
 {
-	struct wiimote_input_report_status_t status;
-	status.buttons = wiimote->buttons;
-	status.leds = wiimote->status.leds;
-	status.ir = wiimote->status.ir;
-	status.speaker = 0;
-	status.extension = wiimote->cur_extension != WIIMOTE_EXT_NONE;
-	status.battery_low = 0;
-	status.battery = 0xFF;
-	return send_hid_input_report(wiimote->hci_con_handle, wiimote->psm_hid_intr_chn.remote_cid,
-				     INPUT_REPORT_ID_STATUS, &status, sizeof(status));
+	struct wiimote_input_report_status_t *status;
+	void *msg = alloc_hid_input_report(wiimote->hot->hci_con_handle,
+					   wiimote->psm_hid_intr_chn.remote_cid,
+					   INPUT_REPORT_ID_STATUS, sizeof(*status), (void **)&status);
+	if (!msg)
+		return IOS_ENOMEM;
+	status->buttons = wiimote->hot->buttons;
+	status->leds = wiimote->status.leds;
+	status->ir = wiimote->status.ir;
+	status->speaker = 0;
+	status->extension = wiimote->cur_extension != WIIMOTE_EXT_NONE;
+	status->battery_low = 0;
+	status->battery = 0xFF;
+	return inject_l2cap_packet_submit(msg);
 }
 
 /* Disconnection helper functions */
@@ -175,9 +202,30 @@ static void eeprom_init(union wiimote_usable_eeprom_data_t *eeprom)
 	eeprom->accel_calibration_2[sizeof(eeprom->accel_calibration_2) - 1] = accel_checksum;
 }
 
-void fake_wiimote_init(fake_wiimote_t *wiimote, const bdaddr_t *bdaddr)
+static inline void fake_wiimote_set_work(fake_wiimote_t *wiimote, u8 work, bool pending)
+{
+	u8 old_work = wiimote->hot->work;
+
+	if (pending)
+		wiimote->hot->work |= work;
+	else
+		wiimote->hot->work &= ~work;
+
+	if (wiimote->hot->work != old_work)
+		periodic_timer_request_update();
+}
+
+/* Input reports can only be sent once the HID channels are open */
+static inline bool fake_wiimote_can_report_input(const fake_wiimote_t *wiimote)
 {
-	wiimote->active = false;
+	return fake_wiimote_is_connected(wiimote) && (wiimote->hot->acl_state != ACL_STATE_LINKING);
+}
+
+void fake_wiimote_init(fake_wiimote_t *wiimote, fake_wiimote_hot_t *hot, const bdaddr_t *bdaddr)
+{
+	wiimote->hot = hot;
+	wiimote->hot->active = false;
+	wiimote->hot->work = 0;
 	/* We can set it now, since it's permanent */
 	bacpy(&wiimote->bdaddr, bdaddr);
 }
@@ -191,6 +239,7 @@ static inline void fake_wiimote_reset_extension_state(fake_wiimote_t *wiimote)
 	memset(&wiimote->extension_regs, 0, sizeof(wiimote->extension_regs));
 	memset(&wiimote->extension_key, 0, sizeof(wiimote->extension_key));
 	wiimote->extension_key_dirty = true;
+	wiimote->report_dirty |= FAKE_WIIMOTE_REPORT_DIRTY_EXT;
 
 	switch (wiimote->cur_extension) {
 	case WIIMOTE_EXT_NUNCHUK:
@@ -237,33 +286,40 @@ static inline void fake_wiimote_reset_extension_state(fake_wiimote_t *wiimote)
 	}
 }
 
+static void fake_wiimote_set_reporting_mode(fake_wiimote_t *wiimote, u8 mode);
+
 void fake_wiimote_init_state(fake_wiimote_t *wiimote, input_device_t *input_device)
 {
-	wiimote->baseband_state = BASEBAND_STATE_REQUEST_CONNECTION;
-	wiimote->acl_state = L2CAP_CHANNEL_STATE_INACTIVE;
+	wiimote->hot->baseband_state = BASEBAND_STATE_REQUEST_CONNECTION;
+	wiimote->hot->acl_state = L2CAP_CHANNEL_STATE_INACTIVE;
 	wiimote->psm_sdp_chn.valid = false;
 	wiimote->psm_hid_cntl_chn.valid = false;
 	wiimote->psm_hid_intr_chn.valid = false;
-	wiimote->num_completed_acl_data_packets = 0;
+	wiimote->hot->num_completed_acl_data_packets = 0;
+	wiimote->acl_reassembly_len = 0;
 	wiimote->input_device = input_device;
 	wiimote->status.leds = 0;
 	wiimote->status.ir = 0;
 	wiimote->status.speaker = 0;
-	wiimote->buttons = 0;
-	wiimote->input_dirty = false;
+	wiimote->hot->buttons = 0;
+	wiimote->hot->input_dirty = false;
 	wiimote->acc_x = ACCEL_ZERO_G;
 	wiimote->acc_y = ACCEL_ZERO_G;
 	wiimote->acc_z = ACCEL_ONE_G;
 	wiimote->rumble_on = false;
 	memset(&wiimote->ir_regs, 0, sizeof(wiimote->ir_regs));
+	wiimote->report_dirty = FAKE_WIIMOTE_REPORT_DIRTY_ALL;
 	wiimote->ir_valid_dots = 0;
 	fake_wiimote_reset_extension_state(wiimote);
 	wiimote->cur_extension = WIIMOTE_EXT_NONE;
 	wiimote->new_extension = WIIMOTE_EXT_NONE;
 	eeprom_init(&wiimote->eeprom);
 	wiimote->read_request.size = 0;
-	wiimote->reporting_mode = INPUT_REPORT_ID_BTN;
-	wiimote->reporting_continuous = false;
+	fake_wiimote_set_reporting_mode(wiimote, INPUT_REPORT_ID_BTN);
+	wiimote->hot->reporting_continuous = false;
+	/* The only work of a newly assigned fake Wiimote is to request the connection */
+	wiimote->hot->work = FAKE_WIIMOTE_WORK_CON_REQ;
+	periodic_timer_request_update();
 }
 
 void fake_wiimote_handle_hci_cmd_accept_con(fake_wiimote_t *wiimote, u8 role)
@@ -277,25 +333,27 @@ void fake_wiimote_handle_hci_cmd_accept_con(fake_wiimote_t *wiimote, u8 role)
 	   event to be sent from the Host Controller when the Host Controller
 	   begins setting up the connection */
 	ret = inject_hci_event_command_status(HCI_CMD_ACCEPT_CON);
-	assert(ret == IOS_OK);
 
-	wiimote->baseband_state = BASEBAND_STATE_COMPLETE;
-	wiimote->hci_con_handle = hci_con_handle_virt_alloc();
-	LOG_DEBUG("Fake Wiimote got HCI con_handle: 0x%x\n",  wiimote->hci_con_handle);
+	wiimote->hot->baseband_state = BASEBAND_STATE_COMPLETE;
+	wiimote->hot->hci_con_handle = hci_con_handle_virt_alloc();
+	LOG_DEBUG("Fake Wiimote got HCI con_handle: 0x%x\n",  wiimote->hot->hci_con_handle);
 
 	/* We can start the ACL (L2CAP) linking now */
-	wiimote->acl_state = ACL_STATE_LINKING;
+	wiimote->hot->acl_state = ACL_STATE_LINKING;
+	fake_wiimote_set_work(wiimote, FAKE_WIIMOTE_WORK_LINKING, true);
 
-	if (role == HCI_ROLE_MASTER) {
+	if ((ret == IOS_OK) && (role == HCI_ROLE_MASTER))
 		ret = inject_hci_event_role_change(&wiimote->bdaddr, HCI_ROLE_MASTER);
-		assert(ret == IOS_OK);
-	}
 
 	/* In addition, when the Link Manager determines the connection is established,
 	 * the Host Controllers on both Bluetooth devices that form the connection
 	 * will send a Connection Complete event to each Host */
-	ret = inject_hci_event_con_compl(&wiimote->bdaddr, wiimote->hci_con_handle, 0);
-	assert(ret == IOS_OK);
+	if (ret == IOS_OK)
+		ret = inject_hci_event_con_compl(&wiimote->bdaddr, wiimote->hot->hci_con_handle, 0);
+
+	/* Only if the host has stopped reading HCI events */
+	if (ret != IOS_OK)
+		LOG_DEBUG("Couldn't inject the connection events: %d\n", ret);
 
 	LOG_DEBUG("Connection complete sent, starting ACL linking!\n");
 }
@@ -309,7 +367,9 @@ int fake_wiimote_disconnect(fake_wiimote_t *wiimote)
 {
 	int ret = 0;
 
-	wiimote->active = false;
+	wiimote->hot->active = false;
+	wiimote->hot->work = 0;
+	periodic_timer_request_update();
 
 	/* Unassign the currently assigned input device (if any) */
 	if (wiimote->input_device)
@@ -317,9 +377,11 @@ int fake_wiimote_disconnect(fake_wiimote_t *wiimote)
 
 	/* Does a real Wiimote gracefully disconnect l2cap channels first?
 	   Not doing that doesn't seem to break anything. */
-	if (wiimote->baseband_state == BASEBAND_STATE_COMPLETE) {
-		ret = inject_hci_event_discon_compl(wiimote->hci_con_handle,
+	if (wiimote->hot->baseband_state == BASEBAND_STATE_COMPLETE) {
+		ret = inject_hci_event_discon_compl(wiimote->hot->hci_con_handle,
 						    0, 0x13 /* User Ended Connection */);
+		hci_con_handle_virt_free(wiimote->hot->hci_con_handle);
+		wiimote->hot->baseband_state = BASEBAND_STATE_INACTIVE;
 	}
 
 	return ret;
@@ -328,29 +390,43 @@ int fake_wiimote_disconnect(fake_wiimote_t *wiimote)
 void fake_wiimote_set_extension(fake_wiimote_t *wiimote, enum wiimote_ext_e ext)
 {
 	wiimote->new_extension = ext;
+	fake_wiimote_set_work(wiimote, FAKE_WIIMOTE_WORK_EXT_CHANGE, ext != wiimote->cur_extension);
 }
 
 void fake_wiimote_report_input(fake_wiimote_t *wiimote, u16 buttons)
 {
-	bool btn_changed = (wiimote->buttons ^ buttons) != 0;
+	bool btn_changed = (wiimote->hot->buttons ^ buttons) != 0;
 
 	if (btn_changed) {
-		wiimote->buttons = buttons;
-		wiimote->input_dirty = true;
+		wiimote->hot->buttons = buttons;
+		wiimote->report_dirty |= FAKE_WIIMOTE_REPORT_DIRTY_BTN;
+		wiimote->hot->input_dirty = true;
+		/* While linking, the change is picked up once the HID channels are open */
+		fake_wiimote_set_work(wiimote, FAKE_WIIMOTE_WORK_INPUT,
+				      fake_wiimote_can_report_input(wiimote));
 	}
 }
 
 void fake_wiimote_report_accelerometer(fake_wiimote_t *wiimote, u16 acc_x, u16 acc_y, u16 acc_z)
 {
-	wiimote->acc_x = acc_x & 0x3FF;
-	wiimote->acc_y = acc_y & 0x3FF;
-	wiimote->acc_z = acc_z & 0x3FF;
+	acc_x &= 0x3FF;
+	acc_y &= 0x3FF;
+	acc_z &= 0x3FF;
+
+	if ((acc_x != wiimote->acc_x) || (acc_y != wiimote->acc_y) || (acc_z != wiimote->acc_z)) {
+		wiimote->acc_x = acc_x;
+		wiimote->acc_y = acc_y;
+		wiimote->acc_z = acc_z;
+		wiimote->report_dirty |= FAKE_WIIMOTE_REPORT_DIRTY_ACC;
+	}
 }
 
 void fake_wiimote_report_ir_dots(fake_wiimote_t *wiimote, struct ir_dot_t ir_dots[static IR_MAX_DOTS])
 {
-	u8 *ir_data = wiimote->ir_regs.camera_data;
+	u8 ir_data[sizeof(wiimote->ir_regs.camera_data)];
+	u32 size;
 
+	/* The camera bytes are built aside, the report only changes if they differ */
 	switch (wiimote->ir_regs.mode) {
 	case IR_MODE_BASIC:
 		ir_data[0] = ir_dots[0].x & 0xFF;
@@ -366,6 +442,7 @@ void fake_wiimote_report_ir_dots(fake_wiimote_t *wiimote, struct ir_dot_t ir_dot
 		ir_data[7] = 0xFF;
 		ir_data[8] = 0xFF;
 		ir_data[9] = 0xFF;
+		size = 10;
 		break;
 	case IR_MODE_EXTENDED:
 		ir_data[0] = ir_dots[0].x & 0xFF;
@@ -384,6 +461,7 @@ void fake_wiimote_report_ir_dots(fake_wiimote_t *wiimote, struct ir_dot_t ir_dot
 		ir_data[9] = 0xFF;
 		ir_data[10] = 0xFF;
 		ir_data[11] = 0xF0;
+		size = 12;
 		break;
 	case IR_MODE_FULL:
 		ir_data[0] = ir_dots[0].x & 0xFF;
@@ -409,26 +487,56 @@ void fake_wiimote_report_ir_dots(fake_wiimote_t *wiimote, struct ir_dot_t ir_dot
 		ir_data[16] = 0;
 		ir_data[17] = 0xFF;
 		memset(&ir_data[18], 0xFF, 2 * 9);
+		size = 36;
 		break;
 	default:
 		/* This seems to be fairly common, 0xff data is sent in this case */
-		memset(ir_data, 0xFF, sizeof(wiimote->ir_regs.camera_data));
+		memset(ir_data, 0xFF, sizeof(ir_data));
+		size = sizeof(ir_data);
 		break;
 	}
+
+	if (memcmp(wiimote->ir_regs.camera_data, ir_data, size) != 0) {
+		memcpy(wiimote->ir_regs.camera_data, ir_data, size);
+		wiimote->report_dirty |= FAKE_WIIMOTE_REPORT_DIRTY_IR;
+	}
+}
+
+static inline void extension_encrypted_update(fake_wiimote_t *wiimote, u16 address, u16 size)
+{
+	u8 *encrypted = &wiimote->extension_regs_encrypted[address];
+
+	/* The whole copy will be rebuilt with the new key */
+	if (wiimote->extension_key_dirty)
+		return;
+
+	memcpy(encrypted, (u8 *)&wiimote->extension_regs + address, size);
+	wiimote_crypto_encrypt(encrypted, &wiimote->extension_key, address, size);
 }
 
 void fake_wiimote_report_input_ext(fake_wiimote_t *wiimote, u16 buttons, const void *ext_data, u8 ext_size)
 {
 	u8 *ext_controller_data = wiimote->extension_regs.controller_data;
-	bool btn_changed = (wiimote->buttons ^ buttons) != 0;
+	bool btn_changed = (wiimote->hot->buttons ^ buttons) != 0;
 	int ext_cmp = memmismatch(ext_controller_data, ext_data, ext_size);
 
 	if (btn_changed || (ext_cmp != ext_size)) {
-		wiimote->buttons = buttons;
+		wiimote->hot->buttons = buttons;
 		/* If there are changes to the extension bytes, copy them */
-		if (ext_cmp != ext_size)
+		if (btn_changed)
+			wiimote->report_dirty |= FAKE_WIIMOTE_REPORT_DIRTY_BTN;
+		if (ext_cmp != ext_size) {
 			memcpy(ext_controller_data + ext_cmp, ext_data + ext_cmp, ext_size - ext_cmp);
-		wiimote->input_dirty = true;
+			extension_encrypted_update(wiimote,
+						   offsetof(struct wiimote_extension_registers_t,
+							    controller_data) + ext_cmp,
+						   ext_size - ext_cmp);
+			wiimote->report_dirty |= FAKE_WIIMOTE_REPORT_DIRTY_EXT;
+		}
+		wiimote->hot->input_dirty = true;
+		/* While linking, the change is picked up once the HID channels are open */
+		fake_wiimote_set_work(wiimote, FAKE_WIIMOTE_WORK_INPUT,
+				      fake_wiimote_can_report_input(wiimote));
 	}
 }
 
@@ -450,6 +558,7 @@ static inline bool ir_camera_write_data(fake_wiimote_t *wiimote, const void *src
 
 	/* Copy the requested data to the IR camera registers */
 	memcpy((u8 *)&wiimote->ir_regs + address, src, size);
+	wiimote->report_dirty |= FAKE_WIIMOTE_REPORT_DIRTY_IR;
 
 	return true;
 }
@@ -460,17 +569,22 @@ static bool extension_read_data(fake_wiimote_t *wiimote, void *dst, u16 address,
 		return false;
 
 	/* Copy the requested data from the extension registers */
-	memcpy(dst, (u8 *)&wiimote->extension_regs + address, size);
-
-	/* Encrypt data read from extension registers (if necessary) */
-	if (wiimote->extension_regs.encryption == ENCRYPTION_ENABLED) {
-		if (wiimote->extension_key_dirty) {
-			wiimote_crypto_generate_key_from_extension_key_data(&wiimote->extension_key,
-						wiimote->extension_regs.encryption_key_data);
-			wiimote->extension_key_dirty = false;
-		}
-		wiimote_crypto_encrypt(dst, &wiimote->extension_key, address, size);
+	if (wiimote->extension_regs.encryption != ENCRYPTION_ENABLED) {
+		memcpy(dst, (u8 *)&wiimote->extension_regs + address, size);
+		return true;
+	}
+
+	/* Or from their encrypted copy, which we might have to rebuild first */
+	if (wiimote->extension_key_dirty) {
+		wiimote_crypto_generate_key_from_extension_key_data(&wiimote->extension_key,
+					wiimote->extension_regs.encryption_key_data);
+		memcpy(wiimote->extension_regs_encrypted, &wiimote->extension_regs,
+		       sizeof(wiimote->extension_regs_encrypted));
+		wiimote_crypto_encrypt(wiimote->extension_regs_encrypted, &wiimote->extension_key,
+				       0, sizeof(wiimote->extension_regs_encrypted));
+		wiimote->extension_key_dirty = false;
 	}
+	memcpy(dst, &wiimote->extension_regs_encrypted[address], size);
 
 	return true;
 }
@@ -487,27 +601,37 @@ static bool extension_write_data(fake_wiimote_t *wiimote, const void *src, u16 a
 
 	/* Copy the requested data to the extension registers */
 	memcpy((u8 *)&wiimote->extension_regs + address, src, size);
+	extension_encrypted_update(wiimote, address, size);
+	/* The extension data or its encryption might have changed */
+	wiimote->report_dirty |= FAKE_WIIMOTE_REPORT_DIRTY_EXT;
 	return true;
 }
 
 static bool fake_wiimote_process_read_request(fake_wiimote_t *wiimote)
 {
-	struct wiimote_input_report_read_data_t reply;
+	struct wiimote_input_report_read_data_t *reply;
 	u8 error = ERROR_CODE_SUCCESS;
 	u16 address, read_size = MIN2(16, wiimote->read_request.size);
+	void *msg;
 
 	if (read_size == 0)
 		return false;
 
+	/* If we can't allocate the reply, we will try again on the next tick */
+	msg = alloc_hid_input_report(wiimote->hot->hci_con_handle, wiimote->psm_hid_intr_chn.remote_cid,
+				     INPUT_REPORT_ID_READ_DATA_REPLY, sizeof(*reply), (void **)&reply);
+	if (!msg)
+		return false;
+
 	address = wiimote->read_request.address;
-	memset(&reply.data, 0, sizeof(reply.data));
+	memset(&reply->data, 0, sizeof(reply->data));
 
 	switch (wiimote->read_request.space) {
 	case ADDRESS_SPACE_EEPROM:
 		if (address + wiimote->read_request.size > EEPROM_FREE_SIZE)
 			error = ERROR_CODE_INVALID_ADDRESS;
 		else
-			memcpy(reply.data, &wiimote->eeprom.data[address], read_size);
+			memcpy(reply->data, &wiimote->eeprom.data[address], read_size);
 		break;
 	case ADDRESS_SPACE_I2C_BUS:
 	case ADDRESS_SPACE_I2C_BUS_ALT:
@@ -515,10 +639,10 @@ static bool fake_wiimote_process_read_request(fake_wiimote_t *wiimote)
 		if (wiimote->read_request.slave_address == EEPROM_I2C_ADDR) {
 			error = ERROR_CODE_INVALID_ADDRESS;
 		} else if (wiimote->read_request.slave_address == EXTENSION_I2C_ADDR) {
-			if (!extension_read_data(wiimote, reply.data, address, read_size))
+			if (!extension_read_data(wiimote, reply->data, address, read_size))
 				error = ERROR_CODE_NACK;
 		} else if (wiimote->read_request.slave_address == CAMERA_I2C_ADDR) {
-			if (!ir_camera_read_data(wiimote, reply.data, address, read_size))
+			if (!ir_camera_read_data(wiimote, reply->data, address, read_size))
 				error = ERROR_CODE_NACK;
 		}
 		break;
@@ -536,13 +660,48 @@ static bool fake_wiimote_process_read_request(fake_wiimote_t *wiimote)
 		wiimote->read_request.address += read_size;
 		wiimote->read_request.size -= read_size;
 	}
+	fake_wiimote_set_work(wiimote, FAKE_WIIMOTE_WORK_READ_REQ, wiimote->read_request.size > 0);
+
+	reply->buttons = wiimote->hot->buttons;
+	reply->size_minus_one = read_size - 1;
+	reply->error = error;
+	reply->address = address;
+	inject_l2cap_packet_submit(msg);
+	return true;
+}
+
+/* Sends up to READ_REPLY_BURST_MAX read replies at once. A burst only takes the host
+ * buffers already waiting on the PendingQ (so the replies never queue up in the ReadyQ),
+ * split evenly with the other connected fake Wiimotes so their input reports get
+ * buffers too, and no more ACL packets than the host said it can take. The replies are
+ * still delivered in order, and no input report is sent until the read is done */
+#define READ_REPLY_BURST_MAX		8
+
+static u32 fake_wiimote_read_reply_burst_size(void)
+{
+	u32 burst = usb_bulk_in_pending_msgs() / MAX2(fake_wiimote_mgr_num_connected(), 1);
+	u16 host_num_acl_pkts = hci_state_get_host_num_acl_pkts();
+
+	if (host_num_acl_pkts)
+		burst = MIN2(burst, host_num_acl_pkts);
+
+	/* Without host buffers, still send one reply (it gets deferred), like a plain tick would */
+	return MIN2(MAX2(burst, 1), READ_REPLY_BURST_MAX);
+}
+
+static bool fake_wiimote_process_read_request_burst(fake_wiimote_t *wiimote)
+{
+	u32 burst = fake_wiimote_read_reply_burst_size();
+
+	if (!fake_wiimote_process_read_request(wiimote))
+		return false;
+
+	while ((--burst > 0) && (wiimote->read_request.size > 0)) {
+		if (!fake_wiimote_process_read_request(wiimote))
+			break;
+		g_read_replies_burst++;
+	}
 
-	reply.buttons = wiimote->buttons;
-	reply.size_minus_one = read_size - 1;
-	reply.error = error;
-	reply.address = address;
-	send_hid_input_report(wiimote->hci_con_handle, wiimote->psm_hid_intr_chn.remote_cid,
-			      INPUT_REPORT_ID_READ_DATA_REPLY, &reply, sizeof(reply));
 	return true;
 }
 
@@ -592,7 +751,7 @@ static inline bool fake_wiimote_process_extension_change(fake_wiimote_t *wiimote
 
 	/* Following a connection or disconnection event on the Extension Port, data reporting
 	 * is disabled and the Data Reporting Mode must be reset before new data can arrive */
-	wiimote->reporting_mode = INPUT_REPORT_ID_REPORT_DISABLED;
+	fake_wiimote_set_reporting_mode(wiimote, INPUT_REPORT_ID_REPORT_DISABLED);
 
 	if (wiimote->cur_extension == WIIMOTE_EXT_NONE) {
 		/* Extension connect */
@@ -602,6 +761,8 @@ static inline bool fake_wiimote_process_extension_change(fake_wiimote_t *wiimote
 		   The next call will change to the new extension if needed. */
 		wiimote->cur_extension = WIIMOTE_EXT_NONE;
 	}
+	fake_wiimote_set_work(wiimote, FAKE_WIIMOTE_WORK_EXT_CHANGE,
+			      wiimote->new_extension != wiimote->cur_extension);
 
 	fake_wiimote_reset_extension_state(wiimote);
 	wiimote_send_input_report_status(wiimote);
@@ -609,57 +770,137 @@ static inline bool fake_wiimote_process_extension_change(fake_wiimote_t *wiimote
 	return true;
 }
 
-static void fake_wiimote_send_data_report(fake_wiimote_t *wiimote)
+/* Data report builders. Each one is specialized for a reporting mode,
+ * so that the layout of the report is known at compile time */
+
+static inline void build_data_report(fake_wiimote_t *wiimote, u8 *report_data,
+				     const struct input_report_layout_t *layout)
 {
-	u8 report_data[CONTROLLER_DATA_BYTES] ATTRIBUTE_ALIGN(4);
+	u8 *last = wiimote->last_report;
+	u8 dirty = wiimote->report_dirty;
 	u16 buttons;
-	bool has_btn;
-	u8 acc_size, acc_offset;
-	u8 ext_size, ext_offset;
-	u8 ir_size, ir_offset;
-	u8 report_size;
 
-	if (wiimote->reporting_mode == INPUT_REPORT_ID_REPORT_DISABLED) {
-		/* The wiimote is in this disabled state after an extension change.
-		   Input reports are not sent, even on button change. */
-		return;
+	if (layout->acc_size && (dirty & FAKE_WIIMOTE_REPORT_DIRTY_ACC)) {
+		last[layout->acc_offset + 0] = (wiimote->acc_x >> 2) & 0xFF;
+		last[layout->acc_offset + 1] = (wiimote->acc_y >> 2) & 0xFF;
+		last[layout->acc_offset + 2] = (wiimote->acc_z >> 2) & 0xFF;
+		/* The LSBs are stored in the buttons */
+		dirty |= FAKE_WIIMOTE_REPORT_DIRTY_BTN;
+	}
+
+	if (layout->ir_size && (dirty & FAKE_WIIMOTE_REPORT_DIRTY_IR))
+		memcpy(&last[layout->ir_offset], wiimote->ir_regs.camera_data, layout->ir_size);
+
+	if (layout->ext_size && (dirty & FAKE_WIIMOTE_REPORT_DIRTY_EXT)) {
+		/* Takes care of encrypting the extension data if necessary */
+		extension_read_data(wiimote, last + layout->ext_offset, 0, layout->ext_size);
 	}
 
-	if (wiimote->reporting_continuous || wiimote->input_dirty) {
-		buttons = wiimote->buttons;
-		has_btn = input_report_has_btn(wiimote->reporting_mode);
-		acc_size = input_report_acc_size(wiimote->reporting_mode);
-		acc_offset = input_report_acc_offset(wiimote->reporting_mode);
-		ext_size = input_report_ext_size(wiimote->reporting_mode);
-		ext_offset = input_report_ext_offset(wiimote->reporting_mode);
-		ir_size = input_report_ir_size(wiimote->reporting_mode);
-		ir_offset = input_report_ir_offset(wiimote->reporting_mode);
-		report_size = (has_btn ? 2 : 0) + acc_size + ext_size + ir_size;
-
-		if (acc_size) {
-			report_data[acc_offset + 0] = (wiimote->acc_x >> 2) & 0xFF;
-			report_data[acc_offset + 1] = (wiimote->acc_y >> 2) & 0xFF;
-			report_data[acc_offset + 2] = (wiimote->acc_z >> 2) & 0xFF;
+	if (layout->has_btn && (dirty & FAKE_WIIMOTE_REPORT_DIRTY_BTN)) {
+		buttons = wiimote->hot->buttons;
+		if (layout->acc_size) {
 			buttons |= ((wiimote->acc_x & 3) << 13) |
 				   ((wiimote->acc_y & 2) << 4)  |
 				   ((wiimote->acc_z & 2) << 5);
 		}
+		memcpy(last, &buttons, sizeof(buttons));
+	}
 
-		if (ir_size)
-			memcpy(&report_data[ir_offset], wiimote->ir_regs.camera_data, ir_size);
+	wiimote->report_dirty = 0;
+	memcpy(report_data, last, layout->size);
+}
 
-		if (ext_size) {
-			/* Takes care of encrypting the extension data if necessary */
-			extension_read_data(wiimote, report_data + ext_offset, 0, ext_size);
-		}
+#define DEFINE_DATA_REPORT_BUILDER(name)						\
+	static void build_data_report_##name(fake_wiimote_t *wiimote, u8 *report_data)	\
+	{										\
+		build_data_report(wiimote, report_data,					\
+				  &input_report_layouts[INPUT_REPORT_ID_##name -	\
+							INPUT_REPORT_ID_BTN]);		\
+	}
+
+DEFINE_DATA_REPORT_BUILDER(BTN)
+DEFINE_DATA_REPORT_BUILDER(BTN_ACC)
+DEFINE_DATA_REPORT_BUILDER(BTN_EXP8)
+DEFINE_DATA_REPORT_BUILDER(BTN_ACC_IR)
+DEFINE_DATA_REPORT_BUILDER(BTN_EXP19)
+DEFINE_DATA_REPORT_BUILDER(BTN_ACC_EXP)
+DEFINE_DATA_REPORT_BUILDER(BTN_IR_EXP)
+DEFINE_DATA_REPORT_BUILDER(BTN_ACC_IR_EXP)
+DEFINE_DATA_REPORT_BUILDER(EXP21)
+
+static void (*const data_report_builders[])(fake_wiimote_t *wiimote, u8 *report_data) = {
+	[INPUT_REPORT_ID_BTN - INPUT_REPORT_ID_BTN] = build_data_report_BTN,
+	[INPUT_REPORT_ID_BTN_ACC - INPUT_REPORT_ID_BTN] = build_data_report_BTN_ACC,
+	[INPUT_REPORT_ID_BTN_EXP8 - INPUT_REPORT_ID_BTN] = build_data_report_BTN_EXP8,
+	[INPUT_REPORT_ID_BTN_ACC_IR - INPUT_REPORT_ID_BTN] = build_data_report_BTN_ACC_IR,
+	[INPUT_REPORT_ID_BTN_EXP19 - INPUT_REPORT_ID_BTN] = build_data_report_BTN_EXP19,
+	[INPUT_REPORT_ID_BTN_ACC_EXP - INPUT_REPORT_ID_BTN] = build_data_report_BTN_ACC_EXP,
+	[INPUT_REPORT_ID_BTN_IR_EXP - INPUT_REPORT_ID_BTN] = build_data_report_BTN_IR_EXP,
+	[INPUT_REPORT_ID_BTN_ACC_IR_EXP - INPUT_REPORT_ID_BTN] = build_data_report_BTN_ACC_IR_EXP,
+	[INPUT_REPORT_ID_EXP21 - INPUT_REPORT_ID_BTN] = build_data_report_EXP21,
+};
+static_assert(ARRAY_SIZE(data_report_builders) <= ARRAY_SIZE(input_report_layouts));
+
+static void fake_wiimote_set_reporting_mode(fake_wiimote_t *wiimote, u8 mode)
+{
+	const struct input_report_layout_t *layout = input_report_layout(mode);
+	u8 index = mode - INPUT_REPORT_ID_BTN;
+
+	wiimote->hot->reporting_mode = mode;
+	wiimote->report_size = layout->size;
+	wiimote->report_sections = (layout->has_btn ? FAKE_WIIMOTE_REPORT_DIRTY_BTN : 0) |
+				   (layout->acc_size ? FAKE_WIIMOTE_REPORT_DIRTY_ACC : 0) |
+				   (layout->ir_size ? FAKE_WIIMOTE_REPORT_DIRTY_IR : 0) |
+				   (layout->ext_size ? FAKE_WIIMOTE_REPORT_DIRTY_EXT : 0);
+	/* The layout of the last report changes */
+	wiimote->report_dirty = FAKE_WIIMOTE_REPORT_DIRTY_ALL;
+
+	/* The modes without a builder only carry the buttons */
+	if ((index < ARRAY_SIZE(data_report_builders)) && data_report_builders[index])
+		wiimote->build_report = data_report_builders[index];
+	else
+		wiimote->build_report = build_data_report_BTN;
+}
 
-		if (has_btn)
-			memcpy(report_data, &buttons, sizeof(buttons));
+static void fake_wiimote_send_data_report(fake_wiimote_t *wiimote)
+{
+	u8 *report_data;
+	void *msg;
 
-		send_hid_input_report(wiimote->hci_con_handle, wiimote->psm_hid_intr_chn.remote_cid,
-				      wiimote->reporting_mode, report_data, report_size);
+	if (wiimote->hot->reporting_mode == INPUT_REPORT_ID_REPORT_DISABLED) {
+		/* The wiimote is in this disabled state after an extension change.
+		   Input reports are not sent, even on button change. */
+		return;
+	}
 
-		wiimote->input_dirty = false;
+	/* In non-continuous mode, there's nothing to send if the report hasn't changed */
+	if (!wiimote->hot->reporting_continuous &&
+	    !(wiimote->report_dirty & wiimote->report_sections)) {
+		wiimote->hot->input_dirty = false;
+		fake_wiimote_set_work(wiimote, FAKE_WIIMOTE_WORK_INPUT, false);
+		return;
+	}
+
+	if (wiimote->hot->reporting_continuous || wiimote->hot->input_dirty) {
+		/* Keep the report dirty if we can't allocate it, we will try again later */
+		msg = alloc_hid_input_report(wiimote->hot->hci_con_handle,
+					     wiimote->psm_hid_intr_chn.remote_cid,
+					     wiimote->hot->reporting_mode, wiimote->report_size,
+					     (void **)&report_data);
+		if (!msg)
+			return;
+
+		wiimote->build_report(wiimote, report_data);
+
+		/* It's only refused if the ReadyQ is full of messages that can't be dropped.
+		 * Keep it dirty to send it again once the host has caught up */
+		if (inject_l2cap_packet_submit(msg) != IOS_OK) {
+			wiimote->report_dirty = FAKE_WIIMOTE_REPORT_DIRTY_ALL;
+			return;
+		}
+
+		wiimote->hot->input_dirty = false;
+		fake_wiimote_set_work(wiimote, FAKE_WIIMOTE_WORK_INPUT, false);
 	}
 }
 
@@ -689,49 +930,60 @@ void fake_wiimote_tick(fake_wiimote_t *wiimote)
 {
 	int ret;
 
-	if (wiimote->baseband_state == BASEBAND_STATE_REQUEST_CONNECTION) {
+	if (wiimote->hot->baseband_state == BASEBAND_STATE_REQUEST_CONNECTION) {
 		if (hci_can_request_connection()) {
 			ret = inject_hci_event_con_req(&wiimote->bdaddr, WIIMOTE_HCI_CLASS_0,
 						       WIIMOTE_HCI_CLASS_1, WIIMOTE_HCI_CLASS_2,
 						       HCI_LINK_ACL);
 			/* After a connection request is visible to the controller switch to inactive */
-			if (ret == IOS_OK)
-				wiimote->baseband_state = BASEBAND_STATE_INACTIVE;
+			if (ret == IOS_OK) {
+				wiimote->hot->baseband_state = BASEBAND_STATE_INACTIVE;
+				fake_wiimote_set_work(wiimote, FAKE_WIIMOTE_WORK_CON_REQ, false);
+			}
 		}
-	} else if (wiimote->baseband_state == BASEBAND_STATE_COMPLETE) {
+	} else if (wiimote->hot->baseband_state == BASEBAND_STATE_COMPLETE) {
 		/* "If the connection originated from the device (Wiimote) it will create
 		 * HID control and interrupt channels (in that order)." */
-		if (wiimote->acl_state == ACL_STATE_LINKING) {
+		if (wiimote->hot->acl_state == ACL_STATE_LINKING) {
 			bool hid_cntl_chn_complete = l2cap_channel_is_complete(&wiimote->psm_hid_cntl_chn);
 
 			/* If-else-if cascade to avoid sending too many packets on the same "tick" */
 			if (!wiimote->psm_hid_cntl_chn.valid) {
 				u16 local_cid = generate_l2cap_channel_id();
-				ret = inject_l2cap_connect_req(wiimote->hci_con_handle, L2CAP_PSM_HID_CNTL,
+				ret = inject_l2cap_connect_req(wiimote->hot->hci_con_handle, L2CAP_PSM_HID_CNTL,
 							       local_cid);
-				assert(ret == IOS_OK);
-				l2cap_channel_info_setup(&wiimote->psm_hid_cntl_chn, L2CAP_PSM_HID_CNTL, local_cid);
-				LOG_DEBUG("Generated local CID for HID CNTL: 0x%x\n", local_cid);
+				/* If the ReadyQ is full, we will try again on the next tick */
+				if (ret == IOS_OK) {
+					l2cap_channel_info_setup(&wiimote->psm_hid_cntl_chn, L2CAP_PSM_HID_CNTL,
+								 local_cid);
+					LOG_DEBUG("Generated local CID for HID CNTL: 0x%x\n", local_cid);
+				}
 			} else if (hid_cntl_chn_complete && !wiimote->psm_hid_intr_chn.valid) {
 				u16 local_cid = generate_l2cap_channel_id();
-				ret = inject_l2cap_connect_req(wiimote->hci_con_handle, L2CAP_PSM_HID_INTR,
+				ret = inject_l2cap_connect_req(wiimote->hot->hci_con_handle, L2CAP_PSM_HID_INTR,
 							       local_cid);
-				assert(ret == IOS_OK);
-				l2cap_channel_info_setup(&wiimote->psm_hid_intr_chn, L2CAP_PSM_HID_INTR, local_cid);
-				LOG_DEBUG("Generated local CID for HID INTR: 0x%x\n", local_cid);
+				if (ret == IOS_OK) {
+					l2cap_channel_info_setup(&wiimote->psm_hid_intr_chn, L2CAP_PSM_HID_INTR,
+								 local_cid);
+					LOG_DEBUG("Generated local CID for HID INTR: 0x%x\n", local_cid);
+				}
 			} else if (hid_cntl_chn_complete &&
 				   l2cap_channel_is_complete(&wiimote->psm_hid_intr_chn)) {
-				wiimote->acl_state = ACL_STATE_INACTIVE;
+				wiimote->hot->acl_state = ACL_STATE_INACTIVE;
+				fake_wiimote_set_work(wiimote, FAKE_WIIMOTE_WORK_LINKING, false);
+				/* Input that changed while linking can be reported now */
+				fake_wiimote_set_work(wiimote, FAKE_WIIMOTE_WORK_INPUT,
+						      wiimote->hot->input_dirty);
 				/* Call resume() input device callback */
 				input_device_resume(wiimote->input_device);
 				return;
 			}
 			/* Send configuration for any newly connected channels. */
-			check_send_config_for_new_channel(wiimote->hci_con_handle, &wiimote->psm_hid_cntl_chn);
-			check_send_config_for_new_channel(wiimote->hci_con_handle, &wiimote->psm_hid_intr_chn);
+			check_send_config_for_new_channel(wiimote->hot->hci_con_handle, &wiimote->psm_hid_cntl_chn);
+			check_send_config_for_new_channel(wiimote->hot->hci_con_handle, &wiimote->psm_hid_intr_chn);
 		} else {
 			/* Both HID ctrl and intr channels are connected (we only need intr though) */
-			if (fake_wiimote_process_read_request(wiimote)) {
+			if (fake_wiimote_process_read_request_burst(wiimote)) {
 				/* Read requests suppress normal input reports.
 				 * Don't send any other reports */
 				return;
@@ -742,12 +994,54 @@ void fake_wiimote_tick(fake_wiimote_t *wiimote)
 				return;
 			}
 
-			if (input_device_report_input(wiimote->input_device))
+			/* Non-continuous reports are sent from the input event handler. We only
+			 * have to flush input changes that arrived while we couldn't send them */
+			if (wiimote->hot->reporting_continuous) {
+				if (input_device_report_input(wiimote->input_device))
+					fake_wiimote_send_data_report(wiimote);
+			} else if (wiimote->hot->input_dirty) {
 				fake_wiimote_send_data_report(wiimote);
+			}
 		}
 	}
 }
 
+bool fake_wiimote_needs_tick(const fake_wiimote_t *wiimote)
+{
+	const fake_wiimote_hot_t *hot = wiimote->hot;
+
+	/* The manager has to report the completed packets, even if they are coalesced */
+	if (hot->num_completed_acl_data_packets > 0)
+		return true;
+
+	if (!fake_wiimote_hot_has_work(hot))
+		return false;
+
+	/* The connection request has to wait until the host allows it */
+	if (hot->work == FAKE_WIIMOTE_WORK_CON_REQ)
+		return hci_can_request_connection();
+
+	return true;
+}
+
+void fake_wiimote_handle_input_event(fake_wiimote_t *wiimote)
+{
+	if (!fake_wiimote_can_report_input(wiimote))
+		return;
+
+	if (!input_device_report_input(wiimote->input_device))
+		return;
+
+	/* Read requests and extension port events suppress input reports.
+	 * The pending input changes will be sent on a later tick */
+	if (wiimote->read_request.size || (wiimote->new_extension != wiimote->cur_extension))
+		return;
+
+	/* Send the report right away, without waiting for the next tick */
+	if (wiimote->hot->input_dirty)
+		fake_wiimote_send_data_report(wiimote);
+}
+
 static void handle_l2cap_config_req(fake_wiimote_t *wiimote, u8 ident, u16 dcid, u16 flags,
 				    const u8 *options, u16 options_size)
 {
@@ -792,7 +1086,7 @@ static void handle_l2cap_config_req(fake_wiimote_t *wiimote, u8 ident, u16 dcid,
 	info->remote_mtu = remote_mtu;
 
 	/* Send Respone (with the same options as received) */
-	inject_l2cap_config_rsp(wiimote->hci_con_handle, info->remote_cid, ident, options, options_size);
+	inject_l2cap_config_rsp(wiimote->hot->hci_con_handle, info->remote_cid, ident, options, options_size);
 }
 
 static void handle_l2cap_signal_channel(fake_wiimote_t *wiimote, u8 code, u8 ident,
@@ -878,7 +1172,7 @@ static void handle_l2cap_signal_channel(fake_wiimote_t *wiimote, u8 code, u8 ide
 		info->valid = false;
 
 		/* Send disconnect response */
-		inject_l2cap_disconnect_rsp(wiimote->hci_con_handle, ident, dcid, scid);
+		inject_l2cap_disconnect_rsp(wiimote->hot->hci_con_handle, ident, dcid, scid);
 		break;
 	}
 	}
@@ -931,8 +1225,9 @@ static void handle_hid_intr_data_output(fake_wiimote_t *wiimote, const u8 *data,
 		struct wiimote_output_report_mode_t *mode = (void *)&data[1];
 		LOG_DEBUG("  Report mode: 0x%02x, cont: %d, rumble: %d, ack: %d\n",
 			mode->mode, mode->continuous, mode->rumble, mode->ack);
-		wiimote->reporting_mode = mode->mode;
-		wiimote->reporting_continuous = mode->continuous;
+		fake_wiimote_set_reporting_mode(wiimote, mode->mode);
+		wiimote->hot->reporting_continuous = mode->continuous;
+		fake_wiimote_set_work(wiimote, FAKE_WIIMOTE_WORK_CONTINUOUS, mode->continuous);
 		if (mode->ack)
 			wiimote_send_ack(wiimote, OUTPUT_REPORT_ID_REPORT_MODE, ERROR_CODE_SUCCESS);
 		break;
@@ -979,10 +1274,11 @@ static void handle_hid_intr_data_output(fake_wiimote_t *wiimote, const u8 *data,
 		wiimote->read_request.address = read->address;
 		/* A zero size request is just ignored, like on the real wiimote */
 		wiimote->read_request.size = read->size;
+		fake_wiimote_set_work(wiimote, FAKE_WIIMOTE_WORK_READ_REQ, read->size > 0);
 
-		/* Send first "read-data reply". If more data needs to be sent,
+		/* Send the first "read-data reply" burst. If more data needs to be sent,
 		 * it will happen on the next "tick()" */
-		fake_wiimote_process_read_request(wiimote);
+		fake_wiimote_process_read_request_burst(wiimote);
 	}
 	case OUTPUT_REPORT_ID_SPEAKER_DATA:
 		/* TODO */
@@ -1007,18 +1303,11 @@ static void handle_hid_intr_data_output(fake_wiimote_t *wiimote, const u8 *data,
 	}
 }
 
-void fake_wiimote_handle_acl_data_out_request_from_host(fake_wiimote_t *wiimote,
-							const hci_acldata_hdr_t *acl)
+static void handle_l2cap_frame(fake_wiimote_t *wiimote, const l2cap_hdr_t *header)
 {
-	const l2cap_hdr_t *header;
 	u16 dcid, length;
 	const u8 *payload;
 
-	/* Increase the number of completed HCI ACL Data packets */
-	wiimote->num_completed_acl_data_packets++;
-
-	/* L2CAP header */
-	header  = (const void *)((u8 *)acl + sizeof(hci_acldata_hdr_t));
 	length  = le16toh(header->length);
 	dcid    = le16toh(header->dcid);
 	payload = (u8 *)header + sizeof(l2cap_hdr_t);
@@ -1049,3 +1338,60 @@ void fake_wiimote_handle_acl_data_out_request_from_host(fake_wiimote_t *wiimote,
 		}
 	}
 }
+
+static inline u32 get_l2cap_frame_size(const void *frame, u32 size)
+{
+	/* We need the header to know the frame size */
+	if (size < sizeof(l2cap_hdr_t))
+		return sizeof(l2cap_hdr_t);
+
+	return sizeof(l2cap_hdr_t) + le16toh(((const l2cap_hdr_t *)frame)->length);
+}
+
+void fake_wiimote_handle_acl_data_out_request_from_host(fake_wiimote_t *wiimote,
+							const hci_acldata_hdr_t *acl)
+{
+	u16 pb = HCI_PB_FLAG(le16toh(acl->con_handle));
+	u16 size = le16toh(acl->length);
+	const u8 *data = (u8 *)acl + sizeof(hci_acldata_hdr_t);
+	u32 frame_size;
+
+	/* Increase the number of completed HCI ACL Data packets */
+	if (wiimote->hot->num_completed_acl_data_packets++ == 0)
+		periodic_timer_request_update();
+
+	if (pb != HCI_PACKET_FRAGMENT) {
+		if (wiimote->acl_reassembly_len != 0) {
+			LOG_DEBUG("Incomplete L2CAP frame dropped (%d bytes)\n",
+				  wiimote->acl_reassembly_len);
+			wiimote->acl_reassembly_len = 0;
+		}
+
+		/* Complete frames (the usual case) are handled in place */
+		frame_size = get_l2cap_frame_size(data, size);
+		if (size >= frame_size) {
+			handle_l2cap_frame(wiimote, (const void *)data);
+			return;
+		}
+	} else if (wiimote->acl_reassembly_len == 0) {
+		LOG_DEBUG("Unexpected ACL continuation fragment dropped\n");
+		return;
+	}
+
+	/* Append the fragment to the frame being reassembled */
+	if ((wiimote->acl_reassembly_len + size) > sizeof(wiimote->acl_reassembly_buf)) {
+		LOG_DEBUG("L2CAP frame too large, dropped\n");
+		wiimote->acl_reassembly_len = 0;
+		return;
+	}
+	memcpy(&wiimote->acl_reassembly_buf[wiimote->acl_reassembly_len], data, size);
+	wiimote->acl_reassembly_len += size;
+
+	frame_size = get_l2cap_frame_size(wiimote->acl_reassembly_buf, wiimote->acl_reassembly_len);
+	if (wiimote->acl_reassembly_len < frame_size)
+		return;
+
+	wiimote->acl_reassembly_len = 0;
+	g_acl_frames_reassembled++;
+	handle_l2cap_frame(wiimote, (const void *)wiimote->acl_reassembly_buf);
+}
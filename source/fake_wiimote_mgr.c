@@ -1,5 +1,6 @@
 #include <string.h>
 #include "fake_wiimote_mgr.h"
+#include "globals.h"
 #include "hci.h"
 #include "hci_state.h"
 #include "injmessage.h"
@@ -8,13 +9,37 @@
 #include "wiimote.h"
 
 static fake_wiimote_t fake_wiimotes[MAX_FAKE_WIIMOTES];
+/* Per-tick state of each fake Wiimote, contiguous so that polling them is cheap */
+static fake_wiimote_hot_t fake_wiimotes_hot[MAX_FAKE_WIIMOTES] ATTRIBUTE_ALIGN(32);
+/* Fake Wiimote that got each handle of the reserved range. Entries are only valid while
+ * the fake Wiimote is connected with that handle */
+static fake_wiimote_t *fake_wiimote_for_con_handle[HCI_RESERVED_CON_HANDLE_COUNT];
+
+/* Global variables */
+u32 g_fake_wiimote_tick_visits;
+u32 g_fake_wiimote_last_tick_visits;
+u32 g_num_compl_pkts_piggybacked;
 
 void fake_wiimote_mgr_init(void)
 {
 	for (int i = 0; i < MAX_FAKE_WIIMOTES; i++)
-		fake_wiimote_init(&fake_wiimotes[i], &FAKE_WIIMOTE_BDADDR(i));
+		fake_wiimote_init(&fake_wiimotes[i], &fake_wiimotes_hot[i], &FAKE_WIIMOTE_BDADDR(i));
 }
 
+/* Completed packets are reported in a single event once the oldest one has waited
+ * NUM_COMPL_PKTS_COALESCE_TICKS ticks, or as soon as NUM_COMPL_PKTS_COALESCE_THRESHOLD
+ * of them are pending (the host can't send more ACL data until they are reported).
+ * In the meantime they are also piggybacked on the controller's own events */
+#ifndef NUM_COMPL_PKTS_COALESCE_TICKS
+#define NUM_COMPL_PKTS_COALESCE_TICKS		2
+#endif
+#ifndef NUM_COMPL_PKTS_COALESCE_THRESHOLD
+#define NUM_COMPL_PKTS_COALESCE_THRESHOLD	4
+#endif
+
+/* Ticks since the oldest unreported completed packet */
+static u32 num_compl_pkts_age;
+
 static inline void fake_wiimote_mgr_send_event_number_of_completed_packets(void)
 {
 	u16 con_handles[MAX_FAKE_WIIMOTES];
@@ -23,20 +48,59 @@ static inline void fake_wiimote_mgr_send_event_number_of_completed_packets(void)
 	u8 num_con_handles = 0;
 
 	for (int i = 0; i < MAX_FAKE_WIIMOTES; i++) {
-		if (fake_wiimote_is_connected(&fake_wiimotes[i])) {
-			con_handles[num_con_handles] = fake_wiimotes[i].hci_con_handle;
-			compl_pkts[num_con_handles] = fake_wiimotes[i].num_completed_acl_data_packets;
+		fake_wiimote_hot_t *hot = &fake_wiimotes_hot[i];
+
+		if (fake_wiimote_hot_is_connected(hot) && (hot->num_completed_acl_data_packets > 0)) {
+			con_handles[num_con_handles] = hot->hci_con_handle;
+			compl_pkts[num_con_handles] = hot->num_completed_acl_data_packets;
 			/* Accumulate completed packets count */
-			total += fake_wiimotes[i].num_completed_acl_data_packets;
-			/* Reset count */
-			fake_wiimotes[i].num_completed_acl_data_packets = 0;
+			total += hot->num_completed_acl_data_packets;
 			num_con_handles++;
 		}
 	}
 
 	/* No completed packets, no event */
-	if (total > 0)
-		inject_hci_event_num_compl_pkts(num_con_handles, con_handles, compl_pkts);
+	if (total == 0) {
+		num_compl_pkts_age = 0;
+		return;
+	}
+
+	/* Wait for more completed packets to report them all at once */
+	if ((++num_compl_pkts_age < NUM_COMPL_PKTS_COALESCE_TICKS) &&
+	    (total < NUM_COMPL_PKTS_COALESCE_THRESHOLD))
+		return;
+
+	/* If the event can't be injected, the counts are reported on the next tick */
+	if (inject_hci_event_num_compl_pkts(num_con_handles, con_handles, compl_pkts) != IOS_OK)
+		return;
+
+	/* Reset counts */
+	for (int i = 0; i < MAX_FAKE_WIIMOTES; i++) {
+		if (fake_wiimote_hot_is_connected(&fake_wiimotes_hot[i]))
+			fake_wiimotes_hot[i].num_completed_acl_data_packets = 0;
+	}
+	num_compl_pkts_age = 0;
+}
+
+u8 fake_wiimote_mgr_piggyback_num_compl_pkts(hci_num_compl_pkts_info *info, u8 max_entries)
+{
+	u8 num_entries = 0;
+
+	for (int i = 0; (i < MAX_FAKE_WIIMOTES) && (num_entries < max_entries); i++) {
+		fake_wiimote_hot_t *hot = &fake_wiimotes_hot[i];
+
+		if (fake_wiimote_hot_is_connected(hot) && (hot->num_completed_acl_data_packets > 0)) {
+			info[num_entries].con_handle = htole16(hot->hci_con_handle);
+			info[num_entries].compl_pkts = htole16(hot->num_completed_acl_data_packets);
+			hot->num_completed_acl_data_packets = 0;
+			num_entries++;
+		}
+	}
+
+	if (num_entries > 0)
+		g_num_compl_pkts_piggybacked++;
+
+	return num_entries;
 }
 
 static inline void fake_wiimote_mgr_check_assign_input_devices(void)
@@ -45,56 +109,122 @@ static inline void fake_wiimote_mgr_check_assign_input_devices(void)
 
 	/* Find if there's a fake Wiimote without an input device assigned */
 	for (int i = 0; i < MAX_FAKE_WIIMOTES; i++) {
-		if (fake_wiimotes[i].active)
+		if (fake_wiimotes_hot[i].active)
 			continue;
 
 		input_device = input_device_get_unassigned();
-		if (input_device) {
-			input_device_assign_wiimote(input_device, &fake_wiimotes[i]);
-			fake_wiimote_init_state(&fake_wiimotes[i], input_device);
-			fake_wiimotes[i].active = true;
-		}
+		if (!input_device)
+			break; /* No other input device is waiting, stop scanning */
+
+		input_device_assign_wiimote(input_device, &fake_wiimotes[i]);
+		fake_wiimote_init_state(&fake_wiimotes[i], input_device);
+		fake_wiimotes_hot[i].active = true;
 	}
 }
 
 void fake_wiimote_mgr_tick_devices(void)
 {
+	u32 visits = 0;
+
 	if (hci_can_request_connection())
 		fake_wiimote_mgr_check_assign_input_devices();
 
+	/* Only visit the fake Wiimotes with a FAKE_WIIMOTE_WORK_* bit set in their work mask.
+	 * Idle ones (connected, nothing to report) are skipped */
 	for (int i = 0; i < MAX_FAKE_WIIMOTES; i++) {
-		if (fake_wiimotes[i].active)
+		if (fake_wiimote_hot_has_work(&fake_wiimotes_hot[i])) {
 			fake_wiimote_tick(&fake_wiimotes[i]);
+			visits++;
+		}
 	}
+	g_fake_wiimote_tick_visits += visits;
+	g_fake_wiimote_last_tick_visits = visits;
 
-	/* This event has to be sent periodically */
+	/* Completed packets don't need a work bit: they are coalesced across ticks here */
 	fake_wiimote_mgr_send_event_number_of_completed_packets();
 }
 
-static inline bool does_bdaddr_belong_to_fake_wiimote(const bdaddr_t *bdaddr, int *index)
+bool fake_wiimote_mgr_any_active(void)
 {
-	/* Check if the bdaddr belongs to a fake wiimote */
 	for (int i = 0; i < MAX_FAKE_WIIMOTES; i++) {
-		if (bacmp(bdaddr, &fake_wiimotes[i].bdaddr) == 0) {
-			if (index)
-				*index = i;
+		if (fake_wiimotes_hot[i].active)
 			return true;
-		}
 	}
 
 	return false;
 }
 
-static inline fake_wiimote_t *get_fake_wiimote_for_hci_con_handle(u16 hci_con_handle)
+bool fake_wiimote_mgr_any_connected(void)
 {
-	/* Check if the HCI connection handle belongs to a fake wiimote */
 	for (int i = 0; i < MAX_FAKE_WIIMOTES; i++) {
-		if (fake_wiimote_is_connected(&fake_wiimotes[i]) &&
-		    (fake_wiimotes[i].hci_con_handle == hci_con_handle))
-			return &fake_wiimotes[i];
+		if (fake_wiimote_hot_is_connected(&fake_wiimotes_hot[i]))
+			return true;
 	}
 
-	return NULL;
+	return false;
+}
+
+u32 fake_wiimote_mgr_num_connected(void)
+{
+	u32 num = 0;
+
+	for (int i = 0; i < MAX_FAKE_WIIMOTES; i++) {
+		if (fake_wiimote_hot_is_connected(&fake_wiimotes_hot[i]))
+			num++;
+	}
+
+	return num;
+}
+
+bool fake_wiimote_mgr_needs_tick(void)
+{
+	bool has_free_wiimote = false;
+
+	for (int i = 0; i < MAX_FAKE_WIIMOTES; i++) {
+		if (!fake_wiimotes_hot[i].active)
+			has_free_wiimote = true;
+		else if (fake_wiimote_needs_tick(&fake_wiimotes[i]))
+			return true;
+	}
+
+	/* An input device is waiting to get a fake Wiimote assigned */
+	return has_free_wiimote && hci_can_request_connection() && input_device_get_unassigned();
+}
+
+static inline bool does_bdaddr_belong_to_fake_wiimote(const bdaddr_t *bdaddr, int *index)
+{
+	const bdaddr_t fake_bdaddr = FAKE_WIIMOTE_BDADDR(0);
+	int i;
+
+	/* Fake Wiimote bdaddrs only differ in the last byte, which encodes the index */
+	if (memcmp(bdaddr->b, fake_bdaddr.b, sizeof(bdaddr->b) - 1) != 0)
+		return false;
+
+	i = bdaddr->b[5] - fake_bdaddr.b[5];
+	if ((i < 0) || (i >= MAX_FAKE_WIIMOTES))
+		return false;
+
+	if (index)
+		*index = i;
+	return true;
+}
+
+static inline fake_wiimote_t *get_fake_wiimote_for_hci_con_handle(u16 hci_con_handle)
+{
+	u32 index = hci_con_handle - HCI_RESERVED_CON_HANDLE_BASE;
+	fake_wiimote_t *wiimote;
+
+	/* Real connections don't use the reserved range. This also rejects
+	 * handles below it, since the subtraction wraps around. */
+	if (index >= HCI_RESERVED_CON_HANDLE_COUNT)
+		return NULL;
+
+	wiimote = fake_wiimote_for_con_handle[index];
+	if (!wiimote || !fake_wiimote_is_connected(wiimote) ||
+	    (wiimote->hot->hci_con_handle != hci_con_handle))
+		return NULL;
+
+	return wiimote;
 }
 
 static inline bool does_hci_con_handle_belong_to_fake_wiimote(u16 hci_con_handle)
@@ -109,6 +239,8 @@ static bool fake_wiimote_mgr_handle_hci_cmd_accept_con(const bdaddr_t *bdaddr, u
 	/* Check if the bdaddr belongs to a fake wiimote */
 	if (does_bdaddr_belong_to_fake_wiimote(bdaddr, &i)) {
 		fake_wiimote_handle_hci_cmd_accept_con(&fake_wiimotes[i], role);
+		fake_wiimote_for_con_handle[fake_wiimotes_hot[i].hci_con_handle -
+					    HCI_RESERVED_CON_HANDLE_BASE] = &fake_wiimotes[i];
 		return true;
 	}
 
@@ -143,7 +275,8 @@ static bool fake_wiimote_mgr_handle_hci_cmd_disconnect(u16 hci_con_handle, u8 re
 		return false;
 
 	ret = inject_hci_event_command_status(HCI_CMD_DISCONNECT);
-	assert(ret == IOS_OK);
+	if (ret != IOS_OK)
+		LOG_DEBUG("Couldn't answer HCI_CMD_DISCONNECT: %d\n", ret);
 
 	/* Host wants disconnection to our fake wiimote. Disconnect */
 	LOG_DEBUG("Host requested disconnection of fake Wiimote\n");
@@ -157,7 +290,7 @@ bool fake_wiimote_mgr_handle_hci_cmd_from_host(const hci_cmd_hdr_t *hdr)
 	void *payload = (void *)((u8 *)hdr + sizeof(hci_cmd_hdr_t));
 	u16 opcode = le16toh(hdr->opcode);
 	u16 con_handle;
-	int ret;
+	int ret = IOS_OK;
 	bool handled = false;
 
 	switch (opcode) {
@@ -183,9 +316,8 @@ bool fake_wiimote_mgr_handle_hci_cmd_from_host(const hci_cmd_hdr_t *hdr)
 		if (does_hci_con_handle_belong_to_fake_wiimote(con_handle)) {
 			u16 pkt_type = le16toh(cp->pkt_type);
 			ret = inject_hci_event_command_status(HCI_CMD_CHANGE_CON_PACKET_TYPE);
-			assert(ret == IOS_OK);
-			ret = inject_hci_event_con_pkt_type_changed(con_handle, pkt_type);
-			assert(ret == IOS_OK);
+			if (ret == IOS_OK)
+				ret = inject_hci_event_con_pkt_type_changed(con_handle, pkt_type);
 			handled = true;
 		}
 		break;
@@ -195,9 +327,8 @@ bool fake_wiimote_mgr_handle_hci_cmd_from_host(const hci_cmd_hdr_t *hdr)
 		con_handle = le16toh(cp->con_handle);
 		if (does_hci_con_handle_belong_to_fake_wiimote(con_handle)) {
 			ret = inject_hci_event_command_status(HCI_CMD_AUTH_REQ);
-			assert(ret == IOS_OK);
-			ret = inject_hci_event_auth_compl(0, con_handle);
-			assert(ret == IOS_OK);
+			if (ret == IOS_OK)
+				ret = inject_hci_event_auth_compl(0, con_handle);
 			handled = true;
 		}
 		break;
@@ -209,9 +340,8 @@ bool fake_wiimote_mgr_handle_hci_cmd_from_host(const hci_cmd_hdr_t *hdr)
 			char name[32];
 			snprintf(name, sizeof(name), "Fake Wiimote %d", index);
 			ret = inject_hci_event_command_status(HCI_CMD_REMOTE_NAME_REQ);
-			assert(ret == IOS_OK);
-			ret = inject_hci_event_remote_name_req_compl(0, &cp->bdaddr, name);
-			assert(ret == IOS_OK);
+			if (ret == IOS_OK)
+				ret = inject_hci_event_remote_name_req_compl(0, &cp->bdaddr, name);
 			handled = true;
 		}
 		break;
@@ -221,10 +351,9 @@ bool fake_wiimote_mgr_handle_hci_cmd_from_host(const hci_cmd_hdr_t *hdr)
 		con_handle = le16toh(cp->con_handle);
 		if (does_hci_con_handle_belong_to_fake_wiimote(con_handle)) {
 			ret = inject_hci_event_command_status(HCI_CMD_READ_REMOTE_FEATURES);
-			assert(ret == IOS_OK);
-			ret = inject_hci_event_read_remote_features_compl(con_handle,
-									  WIIMOTE_REMOTE_FEATURES);
-			assert(ret == IOS_OK);
+			if (ret == IOS_OK)
+				ret = inject_hci_event_read_remote_features_compl(con_handle,
+										  WIIMOTE_REMOTE_FEATURES);
 			handled = true;
 		}
 		break;
@@ -234,12 +363,11 @@ bool fake_wiimote_mgr_handle_hci_cmd_from_host(const hci_cmd_hdr_t *hdr)
 		con_handle = le16toh(cp->con_handle);
 		if (does_hci_con_handle_belong_to_fake_wiimote(con_handle)) {
 			ret = inject_hci_event_command_status(HCI_CMD_READ_REMOTE_VER_INFO);
-			assert(ret == IOS_OK);
-			ret = inject_hci_event_read_remote_ver_info_compl(con_handle,
-									  WIIMOTE_LMP_VERSION,
-									  WIIMOTE_MANUFACTURER_ID,
-									  WIIMOTE_LMP_SUBVERSION);
-			assert(ret == IOS_OK);
+			if (ret == IOS_OK)
+				ret = inject_hci_event_read_remote_ver_info_compl(con_handle,
+										  WIIMOTE_LMP_VERSION,
+										  WIIMOTE_MANUFACTURER_ID,
+										  WIIMOTE_LMP_SUBVERSION);
 			handled = true;
 		}
 		break;
@@ -249,9 +377,8 @@ bool fake_wiimote_mgr_handle_hci_cmd_from_host(const hci_cmd_hdr_t *hdr)
 		con_handle = le16toh(cp->con_handle);
 		if (does_hci_con_handle_belong_to_fake_wiimote(con_handle)) {
 			ret = inject_hci_event_command_status(HCI_CMD_READ_CLOCK_OFFSET);
-			assert(ret == IOS_OK);
-			ret = inject_hci_event_read_clock_offset_compl(con_handle, 0x3818);
-			assert(ret == IOS_OK);
+			if (ret == IOS_OK)
+				ret = inject_hci_event_read_clock_offset_compl(con_handle, 0x3818);
 			handled = true;
 		}
 		break;
@@ -261,10 +388,9 @@ bool fake_wiimote_mgr_handle_hci_cmd_from_host(const hci_cmd_hdr_t *hdr)
 		con_handle = le16toh(cp->con_handle);
 		if (does_hci_con_handle_belong_to_fake_wiimote(con_handle)) {
 			ret = inject_hci_event_command_status(HCI_CMD_SNIFF_MODE);
-			assert(ret == IOS_OK);
-			ret = inject_hci_event_mode_change(con_handle, 0x02 /* sniff mode */,
-							   cp->max_interval);
-			assert(ret == IOS_OK);
+			if (ret == IOS_OK)
+				ret = inject_hci_event_mode_change(con_handle, 0x02 /* sniff mode */,
+								   cp->max_interval);
 			handled = true;
 		}
 		break;
@@ -274,18 +400,20 @@ bool fake_wiimote_mgr_handle_hci_cmd_from_host(const hci_cmd_hdr_t *hdr)
 		con_handle = le16toh(cp->con_handle);
 		if (does_hci_con_handle_belong_to_fake_wiimote(con_handle)) {
 			ret = inject_hci_event_command_status(HCI_CMD_WRITE_LINK_POLICY_SETTINGS);
-			assert(ret == IOS_OK);
 			handled = true;
 		}
 		break;
 	}
 	case HCI_CMD_RESET:
 		for (int i = 0; i < MAX_FAKE_WIIMOTES; i++) {
-			if (fake_wiimotes[i].active) {
+			if (fake_wiimotes_hot[i].active) {
 				/* Unassign the currently assigned input device (if any) */
 				if (fake_wiimotes[i].input_device)
 					input_device_release_wiimote(fake_wiimotes[i].input_device);
-				fake_wiimotes[i].active = false;
+				fake_wiimotes_hot[i].active = false;
+				/* The HCI reset frees the connection handles */
+				fake_wiimotes_hot[i].baseband_state = BASEBAND_STATE_INACTIVE;
+				periodic_timer_request_update();
 			}
 		}
 		break;
@@ -301,7 +429,7 @@ bool fake_wiimote_mgr_handle_hci_cmd_from_host(const hci_cmd_hdr_t *hdr)
 				memset(keys[i], 0, sizeof(keys[i]));
 			}
 
-			inject_hci_event_return_link_keys(MAX_FAKE_WIIMOTES, bdaddrs, keys);
+			ret = inject_hci_event_return_link_keys(MAX_FAKE_WIIMOTES, bdaddrs, keys);
 		} else {
 			if (does_bdaddr_belong_to_fake_wiimote(&cp->bdaddr, NULL)) {
 				/* TODO: Return made-up link key for that particular bdaddr */
@@ -323,13 +451,16 @@ bool fake_wiimote_mgr_handle_hci_cmd_from_host(const hci_cmd_hdr_t *hdr)
 			reply.con_handle = cp->con_handle;
 			ret = inject_hci_event_command_compl(HCI_CMD_WRITE_LINK_SUPERVISION_TIMEOUT,
 							     &reply, sizeof(reply));
-			assert(ret == IOS_OK);
 			handled = true;
 		}
 		break;
 	}
 	}
 
+	/* The host will time out waiting for the answer */
+	if (ret != IOS_OK)
+		LOG_DEBUG("Couldn't answer HCI command 0x%04x: %d\n", opcode, ret);
+
 	return handled;
 }
 
@@ -1,44 +1,121 @@
 #include <stdbool.h>
+#include <stddef.h>
 #include <string.h>
+#include "cache_ops.h"
 #include "fake_wiimote_mgr.h"
+#include "globals.h"
 #include "hci.h"
 #include "hci_state.h"
+#include "injmessage.h"
 #include "utils.h"
 #include "syscalls.h"
 
-#define MAX_HCI_CONNECTIONS	32
+/* Connection handles are 12 bits, but 0x0F00-0x0FFF are reserved */
+#define HCI_CON_HANDLE_MAX		0x0EFF
+#define HCI_CON_HANDLE_COUNT		(HCI_CON_HANDLE_MAX + 1)
+#define HCI_PHYS_CON_HANDLE_NONE	0xFFFF
+/* ACL buffer size of the Wii's controller, used until the real one is known */
+#define HCI_DEFAULT_MAX_ACL_SIZE	339
+
+/* Global variables */
+u32 g_hci_cmd_cache_hits;
+u32 g_hci_con_handles_identity;
 
 /* Snooped HCI state (requested by SW BT stack) */
 static u8 hci_unit_class[HCI_CLASS_SIZE];
 static u8 hci_page_scan_enable;
 static u8 hci_read_stored_link_key_read_all;
-/* Other variables */
-static u16 last_hci_virt_con_handle;
+/* Max. ACL packet size and number of ACL packets the host can receive, 0 until it tells
+ * the controller */
+static u16 hci_host_max_acl_size;
+static u16 hci_host_num_acl_pkts;
+
+/* Controller info that doesn't change across HCI resets. The first successful Command Complete
+ * of each of these commands is kept, and repeat commands are answered locally, saving the
+ * USB round-trips through OH1 every time the BT stack is initialized */
+typedef struct {
+	u16 opcode;
+	u8 size;
+	bool valid;
+	void *rp;
+} hci_cmd_cache_entry_t;
+
+static hci_read_local_ver_rp hci_cached_local_ver;
+static hci_read_local_features_rp hci_cached_local_features;
+static hci_read_buffer_size_rp hci_cached_buffer_size;
+static hci_read_bdaddr_rp hci_cached_bdaddr;
+
+static hci_cmd_cache_entry_t hci_cmd_cache[] = {
+	{HCI_CMD_READ_LOCAL_VER, sizeof(hci_cached_local_ver), false, &hci_cached_local_ver},
+	{HCI_CMD_READ_LOCAL_FEATURES, sizeof(hci_cached_local_features), false, &hci_cached_local_features},
+	{HCI_CMD_READ_BUFFER_SIZE, sizeof(hci_cached_buffer_size), false, &hci_cached_buffer_size},
+	{HCI_CMD_READ_BDADDR, sizeof(hci_cached_bdaddr), false, &hci_cached_bdaddr},
+};
 
 /* Simulated HCI state */
-static struct {
-	bool valid;
-	u16 virt; /* The one we return to the BT SW stack */
-	u16 phys; /* The one the BT dongle uses */
-} hci_virt_con_handle_map_table[MAX_HCI_CONNECTIONS];
+/* Live identity-mapped connection handles */
+static u32 hci_identity_con_handles[HCI_RESERVED_CON_HANDLE_BASE / 32];
+/* Handles of the reserved range. Bit (31 - index) is set if the handle is in use,
+ * so that CLZ finds the first free one */
+static u32 hci_reserved_con_handles_used;
+/* Index where the search for a free reserved handle starts */
+static u8 hci_reserved_con_handles_next;
+/* Physical handle of each reserved virtual handle, HCI_PHYS_CON_HANDLE_NONE for fake Wiimotes */
+static u16 hci_reserved_con_handle_phys[HCI_RESERVED_CON_HANDLE_COUNT];
+/* Reserved virtual handle (index + 1) of the real connections with a reserved physical handle */
+static u8 hci_reserved_phys_con_handle_virt[HCI_RESERVED_CON_HANDLE_COUNT];
+
+static inline u32 hci_reserved_bit(u32 index)
+{
+	return 0x80000000 >> index;
+}
+
+static inline bool hci_con_handle_is_reserved(u16 handle)
+{
+	return (handle >= HCI_RESERVED_CON_HANDLE_BASE) && (handle <= HCI_CON_HANDLE_MAX);
+}
 
 void hci_state_reset()
 {
-	for (int i = 0; i < ARRAY_SIZE(hci_virt_con_handle_map_table); i++)
-		hci_virt_con_handle_map_table[i].valid = false;
+	memset(hci_identity_con_handles, 0, sizeof(hci_identity_con_handles));
+	memset(hci_reserved_phys_con_handle_virt, 0, sizeof(hci_reserved_phys_con_handle_virt));
+	hci_reserved_con_handles_used = 0;
 
 	memset(hci_unit_class, 0, sizeof(hci_unit_class));
 	hci_page_scan_enable = 0;
 	hci_read_stored_link_key_read_all = 0;
+	hci_host_max_acl_size = 0;
+	hci_host_num_acl_pkts = 0;
+
+	/* The cached controller info is kept: a reset doesn't change it, and the BT stack
+	 * starts every init with one, so clearing it would mean never answering from it */
+}
+
+/* Allocates a handle of the reserved range. Returns a negative value if they are all in use */
+static ATTRIBUTE_ARM_CODE int hci_reserved_con_handle_alloc(u16 phys)
+{
+	u32 free = ~hci_reserved_con_handles_used;
+	u32 after;
+	u32 index;
+
+	if (free == 0)
+		return -1;
+
+	/* Prefer the handles after the last allocated one, to delay reusing them */
+	after = free & (0xFFFFFFFF >> hci_reserved_con_handles_next);
+	index = __builtin_clz(after ? after : free);
+
+	hci_reserved_con_handles_used |= hci_reserved_bit(index);
+	hci_reserved_con_handles_next = (index + 1) & (HCI_RESERVED_CON_HANDLE_COUNT - 1);
+	hci_reserved_con_handle_phys[index] = phys;
 
-	last_hci_virt_con_handle = 0;
+	return HCI_RESERVED_CON_HANDLE_BASE + index;
 }
 
 u16 hci_con_handle_virt_alloc(void)
 {
-	u16 ret = last_hci_virt_con_handle;
-	/* XXX: We can have collisions after it wraps around! */
-	last_hci_virt_con_handle = (last_hci_virt_con_handle + 1) & 0x0EFF;
+	int ret = hci_reserved_con_handle_alloc(HCI_PHYS_CON_HANDLE_NONE);
+	assert(ret >= 0);
 	return ret;
 }
 
@@ -51,55 +128,471 @@ bool hci_can_request_connection(void)
 	return true;
 }
 
+/* Cached controller info */
+
+static hci_cmd_cache_entry_t *hci_cmd_cache_find(u16 opcode)
+{
+	for (int i = 0; i < ARRAY_SIZE(hci_cmd_cache); i++) {
+		if (hci_cmd_cache[i].opcode == opcode)
+			return &hci_cmd_cache[i];
+	}
+	return NULL;
+}
+
+static bool hci_cmd_cache_reply(u16 opcode)
+{
+	int ret;
+	hci_cmd_cache_entry_t *entry = hci_cmd_cache_find(opcode);
+
+	if (!entry || !entry->valid)
+		return false;
+
+	ret = inject_hci_event_command_compl(opcode, entry->rp, entry->size);
+	if (ret != IOS_OK)
+		return false;
+
+	g_hci_cmd_cache_hits++;
+	return true;
+}
+
+static void hci_cmd_cache_store(u16 opcode, const void *rp, u32 size)
+{
+	hci_cmd_cache_entry_t *entry = hci_cmd_cache_find(opcode);
+
+	/* Only successful replies are cached. All the return parameters start with the status */
+	if (!entry || entry->valid || (size < entry->size) || (*(const u8 *)rp != 0))
+		return;
+
+	memcpy(entry->rp, rp, entry->size);
+	entry->valid = true;
+}
+
 /* HCI connection handle virt<->phys mapping */
 
-static bool hci_virt_con_handle_map(u16 phys, u16 virt)
+static bool hci_virt_con_handle_map(u16 phys, u16 *virt)
 {
-	for (int i = 0; i < ARRAY_SIZE(hci_virt_con_handle_map_table); i++) {
-		if (!hci_virt_con_handle_map_table[i].valid) {
-			hci_virt_con_handle_map_table[i].virt = virt;
-			hci_virt_con_handle_map_table[i].phys = phys;
-			hci_virt_con_handle_map_table[i].valid = true;
-			return true;
-		}
+	int ret;
+	u32 index;
+
+	if (phys > HCI_CON_HANDLE_MAX)
+		return false;
+
+	if (!hci_con_handle_is_reserved(phys)) {
+		hci_identity_con_handles[phys / 32] |= BIT(phys % 32);
+		*virt = phys;
+		return true;
 	}
-	return false;
+
+	/* The dongle gave us a handle of the reserved range. Give it one we don't use */
+	index = phys - HCI_RESERVED_CON_HANDLE_BASE;
+	if (hci_reserved_phys_con_handle_virt[index])
+		return false;
+	ret = hci_reserved_con_handle_alloc(phys);
+	if (ret < 0)
+		return false;
+
+	hci_reserved_phys_con_handle_virt[index] = ret - HCI_RESERVED_CON_HANDLE_BASE + 1;
+	*virt = ret;
+	return true;
 }
 
 static bool hci_virt_con_handle_unmap_virt(u16 virt)
 {
-	for (int i = 0; i < ARRAY_SIZE(hci_virt_con_handle_map_table); i++) {
-		if (hci_virt_con_handle_map_table[i].valid &&
-		    hci_virt_con_handle_map_table[i].virt == virt) {
-			hci_virt_con_handle_map_table[i].valid = false;
-			return true;
-		}
+	u32 index;
+	u16 phys;
+
+	if (virt > HCI_CON_HANDLE_MAX)
+		return false;
+
+	if (!hci_con_handle_is_reserved(virt)) {
+		if (!(hci_identity_con_handles[virt / 32] & BIT(virt % 32)))
+			return false;
+		hci_identity_con_handles[virt / 32] &= ~BIT(virt % 32);
+		return true;
 	}
-	return false;
+
+	index = virt - HCI_RESERVED_CON_HANDLE_BASE;
+	if (!(hci_reserved_con_handles_used & hci_reserved_bit(index)))
+		return false;
+
+	phys = hci_reserved_con_handle_phys[index];
+	if (phys != HCI_PHYS_CON_HANDLE_NONE)
+		hci_reserved_phys_con_handle_virt[phys - HCI_RESERVED_CON_HANDLE_BASE] = 0;
+	hci_reserved_con_handles_used &= ~hci_reserved_bit(index);
+	return true;
 }
 
-static bool hci_virt_con_handle_get_virt(u16 phys, u16 *virt)
+static inline bool hci_virt_con_handle_get_virt(u16 phys, u16 *virt)
 {
-	for (int i = 0; i < ARRAY_SIZE(hci_virt_con_handle_map_table); i++) {
-		if (hci_virt_con_handle_map_table[i].valid &&
-		    hci_virt_con_handle_map_table[i].phys == phys) {
-			*virt = hci_virt_con_handle_map_table[i].virt;
-			return true;
-		}
+	u32 index;
+
+	if (phys > HCI_CON_HANDLE_MAX)
+		return false;
+
+	if (!hci_con_handle_is_reserved(phys)) {
+		*virt = phys;
+		return !!(hci_identity_con_handles[phys / 32] & BIT(phys % 32));
 	}
-	return false;
+
+	index = hci_reserved_phys_con_handle_virt[phys - HCI_RESERVED_CON_HANDLE_BASE];
+	if (!index)
+		return false;
+
+	*virt = HCI_RESERVED_CON_HANDLE_BASE + index - 1;
+	return true;
 }
 
-static bool hci_virt_con_handle_get_phys(u16 virt, u16 *phys)
+static inline bool hci_virt_con_handle_get_phys(u16 virt, u16 *phys)
 {
-	for (int i = 0; i < ARRAY_SIZE(hci_virt_con_handle_map_table); i++) {
-		if (hci_virt_con_handle_map_table[i].valid &&
-		    hci_virt_con_handle_map_table[i].virt == virt) {
-			*phys = hci_virt_con_handle_map_table[i].phys;
-			return true;
-		}
+	u32 index;
+
+	if (virt > HCI_CON_HANDLE_MAX)
+		return false;
+
+	if (!hci_con_handle_is_reserved(virt)) {
+		*phys = virt;
+		return !!(hci_identity_con_handles[virt / 32] & BIT(virt % 32));
+	}
+
+	index = virt - HCI_RESERVED_CON_HANDLE_BASE;
+	if (!(hci_reserved_con_handles_used & hci_reserved_bit(index)) ||
+	    (hci_reserved_con_handle_phys[index] == HCI_PHYS_CON_HANDLE_NONE))
+		return false;
+
+	*phys = hci_reserved_con_handle_phys[index];
+	return true;
+}
+
+/* Rewrites a little endian connection handle field, unless the connection is identity-mapped.
+ * Returns true if it was rewritten */
+static inline bool hci_con_handle_rewrite(void *field, u16 old_value, u16 new_value)
+{
+	u8 *bytes = field;
+
+	if (new_value == old_value)
+		return false;
+
+	bytes[0] = new_value & 0xFF;
+	bytes[1] = new_value >> 8;
+	cache_dirty_add(field, sizeof(u16));
+	return true;
+}
+
+/* The same, for packets with a single connection handle */
+static inline void hci_con_handle_patch(void *field, u16 old_value, u16 new_value)
+{
+	if (!hci_con_handle_rewrite(field, old_value, new_value))
+		g_hci_con_handles_identity++;
+}
+
+void hci_con_handle_virt_free(u16 virt)
+{
+	bool ret = hci_virt_con_handle_unmap_virt(virt);
+	assert(ret);
+}
+
+#ifdef FAKEMOTE_STANDALONE
+
+/* Standalone mode: there's no real Bluetooth traffic, so instead of handing the HCI commands
+ * down to the dongle, we answer them locally as the Wii's own controller would.
+ * Values match the Wii's Broadcom BCM2045 controller. */
+
+#define STANDALONE_HCI_VERSION		0x02
+#define STANDALONE_HCI_REVISION		0x0000
+#define STANDALONE_LMP_VERSION		0x02
+#define STANDALONE_MANUFACTURER_ID	0x000F
+#define STANDALONE_LMP_SUBVERSION	0x0659
+#define STANDALONE_FEATURES		((u8[]){0xFF, 0xFF, 0x8D, 0xFE, 0x9B, 0xF9, 0x00, 0x80})
+#define STANDALONE_MAX_ACL_SIZE		339
+#define STANDALONE_MAX_SCO_SIZE		64
+#define STANDALONE_NUM_ACL_PKTS		10
+#define STANDALONE_NUM_SCO_PKTS		0
+#define STANDALONE_BDADDR		((bdaddr_t){{0x11, 0x02, 0x19, 0x79, 0x00, 0x00}})
+
+#define HCI_STATUS_SUCCESS		0x00
+#define HCI_STATUS_UNKNOWN_COMMAND	0x01
+
+static void hci_state_standalone_handle_hci_cmd(u16 opcode, void *payload)
+{
+	int ret;
+
+	switch (opcode) {
+	case HCI_CMD_INQUIRY:
+		/* There's nothing to discover, fake Wiimotes connect by themselves */
+		ret = inject_hci_event_command_status(opcode);
+		if (ret == IOS_OK)
+			ret = inject_hci_event_inquiry_compl(HCI_STATUS_SUCCESS);
+		break;
+	case HCI_CMD_RESET:
+		hci_state_reset();
+		goto status_only;
+	case HCI_CMD_WRITE_SCAN_ENABLE: {
+		hci_write_scan_enable_cp *cp = payload;
+		hci_page_scan_enable = cp->scan_enable;
+		/* Pending connection requests depend on it */
+		periodic_timer_request_update();
+		goto status_only;
+	}
+	case HCI_CMD_WRITE_UNIT_CLASS: {
+		hci_write_unit_class_cp *cp = payload;
+		memcpy(hci_unit_class, cp->uclass, sizeof(hci_unit_class));
+		goto status_only;
+	}
+	case HCI_CMD_HOST_BUFFER_SIZE: {
+		hci_host_buffer_size_cp *cp = payload;
+		hci_host_max_acl_size = le16toh(cp->max_acl_size);
+		hci_host_num_acl_pkts = le16toh(cp->num_acl_pkts);
+		goto status_only;
+	}
+	case HCI_CMD_READ_STORED_LINK_KEY: {
+		hci_read_stored_link_key_cp *cp = payload;
+		/* The fake Wiimotes' link keys are returned by the fake Wiimote manager */
+		u16 num_keys = cp->read_all ? MAX_FAKE_WIIMOTES : 0;
+		hci_read_stored_link_key_rp rp = {
+			.status = HCI_STATUS_SUCCESS,
+			.max_num_keys = htole16(num_keys),
+			.num_keys_read = htole16(num_keys)
+		};
+		ret = inject_hci_event_command_compl(opcode, &rp, sizeof(rp));
+		break;
+	}
+	case HCI_CMD_WRITE_STORED_LINK_KEY: {
+		hci_write_stored_link_key_cp *cp = payload;
+		hci_write_stored_link_key_rp rp = {
+			.status = HCI_STATUS_SUCCESS,
+			.num_keys_written = cp->num_keys_write
+		};
+		ret = inject_hci_event_command_compl(opcode, &rp, sizeof(rp));
+		break;
+	}
+	case HCI_CMD_DELETE_STORED_LINK_KEY: {
+		hci_delete_stored_link_key_rp rp = {
+			.status = HCI_STATUS_SUCCESS,
+			.num_keys_deleted = 0
+		};
+		ret = inject_hci_event_command_compl(opcode, &rp, sizeof(rp));
+		break;
+	}
+	case HCI_CMD_READ_LOCAL_VER: {
+		hci_read_local_ver_rp rp = {
+			.status = HCI_STATUS_SUCCESS,
+			.hci_version = STANDALONE_HCI_VERSION,
+			.hci_revision = htole16(STANDALONE_HCI_REVISION),
+			.lmp_version = STANDALONE_LMP_VERSION,
+			.manufacturer = htole16(STANDALONE_MANUFACTURER_ID),
+			.lmp_subversion = htole16(STANDALONE_LMP_SUBVERSION)
+		};
+		ret = inject_hci_event_command_compl(opcode, &rp, sizeof(rp));
+		break;
+	}
+	case HCI_CMD_READ_LOCAL_FEATURES: {
+		hci_read_local_features_rp rp = {
+			.status = HCI_STATUS_SUCCESS
+		};
+		memcpy(rp.features, STANDALONE_FEATURES, sizeof(rp.features));
+		ret = inject_hci_event_command_compl(opcode, &rp, sizeof(rp));
+		break;
+	}
+	case HCI_CMD_READ_BUFFER_SIZE: {
+		hci_read_buffer_size_rp rp = {
+			.status = HCI_STATUS_SUCCESS,
+			.max_acl_size = htole16(STANDALONE_MAX_ACL_SIZE),
+			.max_sco_size = STANDALONE_MAX_SCO_SIZE,
+			.num_acl_pkts = htole16(STANDALONE_NUM_ACL_PKTS),
+			.num_sco_pkts = htole16(STANDALONE_NUM_SCO_PKTS)
+		};
+		ret = inject_hci_event_command_compl(opcode, &rp, sizeof(rp));
+		break;
+	}
+	case HCI_CMD_READ_BDADDR: {
+		hci_read_bdaddr_rp rp = {
+			.status = HCI_STATUS_SUCCESS,
+			.bdaddr = STANDALONE_BDADDR
+		};
+		ret = inject_hci_event_command_compl(opcode, &rp, sizeof(rp));
+		break;
 	}
-	return false;
+	case HCI_CMD_INQUIRY_CANCEL:
+	case HCI_CMD_SET_EVENT_MASK:
+	case HCI_CMD_SET_EVENT_FILTER:
+	case HCI_CMD_WRITE_PIN_TYPE:
+	case HCI_CMD_WRITE_LOCAL_NAME:
+	case HCI_CMD_WRITE_CON_ACCEPT_TIMEOUT:
+	case HCI_CMD_WRITE_PAGE_TIMEOUT:
+	case HCI_CMD_WRITE_PAGE_SCAN_ACTIVITY:
+	case HCI_CMD_WRITE_INQUIRY_SCAN_ACTIVITY:
+	case HCI_CMD_WRITE_AUTH_ENABLE:
+	case HCI_CMD_WRITE_ENCRYPTION_MODE:
+	case HCI_CMD_WRITE_INQUIRY_MODE:
+	case HCI_CMD_WRITE_PAGE_SCAN_TYPE:
+	case HCI_CMD_WRITE_INQUIRY_SCAN_TYPE:
+	case HCI_CMD_WRITE_DEFAULT_LINK_POLICY_SETTINGS:
+	status_only: {
+		hci_status_rp rp = {
+			.status = HCI_STATUS_SUCCESS
+		};
+		ret = inject_hci_event_command_compl(opcode, &rp, sizeof(rp));
+		break;
+	}
+	default: {
+		/* Includes the commands for connections that don't belong to a fake Wiimote,
+		 * which can't exist without a controller */
+		hci_status_rp rp = {
+			.status = HCI_STATUS_UNKNOWN_COMMAND
+		};
+		LOG_DEBUG("Unsupported HCI command in standalone mode: 0x%04x\n", opcode);
+		ret = inject_hci_event_command_compl(opcode, &rp, sizeof(rp));
+		break;
+	}
+	}
+
+	/* Only if the host has stopped reading HCI events, it will time out */
+	if (ret != IOS_OK)
+		LOG_DEBUG("Couldn't answer HCI command 0x%04x: %d\n", opcode, ret);
+}
+
+#endif
+
+/* Offset (+ 1) of the connection handle field of the commands and events that have one,
+ * indexed by OCF (for each OGF) and by event code. Special cases are handled explicitly. */
+#define CON_HANDLE_OFFSET(type)	(offsetof(type, con_handle) + 1)
+
+static const u8 hci_link_control_cmd_con_handle_offset[] = {
+	[HCI_OCF(HCI_CMD_DISCONNECT)] = CON_HANDLE_OFFSET(hci_discon_cp),
+	[HCI_OCF(HCI_CMD_ADD_SCO_CON)] = CON_HANDLE_OFFSET(hci_add_sco_con_cp),
+	[HCI_OCF(HCI_CMD_CHANGE_CON_PACKET_TYPE)] = CON_HANDLE_OFFSET(hci_change_con_pkt_type_cp),
+	[HCI_OCF(HCI_CMD_AUTH_REQ)] = CON_HANDLE_OFFSET(hci_auth_req_cp),
+	[HCI_OCF(HCI_CMD_SET_CON_ENCRYPTION)] = CON_HANDLE_OFFSET(hci_set_con_encryption_cp),
+	[HCI_OCF(HCI_CMD_CHANGE_CON_LINK_KEY)] = CON_HANDLE_OFFSET(hci_change_con_link_key_cp),
+	[HCI_OCF(HCI_CMD_READ_REMOTE_FEATURES)] = CON_HANDLE_OFFSET(hci_read_remote_features_cp),
+	[HCI_OCF(HCI_CMD_READ_REMOTE_EXTENDED_FEATURES)] = CON_HANDLE_OFFSET(hci_read_remote_extended_features_cp),
+	[HCI_OCF(HCI_CMD_READ_REMOTE_VER_INFO)] = CON_HANDLE_OFFSET(hci_read_remote_ver_info_cp),
+	[HCI_OCF(HCI_CMD_READ_CLOCK_OFFSET)] = CON_HANDLE_OFFSET(hci_read_clock_offset_cp),
+	[HCI_OCF(HCI_CMD_READ_LMP_HANDLE)] = CON_HANDLE_OFFSET(hci_read_lmp_handle_cp),
+	[HCI_OCF(HCI_CMD_SETUP_SCO_CON)] = CON_HANDLE_OFFSET(hci_setup_sco_con_cp),
+};
+
+static const u8 hci_link_policy_cmd_con_handle_offset[] = {
+	[HCI_OCF(HCI_CMD_HOLD_MODE)] = CON_HANDLE_OFFSET(hci_hold_mode_cp),
+	[HCI_OCF(HCI_CMD_SNIFF_MODE)] = CON_HANDLE_OFFSET(hci_sniff_mode_cp),
+	[HCI_OCF(HCI_CMD_EXIT_SNIFF_MODE)] = CON_HANDLE_OFFSET(hci_exit_sniff_mode_cp),
+	[HCI_OCF(HCI_CMD_PARK_MODE)] = CON_HANDLE_OFFSET(hci_park_mode_cp),
+	[HCI_OCF(HCI_CMD_EXIT_PARK_MODE)] = CON_HANDLE_OFFSET(hci_exit_park_mode_cp),
+	[HCI_OCF(HCI_CMD_QOS_SETUP)] = CON_HANDLE_OFFSET(hci_qos_setup_cp),
+	[HCI_OCF(HCI_CMD_ROLE_DISCOVERY)] = CON_HANDLE_OFFSET(hci_role_discovery_cp),
+	[HCI_OCF(HCI_CMD_READ_LINK_POLICY_SETTINGS)] = CON_HANDLE_OFFSET(hci_read_link_policy_settings_cp),
+	[HCI_OCF(HCI_CMD_WRITE_LINK_POLICY_SETTINGS)] = CON_HANDLE_OFFSET(hci_write_link_policy_settings_cp),
+	[HCI_OCF(HCI_CMD_FLOW_SPECIFICATION)] = CON_HANDLE_OFFSET(hci_flow_specification_cp),
+	[HCI_OCF(HCI_CMD_SNIFF_SUBRATING)] = CON_HANDLE_OFFSET(hci_sniff_subrating_cp),
+};
+
+static const u8 hci_host_baseband_cmd_con_handle_offset[] = {
+	[HCI_OCF(HCI_CMD_FLUSH)] = CON_HANDLE_OFFSET(hci_flush_cp),
+	[HCI_OCF(HCI_CMD_READ_AUTO_FLUSH_TIMEOUT)] = CON_HANDLE_OFFSET(hci_read_auto_flush_timeout_cp),
+	[HCI_OCF(HCI_CMD_WRITE_AUTO_FLUSH_TIMEOUT)] = CON_HANDLE_OFFSET(hci_write_auto_flush_timeout_cp),
+	[HCI_OCF(HCI_CMD_READ_XMIT_LEVEL)] = CON_HANDLE_OFFSET(hci_read_xmit_level_cp),
+	[HCI_OCF(HCI_CMD_READ_LINK_SUPERVISION_TIMEOUT)] = CON_HANDLE_OFFSET(hci_read_link_supervision_timeout_cp),
+	[HCI_OCF(HCI_CMD_WRITE_LINK_SUPERVISION_TIMEOUT)] = CON_HANDLE_OFFSET(hci_write_link_supervision_timeout_cp),
+	[HCI_OCF(HCI_CMD_REFRESH_ENCRYPTION_KEY)] = CON_HANDLE_OFFSET(hci_refresh_encryption_key_cp),
+	[HCI_OCF(HCI_CMD_ENHANCED_FLUSH)] = CON_HANDLE_OFFSET(hci_enhanced_flush_cp),
+};
+
+static const u8 hci_status_cmd_con_handle_offset[] = {
+	[HCI_OCF(HCI_CMD_READ_FAILED_CONTACT_CNTR)] = CON_HANDLE_OFFSET(hci_read_failed_contact_cntr_cp),
+	[HCI_OCF(HCI_CMD_RESET_FAILED_CONTACT_CNTR)] = CON_HANDLE_OFFSET(hci_reset_failed_contact_cntr_cp),
+	[HCI_OCF(HCI_CMD_READ_LINK_QUALITY)] = CON_HANDLE_OFFSET(hci_read_link_quality_cp),
+	[HCI_OCF(HCI_CMD_READ_RSSI)] = CON_HANDLE_OFFSET(hci_read_rssi_cp),
+	[HCI_OCF(HCI_CMD_READ_AFH_CHANNEL_MAP)] = CON_HANDLE_OFFSET(hci_read_afh_channel_map_cp),
+	[HCI_OCF(HCI_CMD_READ_CLOCK)] = CON_HANDLE_OFFSET(hci_read_clock_cp),
+};
+
+#define OGF_CON_HANDLE_OFFSETS(table)	{table, ARRAY_SIZE(table)}
+
+static const struct {
+	const u8 *offsets;
+	u16 count;
+} hci_cmd_con_handle_offsets[] = {
+	[HCI_OGF_LINK_CONTROL] = OGF_CON_HANDLE_OFFSETS(hci_link_control_cmd_con_handle_offset),
+	[HCI_OGF_LINK_POLICY] = OGF_CON_HANDLE_OFFSETS(hci_link_policy_cmd_con_handle_offset),
+	[HCI_OGF_HC_BASEBAND] = OGF_CON_HANDLE_OFFSETS(hci_host_baseband_cmd_con_handle_offset),
+	[HCI_OGF_STATUS] = OGF_CON_HANDLE_OFFSETS(hci_status_cmd_con_handle_offset),
+};
+
+static const u8 hci_event_con_handle_offset[] = {
+	[HCI_EVENT_AUTH_COMPL] = CON_HANDLE_OFFSET(hci_auth_compl_ep),
+	[HCI_EVENT_ENCRYPTION_CHANGE] = CON_HANDLE_OFFSET(hci_encryption_change_ep),
+	[HCI_EVENT_CHANGE_CON_LINK_KEY_COMPL] = CON_HANDLE_OFFSET(hci_change_con_link_key_compl_ep),
+	[HCI_EVENT_MASTER_LINK_KEY_COMPL] = CON_HANDLE_OFFSET(hci_master_link_key_compl_ep),
+	[HCI_EVENT_READ_REMOTE_FEATURES_COMPL] = CON_HANDLE_OFFSET(hci_read_remote_features_compl_ep),
+	[HCI_EVENT_READ_REMOTE_VER_INFO_COMPL] = CON_HANDLE_OFFSET(hci_read_remote_ver_info_compl_ep),
+	[HCI_EVENT_QOS_SETUP_COMPL] = CON_HANDLE_OFFSET(hci_qos_setup_compl_ep),
+	[HCI_EVENT_FLUSH_OCCUR] = CON_HANDLE_OFFSET(hci_flush_occur_ep),
+	[HCI_EVENT_MODE_CHANGE] = CON_HANDLE_OFFSET(hci_mode_change_ep),
+	[HCI_EVENT_MAX_SLOT_CHANGE] = CON_HANDLE_OFFSET(hci_max_slot_change_ep),
+	[HCI_EVENT_READ_CLOCK_OFFSET_COMPL] = CON_HANDLE_OFFSET(hci_read_clock_offset_compl_ep),
+	[HCI_EVENT_CON_PKT_TYPE_CHANGED] = CON_HANDLE_OFFSET(hci_con_pkt_type_changed_ep),
+	[HCI_EVENT_QOS_VIOLATION] = CON_HANDLE_OFFSET(hci_qos_violation_ep),
+	[HCI_EVENT_FLOW_SPECIFICATION_COMPL] = CON_HANDLE_OFFSET(hci_flow_specification_compl_ep),
+	[HCI_EVENT_READ_REMOTE_EXTENDED_FEATURES] = CON_HANDLE_OFFSET(hci_read_remote_extended_features_ep),
+	[HCI_EVENT_SCO_CON_COMPL] = CON_HANDLE_OFFSET(hci_sco_con_compl_ep),
+	[HCI_EVENT_SCO_CON_CHANGED] = CON_HANDLE_OFFSET(hci_sco_con_changed_ep),
+	[HCI_EVENT_SNIFF_SUBRATING] = CON_HANDLE_OFFSET(hci_sniff_subrating_ep),
+	[HCI_EVENT_ENCRYPTION_KEY_REFRESH] = CON_HANDLE_OFFSET(hci_encryption_key_refresh_ep),
+	[HCI_EVENT_LINK_SUPERVISION_TO_CHANGED] = CON_HANDLE_OFFSET(hci_link_supervision_to_changed_ep),
+	[HCI_EVENT_ENHANCED_FLUSH_COMPL] = CON_HANDLE_OFFSET(hci_enhanced_flush_compl_ep),
+};
+
+static inline u8 *hci_cmd_con_handle_field(u16 opcode, void *payload)
+{
+	u32 ogf = HCI_OGF(opcode);
+	u32 ocf = HCI_OCF(opcode);
+	u8 offset;
+
+	if ((ogf >= ARRAY_SIZE(hci_cmd_con_handle_offsets)) ||
+	    (ocf >= hci_cmd_con_handle_offsets[ogf].count))
+		return NULL;
+
+	offset = hci_cmd_con_handle_offsets[ogf].offsets[ocf];
+	return offset ? (u8 *)payload + offset - 1 : NULL;
+}
+
+static inline u8 *hci_event_con_handle_field(u8 event, void *payload)
+{
+	u8 offset;
+
+	if (event >= ARRAY_SIZE(hci_event_con_handle_offset))
+		return NULL;
+
+	offset = hci_event_con_handle_offset[event];
+	return offset ? (u8 *)payload + offset - 1 : NULL;
+}
+
+static inline u16 hci_con_handle_read(const u8 *field)
+{
+	return field[0] | (field[1] << 8);
+}
+
+u16 hci_state_get_max_acl_size(void)
+{
+	/* The size of the ACL packets the controller can send to the host is
+	 * the one the host announced with Host_Buffer_Size */
+	if (hci_host_max_acl_size)
+		return hci_host_max_acl_size;
+
+	/* Otherwise assume that the host sized its buffers like the controller's */
+#ifdef FAKEMOTE_STANDALONE
+	return STANDALONE_MAX_ACL_SIZE;
+#else
+	if (hci_cmd_cache_find(HCI_CMD_READ_BUFFER_SIZE)->valid)
+		return le16toh(hci_cached_buffer_size.max_acl_size);
+
+	return HCI_DEFAULT_MAX_ACL_SIZE;
+#endif
+}
+
+u16 hci_state_get_host_num_acl_pkts(void)
+{
+	return hci_host_num_acl_pkts;
 }
 
 /* HCI handlers */
@@ -109,8 +602,6 @@ void hci_state_handle_hci_cmd_from_host(void *data, u32 length, bool *fwd_to_usb
 	hci_cmd_hdr_t *hdr = data;
 	void *payload = (void *)((u8 *)hdr + sizeof(hci_cmd_hdr_t));
 	u16 opcode = le16toh(hdr->opcode);
-	u16 virt, phys = 0;
-	bool success;
 
 	LOG_DEBUG("H > C HCI CMD: opcode: 0x%04x\n", opcode);
 
@@ -122,26 +613,27 @@ void hci_state_handle_hci_cmd_from_host(void *data, u32 length, bool *fwd_to_usb
 		return;
 	}
 
-#define TRANSLATE_CON_HANDLE(event, type) \
-	case event: { \
-		type *cp = (type *)payload; \
-		virt = le16toh(cp->con_handle); \
-		success = hci_virt_con_handle_get_phys(virt, &phys); \
-		assert(success); \
-		cp->con_handle = htole16(phys); \
-		os_sync_after_write(&cp->con_handle, sizeof(cp->con_handle)); \
-		break; \
-	}
-
+#ifdef FAKEMOTE_STANDALONE
+	hci_state_standalone_handle_hci_cmd(opcode, payload);
+	*fwd_to_usb = false;
+#else
 	switch (opcode) {
+	case HCI_CMD_READ_LOCAL_VER:
+	case HCI_CMD_READ_LOCAL_FEATURES:
+	case HCI_CMD_READ_BUFFER_SIZE:
+	case HCI_CMD_READ_BDADDR:
+		if (hci_cmd_cache_reply(opcode))
+			*fwd_to_usb = false;
+		break;
 	case HCI_CMD_CREATE_CON:
 		/* TODO */
 		assert(0);
 		break;
-	TRANSLATE_CON_HANDLE(HCI_CMD_DISCONNECT, hci_discon_cp)
 	case HCI_CMD_WRITE_SCAN_ENABLE: {
 		hci_write_scan_enable_cp *cp = payload;
 		hci_page_scan_enable = cp->scan_enable;
+		/* Pending connection requests depend on it */
+		periodic_timer_request_update();
 		break;
 	}
 	case HCI_CMD_WRITE_UNIT_CLASS: {
@@ -151,101 +643,71 @@ void hci_state_handle_hci_cmd_from_host(void *data, u32 length, bool *fwd_to_usb
 		hci_unit_class[2] = cp->uclass[2];
 		break;
 	}
-	TRANSLATE_CON_HANDLE(HCI_CMD_ADD_SCO_CON, hci_add_sco_con_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_CHANGE_CON_PACKET_TYPE, hci_change_con_pkt_type_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_AUTH_REQ, hci_auth_req_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_SET_CON_ENCRYPTION, hci_set_con_encryption_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_CHANGE_CON_LINK_KEY, hci_change_con_link_key_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_READ_REMOTE_FEATURES, hci_read_remote_features_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_READ_REMOTE_EXTENDED_FEATURES, hci_read_remote_extended_features_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_READ_REMOTE_VER_INFO, hci_read_remote_ver_info_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_READ_CLOCK_OFFSET, hci_read_clock_offset_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_READ_LMP_HANDLE, hci_read_lmp_handle_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_SETUP_SCO_CON, hci_setup_sco_con_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_HOLD_MODE, hci_hold_mode_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_SNIFF_MODE, hci_sniff_mode_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_EXIT_SNIFF_MODE, hci_exit_sniff_mode_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_PARK_MODE, hci_park_mode_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_EXIT_PARK_MODE, hci_exit_park_mode_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_QOS_SETUP, hci_qos_setup_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_ROLE_DISCOVERY, hci_role_discovery_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_READ_LINK_POLICY_SETTINGS, hci_read_link_policy_settings_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_WRITE_LINK_POLICY_SETTINGS, hci_write_link_policy_settings_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_FLOW_SPECIFICATION, hci_flow_specification_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_SNIFF_SUBRATING, hci_sniff_subrating_cp)
 	case HCI_CMD_RESET:
 		LOG_DEBUG("HCI_CMD_RESET\n");
 		hci_state_reset();
 		break;
-	TRANSLATE_CON_HANDLE(HCI_CMD_FLUSH, hci_flush_cp)
 	case HCI_CMD_READ_STORED_LINK_KEY: {
 		hci_read_stored_link_key_cp *cp = payload;
 		/* Save requested info to patch the corresponding Command Complete Event */
 		hci_read_stored_link_key_read_all = cp->read_all;
 		break;
 	}
-	TRANSLATE_CON_HANDLE(HCI_CMD_READ_AUTO_FLUSH_TIMEOUT, hci_read_auto_flush_timeout_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_WRITE_AUTO_FLUSH_TIMEOUT, hci_write_auto_flush_timeout_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_READ_XMIT_LEVEL, hci_read_xmit_level_cp)
+	case HCI_CMD_HOST_BUFFER_SIZE: {
+		hci_host_buffer_size_cp *cp = payload;
+		/* Size and number of the ACL packets we can inject */
+		hci_host_max_acl_size = le16toh(cp->max_acl_size);
+		hci_host_num_acl_pkts = le16toh(cp->num_acl_pkts);
+		break;
+	}
 	case HCI_CMD_HOST_NUM_COMPL_PKTS:
 		/* TODO: Is this command ever sent actually? */
 		assert(0);
 		break;
-	TRANSLATE_CON_HANDLE(HCI_CMD_READ_LINK_SUPERVISION_TIMEOUT, hci_read_link_supervision_timeout_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_WRITE_LINK_SUPERVISION_TIMEOUT, hci_write_link_supervision_timeout_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_REFRESH_ENCRYPTION_KEY, hci_refresh_encryption_key_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_ENHANCED_FLUSH, hci_enhanced_flush_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_READ_FAILED_CONTACT_CNTR, hci_read_failed_contact_cntr_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_RESET_FAILED_CONTACT_CNTR, hci_reset_failed_contact_cntr_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_READ_LINK_QUALITY, hci_read_link_quality_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_READ_RSSI, hci_read_rssi_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_READ_AFH_CHANNEL_MAP, hci_read_afh_channel_map_cp)
-	TRANSLATE_CON_HANDLE(HCI_CMD_READ_CLOCK, hci_read_clock_cp)
+	default: {
+		u8 *con_handle = hci_cmd_con_handle_field(opcode, payload);
+		u16 virt, phys = 0;
+		bool success;
+		if (con_handle) {
+			virt = hci_con_handle_read(con_handle);
+			success = hci_virt_con_handle_get_phys(virt, &phys);
+			assert(success);
+			hci_con_handle_patch(con_handle, virt, phys);
+		}
+		break;
+	}
 	}
-#undef TRANSLATE_CON_HANDLE
+#endif
 }
 
-void hci_state_handle_hci_event_from_controller(void *data, u32 length)
+u32 hci_state_handle_hci_event_from_controller(void *data, u32 length, u32 size)
 {
 	bool ret;
 	bool success;
 	u16 phys, virt = 0;
 	hci_event_hdr_t *hdr = data;
 	void *payload = (void *)((u8 *)hdr + sizeof(hci_event_hdr_t));
+	u8 *con_handle;
 
 	/* Here we just have to patch the HCI connection handles from physical to virtual,
 	 * and check for connection/disconnection events to create/remove the mappings.  */
 
 	LOG_DEBUG("C > H HCI EVT: event: 0x%02x, len: 0x%x\n", hdr->event, hdr->length);
 
-#define TRANSLATE_CON_HANDLE(event, type) \
-	case event: { \
-		type *ep = (type *)payload; \
-		phys = le16toh(ep->con_handle); \
-		success = hci_virt_con_handle_get_virt(phys, &virt); \
-		assert(success); \
-		ep->con_handle = htole16(virt); \
-		os_sync_after_write(&ep->con_handle, sizeof(ep->con_handle)); \
-		break; \
-	}
-
 	switch (hdr->event) {
 	case HCI_EVENT_CON_COMPL: {
 		hci_con_compl_ep *ep = payload;
 		/* The BT controller sent us the *physical* HCI handle for the new connection.
-		 * Allocate a new virtual HCI handle and map it. */
+		 * Map it to a virtual HCI handle, which is the same one whenever possible. */
 		LOG_DEBUG("HCI_EVENT_CON_COMPL: status: 0x%x, handle: 0x%x\n",
 			ep->status, le16toh(ep->con_handle));
 		if (ep->status == 0) {
-			/* Allocate a new virtual connection handle */
-			virt = hci_con_handle_virt_alloc();
+			phys = le16toh(ep->con_handle);
 			/* Create the new connection handle mapping */
-			ret = hci_virt_con_handle_map(le16toh(ep->con_handle), virt);
+			ret = hci_virt_con_handle_map(phys, &virt);
 			assert(ret);
-			LOG_DEBUG("New HCI connection. Mapping: p 0x%x -> v 0x%x\n",
-				le16toh(ep->con_handle), virt);
-			ep->con_handle = htole16(virt);
-			os_sync_after_write(&ep->con_handle, sizeof(ep->con_handle));
+			LOG_DEBUG("New HCI connection. Mapping: p 0x%x -> v 0x%x\n", phys, virt);
+			hci_con_handle_patch(&ep->con_handle, phys, virt);
 		}
 		break;
 	}
@@ -256,26 +718,21 @@ void hci_state_handle_hci_event_from_controller(void *data, u32 length)
 		LOG_DEBUG("HCI_EVENT_DISCON_COMPL: status: 0x%x, handle: 0x%x, reason: 0x%x\n",
 			ep->status, le16toh(ep->con_handle), ep->reason);
 		if (ep->status == 0) {
-			ret = hci_virt_con_handle_get_virt(le16toh(ep->con_handle), &virt);
+			phys = le16toh(ep->con_handle);
+			ret = hci_virt_con_handle_get_virt(phys, &virt);
 			assert(ret);
 			/* Remove the connection handle mapping */
 			ret = hci_virt_con_handle_unmap_virt(virt);
 			assert(ret);
-			ep->con_handle = htole16(virt);
-			os_sync_after_write(&ep->con_handle, sizeof(ep->con_handle));
+			hci_con_handle_patch(&ep->con_handle, phys, virt);
 		}
 		break;
 	}
-	TRANSLATE_CON_HANDLE(HCI_EVENT_AUTH_COMPL, hci_auth_compl_ep)
-	TRANSLATE_CON_HANDLE(HCI_EVENT_ENCRYPTION_CHANGE, hci_encryption_change_ep)
-	TRANSLATE_CON_HANDLE(HCI_EVENT_CHANGE_CON_LINK_KEY_COMPL, hci_change_con_link_key_compl_ep)
-	TRANSLATE_CON_HANDLE(HCI_EVENT_MASTER_LINK_KEY_COMPL, hci_master_link_key_compl_ep)
-	TRANSLATE_CON_HANDLE(HCI_EVENT_READ_REMOTE_FEATURES_COMPL, hci_read_remote_features_compl_ep)
-	TRANSLATE_CON_HANDLE(HCI_EVENT_READ_REMOTE_VER_INFO_COMPL, hci_read_remote_ver_info_compl_ep)
-	TRANSLATE_CON_HANDLE(HCI_EVENT_QOS_SETUP_COMPL, hci_qos_setup_compl_ep)
 	case HCI_EVENT_COMMAND_COMPL: {
 		hci_command_compl_ep *ep = payload;
 		u16 opcode = le16toh(ep->opcode);
+		hci_cmd_cache_store(opcode, (u8 *)ep + sizeof(*ep),
+				    hdr->length - MIN2(hdr->length, sizeof(*ep)));
 		if (opcode == HCI_CMD_READ_STORED_LINK_KEY) {
 			hci_read_stored_link_key_rp *rp = (void *)((u8 *)ep + sizeof(*ep));
 			u16 max_num_keys = le16toh(rp->max_num_keys);
@@ -284,43 +741,54 @@ void hci_state_handle_hci_event_from_controller(void *data, u32 length)
 			if (hci_read_stored_link_key_read_all) {
 				rp->max_num_keys = htole16(max_num_keys + MAX_FAKE_WIIMOTES);
 				rp->num_keys_read = htole16(num_keys_read + MAX_FAKE_WIIMOTES);
-				os_sync_after_write(rp, sizeof(*rp));
+				cache_dirty_add(rp, sizeof(*rp));
 			}
 		}
 		break;
 	}
-	TRANSLATE_CON_HANDLE(HCI_EVENT_FLUSH_OCCUR, hci_flush_occur_ep)
 	case HCI_EVENT_NUM_COMPL_PKTS: {
 		hci_num_compl_pkts_ep *ep = payload;
 		hci_num_compl_pkts_info *info = (void *)((u8 *)ep + sizeof(*ep));
+		bool rewritten = false;
 		/* Translate all HCI Connection Handles */
 		for (int i = 0; i < ep->num_con_handles; i++) {
 			phys = le16toh(info[i].con_handle);
 			success = hci_virt_con_handle_get_virt(phys, &virt);
 			assert(success);
-			info[i].con_handle = htole16(virt);
+			rewritten |= hci_con_handle_rewrite(&info[i].con_handle, phys, virt);
+		}
+		if ((ep->num_con_handles > 0) && !rewritten)
+			g_hci_con_handles_identity++;
+		/* Append the completed packets of the fake Wiimotes if they fit */
+		if (size > length) {
+			u32 room = MIN2(size - length, 0xFF - hdr->length) / sizeof(*info);
+			u8 num = fake_wiimote_mgr_piggyback_num_compl_pkts(&info[ep->num_con_handles],
+									   room);
+			if (num > 0) {
+				cache_dirty_add(&info[ep->num_con_handles], num * sizeof(*info));
+				ep->num_con_handles += num;
+				hdr->length += num * sizeof(*info);
+				cache_dirty_add(data, sizeof(*hdr) + sizeof(*ep));
+				length += num * sizeof(*info);
+			}
 		}
-		os_sync_after_write(info, ep->num_con_handles * sizeof(hci_num_compl_pkts_info));
 		break;
 	}
-	TRANSLATE_CON_HANDLE(HCI_EVENT_MODE_CHANGE, hci_mode_change_ep)
-	TRANSLATE_CON_HANDLE(HCI_EVENT_MAX_SLOT_CHANGE, hci_max_slot_change_ep)
-	TRANSLATE_CON_HANDLE(HCI_EVENT_READ_CLOCK_OFFSET_COMPL, hci_read_clock_offset_compl_ep)
-	TRANSLATE_CON_HANDLE(HCI_EVENT_CON_PKT_TYPE_CHANGED, hci_con_pkt_type_changed_ep)
-	TRANSLATE_CON_HANDLE(HCI_EVENT_QOS_VIOLATION, hci_qos_violation_ep)
-	TRANSLATE_CON_HANDLE(HCI_EVENT_FLOW_SPECIFICATION_COMPL, hci_flow_specification_compl_ep)
-	TRANSLATE_CON_HANDLE(HCI_EVENT_READ_REMOTE_EXTENDED_FEATURES, hci_read_remote_extended_features_ep)
-	TRANSLATE_CON_HANDLE(HCI_EVENT_SCO_CON_COMPL, hci_sco_con_compl_ep)
-	TRANSLATE_CON_HANDLE(HCI_EVENT_SCO_CON_CHANGED, hci_sco_con_changed_ep)
-	TRANSLATE_CON_HANDLE(HCI_EVENT_SNIFF_SUBRATING, hci_sniff_subrating_ep)
-	TRANSLATE_CON_HANDLE(HCI_EVENT_ENCRYPTION_KEY_REFRESH, hci_encryption_key_refresh_ep)
-	TRANSLATE_CON_HANDLE(HCI_EVENT_LINK_SUPERVISION_TO_CHANGED, hci_link_supervision_to_changed_ep)
-	TRANSLATE_CON_HANDLE(HCI_EVENT_ENHANCED_FLUSH_COMPL, hci_enhanced_flush_compl_ep)
+	default:
+		con_handle = hci_event_con_handle_field(hdr->event, payload);
+		if (con_handle) {
+			phys = hci_con_handle_read(con_handle);
+			success = hci_virt_con_handle_get_virt(phys, &virt);
+			assert(success);
+			hci_con_handle_patch(con_handle, phys, virt);
+		}
+		break;
 	}
-#undef TRANSLATE_CON_HANDLE
+
+	return length;
 }
 
-void hci_state_handle_acl_data_in_response_from_controller(void *data, u32 length)
+u32 hci_state_handle_acl_data_in_response_from_controller(void *data, u32 length, u32 size)
 {
 	bool ret;
 	u16 virt = 0;
@@ -336,24 +804,21 @@ void hci_state_handle_acl_data_in_response_from_controller(void *data, u32 lengt
 
 	ret = hci_virt_con_handle_get_virt(phys, &virt);
 	assert(ret);
-	hdr->con_handle = htole16(HCI_MK_CON_HANDLE(virt, pb, pc));
 
 	LOG_DEBUG("    p 0x%x -> v 0x%x\n", phys, virt);
 
-	/* Flush modified data */
-	os_sync_after_write(&hdr->con_handle, sizeof(hdr->con_handle));
+	/* Modified data is flushed before the message is handed over */
+	hci_con_handle_patch(&hdr->con_handle, handle_pb_bc, HCI_MK_CON_HANDLE(virt, pb, pc));
+
+	return length;
 }
 
 void hci_state_handle_acl_data_out_request_from_host(void *data, u32 length, bool *fwd_to_usb)
 {
-	bool ret;
-	u16 phys = 0;
 	hci_acldata_hdr_t *hdr = data;
 	u16 handle_pb_bc = le16toh(hdr->con_handle);
 	u16 payload_len = le16toh(hdr->length);
 	u16 virt = HCI_CON_HANDLE(handle_pb_bc);
-	u16 pb = HCI_PB_FLAG(handle_pb_bc);
-	u16 pc = HCI_BC_FLAG(handle_pb_bc);
 	UNUSED(payload_len);
 
 	LOG_DEBUG("H > C ACL OUT: vcon_handle: 0x%x, len: 0x%x\n", virt, payload_len);
@@ -364,12 +829,22 @@ void hci_state_handle_acl_data_out_request_from_host(void *data, u32 length, boo
 		return;
 	}
 
+#ifdef FAKEMOTE_STANDALONE
+	/* Data for a fake Wiimote that has just disconnected. There's no one to send it to */
+	LOG_DEBUG("Dropping ACL data for unknown connection 0x%x\n", virt);
+	*fwd_to_usb = false;
+#else
+	u16 pb = HCI_PB_FLAG(handle_pb_bc);
+	u16 pc = HCI_BC_FLAG(handle_pb_bc);
+	u16 phys = 0;
+	bool ret;
+
 	ret = hci_virt_con_handle_get_phys(virt, &phys);
 	assert(ret);
-	hdr->con_handle = htole16(HCI_MK_CON_HANDLE(phys, pb, pc));
 
 	LOG_DEBUG("    v 0x%x -> p 0x%x\n", virt, phys);
 
-	/* Flush modified data */
-	os_sync_after_write(&hdr->con_handle, sizeof(hdr->con_handle));
+	/* Modified data is flushed before the message is handed over */
+	hci_con_handle_patch(&hdr->con_handle, handle_pb_bc, HCI_MK_CON_HANDLE(phys, pb, pc));
+#endif
 }
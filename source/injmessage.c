@@ -1,10 +1,19 @@
+#include "globals.h"
 #include "hci.h"
+#include "hci_state.h"
 #include "injmessage.h"
 #include "l2cap.h"
 #include "syscalls.h"
 #include "utils.h"
 
-#define INJMESSAGE_HEAP_SIZE	(4 * 1024)
+#define INJMESSAGE_HEAP_SIZE	(9 * 1024)
+
+/* Fragments an injected L2CAP frame can be split into */
+#define INJ_L2CAP_FRAGMENTS_MAX	8
+
+/* Global variables */
+u32 g_acl_fragments_injected;
+u32 g_l2cap_bytes_copied;
 
 /* Heap to allocate messages that we inject into the ReadyQ to send them to the /dev/usb/oh1 user,
  * which is the bluetooth stack beneath the WPAD library of games/apps */
@@ -24,12 +33,58 @@ int injmessage_init_heap(void)
 	return 0;
 }
 
-/* Used to allocate messages (bulk in/interrupt) to inject back to the BT SW stack */
-static inline injmessage *injmessage_alloc(void **data, u16 size)
+/* Endpoint (bulk in/interrupt) the injected messages are sent through */
+typedef struct {
+	void *(*claim_pending_msg)(void **data, u16 size);
+	bool (*reserve)(u32 num);
+	void (*unreserve)(u32 num);
+} injmessage_ep_t;
+
+static const injmessage_ep_t usb_intr_ep = {
+	.claim_pending_msg = claim_usb_intr_pending_msg,
+	.reserve = usb_intr_ready_queue_reserve,
+	.unreserve = usb_intr_ready_queue_unreserve
+};
+
+static const injmessage_ep_t usb_bulk_in_ep = {
+	.claim_pending_msg = claim_usb_bulk_in_pending_msg,
+	.reserve = usb_bulk_in_ready_queue_reserve,
+	.unreserve = usb_bulk_in_ready_queue_unreserve
+};
+
+/* Never builds the message in a host buffer. The caller reserves its room in the ReadyQ */
+static const injmessage_ep_t usb_bulk_in_heap_ep = {
+	.claim_pending_msg = NULL,
+	.reserve = NULL,
+	.unreserve = NULL
+};
+
+/* Used to allocate messages (bulk in/interrupt) to inject back to the BT SW stack.
+ * If the host has already given us a buffer to fill, the message is built in place there
+ * (the returned message is then the claimed PendingQ message). Otherwise it's allocated
+ * from the heap, if there's room for it in the ReadyQ. Either way, it has to be passed to
+ * the injection function of the endpoint. */
+static inline void *injmessage_alloc(void **data, u16 size, const injmessage_ep_t *ep)
 {
-	injmessage *msg = os_heap_alloc(injmessages_heap_id, sizeof(injmessage) + size);
-	if (!msg)
+	injmessage *msg;
+	void *pend_msg;
+
+	if (ep->claim_pending_msg) {
+		pend_msg = ep->claim_pending_msg(data, size);
+		if (pend_msg)
+			return pend_msg;
+	}
+
+	/* The host isn't taking the messages we inject, don't queue more */
+	if (ep->reserve && !ep->reserve(1))
 		return NULL;
+
+	msg = os_heap_alloc(injmessages_heap_id, sizeof(injmessage) + size);
+	if (!msg) {
+		if (ep->unreserve)
+			ep->unreserve(1);
+		return NULL;
+	}
 	msg->size = size;
 	*data = msg->data;
 	return msg;
@@ -48,10 +103,10 @@ bool is_message_injected(const void *msg)
 
 /* HCI and ACL/L2CAP message enqueue (injection) helpers */
 
-static injmessage *alloc_hci_event_msg(void **event_payload, u8 event, u8 event_size)
+static void *alloc_hci_event_msg(void **event_payload, u8 event, u8 event_size)
 {
 	hci_event_hdr_t *hdr;
-	injmessage *msg = injmessage_alloc((void **)&hdr, sizeof(*hdr) + event_size);
+	void *msg = injmessage_alloc((void **)&hdr, sizeof(*hdr) + event_size, &usb_intr_ep);
 	if (!msg)
 		return NULL;
 
@@ -63,26 +118,33 @@ static injmessage *alloc_hci_event_msg(void **event_payload, u8 event, u8 event_
 	return msg;
 }
 
-static injmessage *alloc_hci_acl_msg(void **acl_payload, u16 hci_con_handle, u16 acl_payload_size)
+static void *alloc_hci_acl_msg_from(void **acl_payload, u16 hci_con_handle, u16 pb,
+				    u16 acl_payload_size, const injmessage_ep_t *ep)
 {
 	hci_acldata_hdr_t *hdr;
-	injmessage *msg = injmessage_alloc((void **)&hdr, sizeof(*hdr) + acl_payload_size);
+	void *msg = injmessage_alloc((void **)&hdr, sizeof(*hdr) + acl_payload_size, ep);
 	if (!msg)
 		return NULL;
 
 	/* Fill message data */
-	hdr->con_handle = htole16(HCI_MK_CON_HANDLE(hci_con_handle, HCI_PACKET_START,
-						    HCI_POINT2POINT));
+	hdr->con_handle = htole16(HCI_MK_CON_HANDLE(hci_con_handle, pb, HCI_POINT2POINT));
 	hdr->length = htole16(acl_payload_size);
 	*acl_payload = (u8 *)hdr + sizeof(*hdr);
 
 	return msg;
 }
 
+static inline void *alloc_hci_acl_msg(void **acl_payload, u16 hci_con_handle, u16 pb,
+				      u16 acl_payload_size)
+{
+	return alloc_hci_acl_msg_from(acl_payload, hci_con_handle, pb, acl_payload_size,
+				      &usb_bulk_in_ep);
+}
+
 int inject_hci_event_command_status(u16 opcode)
 {
 	hci_command_status_ep *ep;
-	injmessage *msg = alloc_hci_event_msg((void *)&ep, HCI_EVENT_COMMAND_STATUS, sizeof(*ep));
+	void *msg = alloc_hci_event_msg((void *)&ep, HCI_EVENT_COMMAND_STATUS, sizeof(*ep));
 	if (!msg)
 		return IOS_ENOMEM;
 
@@ -97,7 +159,7 @@ int inject_hci_event_command_status(u16 opcode)
 int inject_hci_event_command_compl(u16 opcode, const void *payload, u32 payload_size)
 {
 	hci_command_compl_ep *ep;
-	injmessage *msg = alloc_hci_event_msg((void *)&ep, HCI_EVENT_COMMAND_COMPL,
+	void *msg = alloc_hci_event_msg((void *)&ep, HCI_EVENT_COMMAND_COMPL,
 					      sizeof(*ep) + payload_size);
 	if (!msg)
 		return IOS_ENOMEM;
@@ -111,10 +173,23 @@ int inject_hci_event_command_compl(u16 opcode, const void *payload, u32 payload_
 	return inject_msg_to_usb_intr_ready_queue(msg);
 }
 
+int inject_hci_event_inquiry_compl(u8 status)
+{
+	hci_inquiry_compl_ep *ep;
+	void *msg = alloc_hci_event_msg((void *)&ep, HCI_EVENT_INQUIRY_COMPL, sizeof(*ep));
+	if (!msg)
+		return IOS_ENOMEM;
+
+	/* Fill event data */
+	ep->status = status;
+
+	return inject_msg_to_usb_intr_ready_queue(msg);
+}
+
 int inject_hci_event_con_req(const bdaddr_t *bdaddr, u8 uclass0, u8 uclass1, u8 uclass2, u8 link_type)
 {
 	hci_con_req_ep *ep;
-	injmessage *msg = alloc_hci_event_msg((void *)&ep, HCI_EVENT_CON_REQ, sizeof(*ep));
+	void *msg = alloc_hci_event_msg((void *)&ep, HCI_EVENT_CON_REQ, sizeof(*ep));
 	if (!msg)
 		return IOS_ENOMEM;
 
@@ -131,7 +206,7 @@ int inject_hci_event_con_req(const bdaddr_t *bdaddr, u8 uclass0, u8 uclass1, u8
 int inject_hci_event_discon_compl(u16 con_handle, u8 status, u8 reason)
 {
 	hci_discon_compl_ep *ep;
-	injmessage *msg = alloc_hci_event_msg((void *)&ep, HCI_EVENT_DISCON_COMPL, sizeof(*ep));
+	void *msg = alloc_hci_event_msg((void *)&ep, HCI_EVENT_DISCON_COMPL, sizeof(*ep));
 	if (!msg)
 		return IOS_ENOMEM;
 
@@ -146,7 +221,7 @@ int inject_hci_event_discon_compl(u16 con_handle, u8 status, u8 reason)
 int inject_hci_event_con_compl(const bdaddr_t *bdaddr, u16 con_handle, u8 status)
 {
 	hci_con_compl_ep *ep;
-	injmessage *msg = alloc_hci_event_msg((void *)&ep, HCI_EVENT_CON_COMPL, sizeof(*ep));
+	void *msg = alloc_hci_event_msg((void *)&ep, HCI_EVENT_CON_COMPL, sizeof(*ep));
 	if (!msg)
 		return IOS_ENOMEM;
 
@@ -163,7 +238,7 @@ int inject_hci_event_con_compl(const bdaddr_t *bdaddr, u16 con_handle, u8 status
 int inject_hci_event_role_change(const bdaddr_t *bdaddr, u8 role)
 {
 	hci_role_change_ep *ep;
-	injmessage *msg = alloc_hci_event_msg((void *)&ep, HCI_EVENT_ROLE_CHANGE, sizeof(*ep));
+	void *msg = alloc_hci_event_msg((void *)&ep, HCI_EVENT_ROLE_CHANGE, sizeof(*ep));
 	if (!msg)
 		return IOS_ENOMEM;
 
@@ -179,7 +254,7 @@ int inject_hci_event_num_compl_pkts(u8 num_con_handles, const u16 *con_handles,
 {
 	hci_num_compl_pkts_ep *ep;
 	hci_num_compl_pkts_info *info;
-	injmessage *msg = alloc_hci_event_msg((void *)&ep, HCI_EVENT_NUM_COMPL_PKTS, sizeof(*ep) +
+	void *msg = alloc_hci_event_msg((void *)&ep, HCI_EVENT_NUM_COMPL_PKTS, sizeof(*ep) +
 					      num_con_handles * (sizeof(u16) + sizeof(u16)));
 	if (!msg)
 		return IOS_ENOMEM;
@@ -199,7 +274,7 @@ int inject_hci_event_num_compl_pkts(u8 num_con_handles, const u16 *con_handles,
 int inject_hci_event_mode_change(u16 con_handle, u8 unit_mode, u16 interval)
 {
 	hci_mode_change_ep *ep;
-	injmessage *msg = alloc_hci_event_msg((void *)&ep, HCI_EVENT_MODE_CHANGE, sizeof(*ep));
+	void *msg = alloc_hci_event_msg((void *)&ep, HCI_EVENT_MODE_CHANGE, sizeof(*ep));
 	if (!msg)
 		return IOS_ENOMEM;
 
@@ -215,7 +290,7 @@ int inject_hci_event_mode_change(u16 con_handle, u8 unit_mode, u16 interval)
 int inject_hci_event_return_link_keys(u8 num_keys, const bdaddr_t *bdaddr, const u8 key[][HCI_KEY_SIZE])
 {
 	hci_return_link_keys_ep *ep;
-	injmessage *msg = alloc_hci_event_msg((void *)&ep, HCI_EVENT_RETURN_LINK_KEYS, sizeof(*ep) +
+	void *msg = alloc_hci_event_msg((void *)&ep, HCI_EVENT_RETURN_LINK_KEYS, sizeof(*ep) +
 					      num_keys * (sizeof(bdaddr_t) + HCI_KEY_SIZE));
 	if (!msg)
 		return IOS_ENOMEM;
@@ -238,7 +313,7 @@ int inject_hci_event_return_link_keys(u8 num_keys, const bdaddr_t *bdaddr, const
 int inject_hci_event_con_pkt_type_changed(u16 con_handle, u16 pkt_type)
 {
 	hci_con_pkt_type_changed_ep *ep;
-	injmessage *msg = alloc_hci_event_msg((void *)&ep, HCI_EVENT_CON_PKT_TYPE_CHANGED, sizeof(*ep));
+	void *msg = alloc_hci_event_msg((void *)&ep, HCI_EVENT_CON_PKT_TYPE_CHANGED, sizeof(*ep));
 	if (!msg)
 		return IOS_ENOMEM;
 
@@ -253,7 +328,7 @@ int inject_hci_event_con_pkt_type_changed(u16 con_handle, u16 pkt_type)
 int inject_hci_event_auth_compl(u8 status, u16 con_handle)
 {
 	hci_auth_compl_ep *ep;
-	injmessage *msg = alloc_hci_event_msg((void *)&ep, HCI_EVENT_AUTH_COMPL, sizeof(*ep));
+	void *msg = alloc_hci_event_msg((void *)&ep, HCI_EVENT_AUTH_COMPL, sizeof(*ep));
 	if (!msg)
 		return IOS_ENOMEM;
 
@@ -267,7 +342,7 @@ int inject_hci_event_auth_compl(u8 status, u16 con_handle)
 int inject_hci_event_remote_name_req_compl(u8 status, const bdaddr_t *bdaddr, const char *name)
 {
 	hci_remote_name_req_compl_ep *ep;
-	injmessage *msg = alloc_hci_event_msg((void *)&ep, HCI_EVENT_REMOTE_NAME_REQ_COMPL,
+	void *msg = alloc_hci_event_msg((void *)&ep, HCI_EVENT_REMOTE_NAME_REQ_COMPL,
 					      sizeof(*ep));
 	if (!msg)
 		return IOS_ENOMEM;
@@ -283,7 +358,7 @@ int inject_hci_event_remote_name_req_compl(u8 status, const bdaddr_t *bdaddr, co
 int inject_hci_event_read_remote_features_compl(u16 con_handle, const u8 features[static HCI_FEATURES_SIZE])
 {
 	hci_read_remote_features_compl_ep *ep;
-	injmessage *msg = alloc_hci_event_msg((void *)&ep, HCI_EVENT_READ_REMOTE_FEATURES_COMPL,
+	void *msg = alloc_hci_event_msg((void *)&ep, HCI_EVENT_READ_REMOTE_FEATURES_COMPL,
 					      sizeof(*ep));
 	if (!msg)
 		return IOS_ENOMEM;
@@ -300,7 +375,7 @@ int inject_hci_event_read_remote_ver_info_compl(u16 con_handle, u8 lmp_version,
 						 u16 lmp_subversion)
 {
 	hci_read_remote_ver_info_compl_ep *ep;
-	injmessage *msg = alloc_hci_event_msg((void *)&ep, HCI_EVENT_READ_REMOTE_VER_INFO_COMPL,
+	void *msg = alloc_hci_event_msg((void *)&ep, HCI_EVENT_READ_REMOTE_VER_INFO_COMPL,
 					      sizeof(*ep));
 	if (!msg)
 		return IOS_ENOMEM;
@@ -318,7 +393,7 @@ int inject_hci_event_read_remote_ver_info_compl(u16 con_handle, u8 lmp_version,
 int inject_hci_event_read_clock_offset_compl(u16 con_handle, u16 clock_offset)
 {
 	hci_read_clock_offset_compl_ep *ep;
-	injmessage *msg = alloc_hci_event_msg((void *)&ep, HCI_EVENT_READ_CLOCK_OFFSET_COMPL,
+	void *msg = alloc_hci_event_msg((void *)&ep, HCI_EVENT_READ_CLOCK_OFFSET_COMPL,
 					      sizeof(*ep));
 	if (!msg)
 		return IOS_ENOMEM;
@@ -331,12 +406,13 @@ int inject_hci_event_read_clock_offset_compl(u16 con_handle, u16 clock_offset)
 	return inject_msg_to_usb_intr_ready_queue(msg);
 }
 
-static injmessage *alloc_l2cap_msg(void **l2cap_payload, u16 hci_con_handle, u16 dcid, u16 size)
+static void *alloc_l2cap_msg(void **l2cap_payload, u16 hci_con_handle, u16 dcid, u16 size)
 {
-	injmessage *msg;
+	void *msg;
 	l2cap_hdr_t *hdr;
 
-	msg = alloc_hci_acl_msg((void **)&hdr, hci_con_handle, sizeof(l2cap_hdr_t) + size);
+	msg = alloc_hci_acl_msg((void **)&hdr, hci_con_handle, HCI_PACKET_START,
+				sizeof(l2cap_hdr_t) + size);
 	if (!msg)
 		return NULL;
 
@@ -348,10 +424,10 @@ static injmessage *alloc_l2cap_msg(void **l2cap_payload, u16 hci_con_handle, u16
 	return msg;
 }
 
-static injmessage *alloc_l2cap_cmd_msg(void **l2cap_cmd_payload, u16 hci_con_handle,
+static void *alloc_l2cap_cmd_msg(void **l2cap_cmd_payload, u16 hci_con_handle,
 				       u8 code, u8 ident, u16 size)
 {
-	injmessage *msg;
+	void *msg;
 	l2cap_cmd_hdr_t *hdr;
 
 	msg = alloc_l2cap_msg((void **)&hdr, hci_con_handle, L2CAP_SIGNAL_CID,
@@ -368,22 +444,106 @@ static injmessage *alloc_l2cap_cmd_msg(void **l2cap_cmd_payload, u16 hci_con_han
 	return msg;
 }
 
+void *inject_l2cap_packet_alloc(u16 hci_con_handle, u16 dcid, u16 size, void **payload)
+{
+	/* The ACL and L2CAP headers are filled in now, the caller writes the payload in place */
+	return alloc_l2cap_msg(payload, hci_con_handle, dcid, size);
+}
+
+int inject_l2cap_packet_submit(void *msg)
+{
+	return inject_msg_to_usb_bulk_in_ready_queue(msg);
+}
+
+/* Splits an L2CAP frame that doesn't fit in the host's ACL buffers into a start packet and
+ * continuation fragments. The ReadyQ keeps the fragments of a frame together.
+ * The ReadyQ room of all the fragments is reserved and they are all allocated from the heap
+ * before any of them is submitted, so that the ReadyQ never gets a truncated frame. */
+static int inject_l2cap_packet_fragmented(u16 hci_con_handle, u16 dcid, const u8 *data,
+					  u16 size, u16 max_acl_size)
+{
+	void *msgs[INJ_L2CAP_FRAGMENTS_MAX];
+	u32 num_msgs, total;
+	l2cap_hdr_t *hdr;
+	u8 *payload;
+	u16 chunk, pb;
+	int ret;
+
+	total = sizeof(l2cap_hdr_t) + size;
+	num_msgs = (total + max_acl_size - 1) / max_acl_size;
+	if (num_msgs > ARRAY_SIZE(msgs))
+		return IOS_EINVAL;
+
+	/* The host isn't taking the messages we inject, don't queue more */
+	if (!usb_bulk_in_ready_queue_reserve(num_msgs))
+		return IOS_ENOMEM;
+
+	for (u32 i = 0; i < num_msgs; i++) {
+		chunk = MIN2(total, max_acl_size);
+		pb = (i == 0) ? HCI_PACKET_START : HCI_PACKET_FRAGMENT;
+		msgs[i] = alloc_hci_acl_msg_from((void **)&payload, hci_con_handle, pb, chunk,
+						 &usb_bulk_in_heap_ep);
+		if (!msgs[i]) {
+			usb_bulk_in_ready_queue_unreserve(num_msgs);
+			while (i-- > 0)
+				injmessage_free(msgs[i]);
+			return IOS_ENOMEM;
+		}
+
+		/* Only the start packet carries the L2CAP header */
+		if (i == 0) {
+			hdr = (l2cap_hdr_t *)payload;
+			hdr->length = htole16(size);
+			hdr->dcid = htole16(dcid);
+			payload += sizeof(l2cap_hdr_t);
+			chunk -= sizeof(l2cap_hdr_t);
+			total -= sizeof(l2cap_hdr_t);
+		}
+		memcpy(payload, data, chunk);
+		g_l2cap_bytes_copied += chunk;
+		data += chunk;
+		total -= chunk;
+	}
+
+	for (u32 i = 0; i < num_msgs; i++) {
+		ret = inject_msg_to_usb_bulk_in_ready_queue(msgs[i]);
+		if (ret != IOS_OK) {
+			/* The rest of the frame would be useless to the host */
+			usb_bulk_in_ready_queue_unreserve(num_msgs - i - 1);
+			while (++i < num_msgs)
+				injmessage_free(msgs[i]);
+			return ret;
+		}
+		g_acl_fragments_injected++;
+	}
+
+	return IOS_OK;
+}
+
 int inject_l2cap_packet(u16 hci_con_handle, u16 dcid, const void *data, u16 size)
 {
 	void *payload;
-	injmessage *msg = alloc_l2cap_msg(&payload, hci_con_handle, dcid, size);
+	void *msg;
+	u16 max_acl_size = hci_state_get_max_acl_size();
+
+	if ((sizeof(l2cap_hdr_t) + size) > max_acl_size)
+		return inject_l2cap_packet_fragmented(hci_con_handle, dcid, data, size,
+						      max_acl_size);
+
+	msg = inject_l2cap_packet_alloc(hci_con_handle, dcid, size, &payload);
 	if (!msg)
 		return IOS_ENOMEM;
 
 	/* Fill message data */
 	memcpy(payload, data, size);
+	g_l2cap_bytes_copied += size;
 
-	return inject_msg_to_usb_bulk_in_ready_queue(msg);
+	return inject_l2cap_packet_submit(msg);
 }
 
 int inject_l2cap_connect_req(u16 hci_con_handle, u16 psm, u16 scid)
 {
-	injmessage *msg;
+	void *msg;
 	l2cap_con_req_cp *req;
 
 	msg = alloc_l2cap_cmd_msg((void **)&req, hci_con_handle, L2CAP_CONNECT_REQ,
@@ -400,7 +560,7 @@ int inject_l2cap_connect_req(u16 hci_con_handle, u16 psm, u16 scid)
 
 int inject_l2cap_disconnect_req(u16 hci_con_handle, u16 dcid, u16 scid)
 {
-	injmessage *msg;
+	void *msg;
 	l2cap_discon_req_cp *req;
 
 	msg = alloc_l2cap_cmd_msg((void **)&req, hci_con_handle, L2CAP_DISCONNECT_REQ,
@@ -417,7 +577,7 @@ int inject_l2cap_disconnect_req(u16 hci_con_handle, u16 dcid, u16 scid)
 
 int inject_l2cap_disconnect_rsp(u16 hci_con_handle, u8 ident, u16 dcid, u16 scid)
 {
-	injmessage *msg;
+	void *msg;
 	l2cap_discon_rsp_cp *req;
 
 	msg = alloc_l2cap_cmd_msg((void **)&req, hci_con_handle, L2CAP_DISCONNECT_RSP,
@@ -434,7 +594,7 @@ int inject_l2cap_disconnect_rsp(u16 hci_con_handle, u8 ident, u16 dcid, u16 scid
 
 int inject_l2cap_config_req(u16 hci_con_handle, u16 remote_cid, u16 mtu, u16 flush_time_out)
 {
-	injmessage *msg;
+	void *msg;
 	l2cap_cfg_req_cp *req;
 	l2cap_cfg_opt_t *opt;
 	u32 size = sizeof(l2cap_cfg_req_cp);
@@ -477,7 +637,7 @@ int inject_l2cap_config_req(u16 hci_con_handle, u16 remote_cid, u16 mtu, u16 flu
 
 int inject_l2cap_config_rsp(u16 hci_con_handle, u16 remote_cid, u8 ident, const u8 *options, u32 options_len)
 {
-	injmessage *msg;
+	void *msg;
 	l2cap_cfg_rsp_cp *req;
 
 	msg = alloc_l2cap_cmd_msg((void **)&req, hci_con_handle, L2CAP_CONFIG_RSP,
@@ -1,9 +1,11 @@
 #include "fake_wiimote.h"
+#include "globals.h"
 #include "input_device.h"
+#include "syscalls.h"
 #include "utils.h"
 #include "types.h"
 
-#define MAX_INPUT_DEVS	2
+#define MAX_INPUT_DEVS	4
 #define RECONNECT_DELAY	200 /* 1s @ 200Hz */
 
 static struct input_device_t {
@@ -13,6 +15,14 @@ static struct input_device_t {
 	const input_device_ops_t *ops;
 	void *usrdata;
 	u32 reconnect_delay;
+	/* The flags below are written by the USB HID worker thread and read by the OH1 thread.
+	 * IOS runs them on a single core, so a byte store can't be seen half-done, but they
+	 * are volatile so that the compiler reloads them on every check of the main loop */
+	/* Set when an input event has been posted to the main loop and not handled yet */
+	volatile bool input_event_pending;
+	/* Set by the USB HID worker when the device is gone. The removal itself
+	 * is done from the main loop, which owns the fake Wiimotes and the queues */
+	volatile bool removal_pending;
 } input_devices[MAX_INPUT_DEVS];
 
 void input_devices_init(void)
@@ -21,6 +31,17 @@ void input_devices_init(void)
 		input_devices[i].valid = false;
 }
 
+static void post_input_event(input_device_t *input_device)
+{
+	/* Only one event per input device can be in flight so that we never flood the OH1 message queue */
+	if (input_device->input_event_pending)
+		return;
+
+	input_device->input_event_pending = true;
+	if (os_message_queue_send(orig_msg_queueid, input_device, IOS_MESSAGE_NOBLOCK) != IOS_OK)
+		input_device->input_event_pending = false;
+}
+
 bool input_devices_add(void *usrdata, const input_device_ops_t *ops,
 		       input_device_t **assigned_input_device)
 {
@@ -32,8 +53,12 @@ bool input_devices_add(void *usrdata, const input_device_ops_t *ops,
 			input_devices[i].ops = ops;
 			input_devices[i].usrdata = usrdata;
 			input_devices[i].reconnect_delay = 0;
+			input_devices[i].input_event_pending = false;
+			input_devices[i].removal_pending = false;
 			input_devices[i].valid = true;
 			*assigned_input_device = &input_devices[i];
+			/* Wake up the main loop in case the periodic timer is stopped */
+			post_input_event(&input_devices[i]);
 			return true;
 		}
 	}
@@ -41,6 +66,13 @@ bool input_devices_add(void *usrdata, const input_device_ops_t *ops,
 }
 
 void input_devices_remove(input_device_t *input_device)
+{
+	/* Called from the USB HID worker. From now on, the input device ops must not be called */
+	input_device->removal_pending = true;
+	post_input_event(input_device);
+}
+
+static void input_device_do_remove(input_device_t *input_device)
 {
 	fake_wiimote_t *wiimote = input_device->assigned_wiimote;
 
@@ -50,12 +82,49 @@ void input_devices_remove(input_device_t *input_device)
 		fake_wiimote_release_input_device(wiimote);
 		fake_wiimote_disconnect(wiimote);
 	}
+	input_device->removal_pending = false;
 	input_device->valid = false;
+	periodic_timer_request_update();
+	/* Only now the input device can hand its usrdata back */
+	input_device->ops->removed(input_device->usrdata);
+}
+
+void input_device_post_input_event(input_device_t *input_device)
+{
+	/* Called from the USB HID worker */
+	if (input_device->assigned_wiimote)
+		post_input_event(input_device);
+}
+
+bool input_device_is_input_event_cookie(const void *msg)
+{
+	return ((uintptr_t)msg >= (uintptr_t)&input_devices[0]) &&
+	       ((uintptr_t)msg < (uintptr_t)&input_devices[ARRAY_SIZE(input_devices)]);
+}
+
+void input_device_handle_input_event(input_device_t *input_device)
+{
+	/* Clear it first, so that new input arriving from now on posts a new event */
+	input_device->input_event_pending = false;
+
+	if (!input_device->valid)
+		return;
+
+	if (input_device->removal_pending)
+		input_device_do_remove(input_device);
+	else if (input_device->assigned_wiimote)
+		fake_wiimote_handle_input_event(input_device->assigned_wiimote);
+	else /* Newly added, it's waiting for a fake Wiimote */
+		periodic_timer_request_update();
 }
 
 void input_devices_tick(void)
 {
 	for (int i = 0; i < ARRAY_SIZE(input_devices); i++) {
+		/* In case the removal event couldn't be posted */
+		if (input_devices[i].valid && input_devices[i].removal_pending)
+			input_device_do_remove(&input_devices[i]);
+
 		if (input_devices[i].valid && !input_devices[i].assigned_wiimote) {
 			if (input_devices[i].reconnect_delay > 0)
 				input_devices[i].reconnect_delay--;
@@ -63,10 +132,34 @@ void input_devices_tick(void)
 	}
 }
 
+bool input_devices_any_valid(void)
+{
+	for (int i = 0; i < ARRAY_SIZE(input_devices); i++) {
+		if (input_devices[i].valid)
+			return true;
+	}
+
+	return false;
+}
+
+bool input_devices_need_tick(void)
+{
+	/* The reconnect delay is counted in ticks */
+	for (int i = 0; i < ARRAY_SIZE(input_devices); i++) {
+		if (input_devices[i].valid &&
+		    !input_devices[i].assigned_wiimote &&
+		    input_devices[i].reconnect_delay > 0)
+			return true;
+	}
+
+	return false;
+}
+
 input_device_t *input_device_get_unassigned(void)
 {
 	for (int i = 0; i < ARRAY_SIZE(input_devices); i++) {
 		if (input_devices[i].valid &&
+		    !input_devices[i].removal_pending &&
 		    !input_devices[i].assigned_wiimote &&
 		    input_devices[i].reconnect_delay == 0) {
 			return &input_devices[i];
@@ -85,30 +178,43 @@ void input_device_release_wiimote(input_device_t *input_device)
 {
 	input_device->assigned_wiimote = NULL;
 	input_device->reconnect_delay = RECONNECT_DELAY;
-	input_device->ops->suspend(input_device->usrdata);
+	if (!input_device->removal_pending)
+		input_device->ops->suspend(input_device->usrdata);
 }
 
+/* The usrdata of an input device pending removal might already be gone (or reused) */
+
 int input_device_resume(input_device_t *input_device)
 {
+	if (input_device->removal_pending)
+		return IOS_ENOENT;
 	return input_device->ops->resume(input_device->usrdata, input_device->assigned_wiimote);
 }
 
 int input_device_suspend(input_device_t *input_device)
 {
+	if (input_device->removal_pending)
+		return IOS_ENOENT;
 	return input_device->ops->suspend(input_device->usrdata);
 }
 
 int input_device_set_leds(input_device_t *input_device, int leds)
 {
+	if (input_device->removal_pending)
+		return IOS_ENOENT;
 	return input_device->ops->set_leds(input_device->usrdata, leds);
 }
 
 int input_device_set_rumble(input_device_t *input_device, bool rumble_on)
 {
+	if (input_device->removal_pending)
+		return IOS_ENOENT;
 	return input_device->ops->set_rumble(input_device->usrdata, rumble_on);
 }
 
 bool input_device_report_input(input_device_t *input_device)
 {
+	if (input_device->removal_pending)
+		return false;
 	return input_device->ops->report_input(input_device->usrdata);
 }
@@ -25,6 +25,22 @@ void *memcpy(void *dest, const void *src, size_t n)
 	return dest;
 }
 
+void *memmove(void *dest, const void *src, size_t n)
+{
+	const char *s = src;
+	char *d = dest;
+
+	if (d <= s)
+		return memcpy(dest, src, n);
+
+	while (n) {
+		n--;
+		d[n] = s[n];
+	}
+
+	return dest;
+}
+
 int memcmp(const void *s1, const void *s2, size_t n)
 {
 	unsigned char u1, u2;
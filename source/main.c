@@ -4,6 +4,7 @@
 #include <string.h>
 #include <stdarg.h>
 
+#include "cache_ops.h"
 #include "conf.h"
 #include "fake_wiimote_mgr.h"
 #include "globals.h"
@@ -13,11 +14,13 @@
 #include "hci_state.h"
 #include "l2cap.h"
 #include "mem.h"
+#include "msg_ring.h"
 #include "syscalls.h"
 #include "tools.h"
 #include "types.h"
 #include "usb_hid.h"
 #include "utils.h"
+#include "wiimote.h"
 
 /* OH1 module hook information */
 #define OH1_IOS_ReceiveMessage_ADDR1 0x138b365c
@@ -54,11 +57,30 @@
 /* Private definitions */
 
 /* The Real Wiimmote sends report every ~5ms (200 Hz). */
-#define PERIODC_TIMER_PERIOD		5 * 1000
-#define HAND_DOWN_MSG_DATA_SIZE		4096
+#define PERIODC_TIMER_PERIOD		(5 * 1000)
+/* Period used when devices are connected but none of them has periodic work to do */
+#define PERIODC_TIMER_IDLE_PERIOD	(100 * 1000)
+/* The Starlet timer runs at 243 MHz / 128 */
+#define STARLET_TIMER_TICKS_PER_MS	1898
+/* Hand down messages per endpoint, so that several USB transfers can be in flight */
+#define HAND_DOWN_MSGS_PER_EP		3
+/* HCI events are at most 2 + 255 bytes */
+#define HCI_EVENT_HAND_DOWN_MSG_SIZE	288
+/* The Wii's BT controller sends ACL packets of up to 4 + 339 bytes. The large
+ * buffer is used when the host asks for more, in case a controller needs it */
+#define ACL_IN_HAND_DOWN_MSG_SIZE	384
+#define ACL_IN_HAND_DOWN_MSG_LARGE_SIZE	1024
+/* Max host ACL buffers handed down to OH1 as they are while no fake Wiimote is connected */
+#define ACL_IN_PASSTHROUGH_MSGS_MAX	2
 
 /* Global variables */
 u8 g_sensor_bar_position_top;
+u32 g_periodic_timer_ticks_saved;
+u32 g_periodic_timer_rate_updates;
+u32 g_ready_msgs_deferred;
+u32 g_ready_msgs_dropped;
+u32 g_ready_msgs_coalesced;
+u32 g_acl_in_passthrough;
 
 /* Required by cios-lib... */
 char *moduleName = "TST";
@@ -66,84 +88,281 @@ char *moduleName = "TST";
 /* Queue ID created by OH1 that receives ipcmessages from /dev/usb/oh1 */
 int orig_msg_queueid;
 
-/* Periodic timer with large period to tick fakedevices to check their state */
+/* Periodic timer to tick fake devices to check their state and to send continuous reports.
+ * Non-continuous data reports are sent as soon as the USB HID worker posts an input event */
 static int periodic_timer_id;
 static int periodic_timer_cookie;
 
+/* The periodic timer runs at full rate only when there's work that needs it (connection
+ * requests, linking, continuous reporting...), slows down when devices are idle and
+ * is stopped when there are no devices at all */
+typedef enum {
+	PERIODIC_TIMER_RATE_FULL,
+	PERIODIC_TIMER_RATE_IDLE,
+	PERIODIC_TIMER_RATE_STOPPED
+} periodic_timer_rate_e;
+
+static periodic_timer_rate_e periodic_timer_rate = PERIODIC_TIMER_RATE_FULL;
+static u32 periodic_timer_stop_time;
+/* Set when something the desired rate depends on might have changed */
+static bool periodic_timer_update_pending = true;
+
 /* ipcmessages used when we return from IOS_ReceiveMessage hook to communicate with the USB BT dongle */
-static u8 usb_intr_hand_down_msg_data[HAND_DOWN_MSG_DATA_SIZE] ATTRIBUTE_ALIGN(32);
-static u8 usb_intr_hand_down_msg_ioctlv_0_data = EP_HCI_EVENT;
-static u16 usb_intr_hand_down_msg_ioctlv_1_data;
-static ioctlv usb_intr_hand_down_msg_ioctlvs[3] = {
-	{&usb_intr_hand_down_msg_ioctlv_0_data, sizeof(usb_intr_hand_down_msg_ioctlv_0_data)},
-	{&usb_intr_hand_down_msg_ioctlv_1_data, sizeof(usb_intr_hand_down_msg_ioctlv_1_data)},
-	{&usb_intr_hand_down_msg_data,          sizeof(usb_intr_hand_down_msg_data)}
-};
-static ipcmessage usb_intr_hand_down_msg = {
-	.command = IOS_IOCTLV,
-	.result = IOS_OK,
-	.fd = 0, /* Filled dynamically */
-	.ioctlv = {
-		.command = USBV0_IOCTLV_INTRMSG,
-		.num_in = 2,
-		.num_io = 1,
-		.vector = usb_intr_hand_down_msg_ioctlvs
-	}
-};
-static bool usb_intr_hand_down_msg_pending = false;
-
-static u8 usb_bulk_in_hand_down_msg_data[HAND_DOWN_MSG_DATA_SIZE] ATTRIBUTE_ALIGN(32);
-static u8 usb_bulk_in_hand_down_msg_ioctlv_0_data = EP_ACL_DATA_IN;
-static u16 usb_bulk_in_hand_down_msg_ioctlv_1_data;
-static ioctlv usb_bulk_in_hand_down_msg_ioctlvs[3] = {
-	{&usb_bulk_in_hand_down_msg_ioctlv_0_data, sizeof(usb_bulk_in_hand_down_msg_ioctlv_0_data)},
-	{&usb_bulk_in_hand_down_msg_ioctlv_1_data, sizeof(usb_bulk_in_hand_down_msg_ioctlv_1_data)},
-	{&usb_bulk_in_hand_down_msg_data,          sizeof(usb_bulk_in_hand_down_msg_data)}
-};
-static ipcmessage usb_bulk_in_hand_down_msg = {
-	.command = IOS_IOCTLV,
-	.result = IOS_OK,
-	.fd = 0, /* Filled dynamically */
-	.ioctlv = {
-		.command = USBV0_IOCTLV_BLKMSG,
-		.num_in = 2,
-		.num_io = 1,
-		.vector = usb_bulk_in_hand_down_msg_ioctlvs
-	}
+typedef struct {
+	ipcmessage ipc; /* Must be the first member */
+	ioctlv vectors[3];
+	u8 endpoint;
+	u16 wLength;
+	/* Size of the data buffer */
+	u16 size;
+	/* Handed down to OH1, or its data is waiting to be delivered to the host */
+	bool busy;
+	/* Completed by OH1, but an older message of the same endpoint is still in flight */
+	bool completed;
+} hand_down_msg_t;
+
+typedef struct {
+	hand_down_msg_t msgs[HAND_DOWN_MSGS_PER_EP];
+	u8 num_msgs;
+	/* Size of the largest message */
+	u16 max_size;
+	/* Messages handed down to OH1, in the order they were handed down */
+	msg_ring_t in_flight;
+	/* Host buffers handed down to OH1 as they are */
+	msg_ring_t passthrough;
+	/* Lets the HCI tracker know about the data coming from OH1. It can append to it */
+	u32 (*handle_data)(void *data, u32 length, u32 size);
+	/* The pool itself is posted to the OH1 queue to hand down more messages */
+	bool refill_posted;
+} hand_down_pool_t;
+
+static u8 usb_intr_hand_down_msg_data[HAND_DOWN_MSGS_PER_EP][HCI_EVENT_HAND_DOWN_MSG_SIZE]
+	ATTRIBUTE_ALIGN(32);
+static hand_down_pool_t usb_intr_hand_down_pool = {
+	.handle_data = hci_state_handle_hci_event_from_controller
 };
-static bool usb_bulk_in_hand_down_msg_pending = false;
 
-static void *ready_usb_intr_msg_queue_data[8];
-static int ready_usb_intr_msg_queue_id;
-static ipcmessage *pending_usb_intr_msg_queue_data[8];
-static int pending_usb_intr_msg_queue_id;
+/* One of the ACL IN messages gets the large buffer */
+static u8 usb_bulk_in_hand_down_msg_data[HAND_DOWN_MSGS_PER_EP - 1][ACL_IN_HAND_DOWN_MSG_SIZE]
+	ATTRIBUTE_ALIGN(32);
+static u8 usb_bulk_in_hand_down_msg_large_data[ACL_IN_HAND_DOWN_MSG_LARGE_SIZE] ATTRIBUTE_ALIGN(32);
+static hand_down_pool_t usb_bulk_in_hand_down_pool = {
+	.handle_data = hci_state_handle_acl_data_in_response_from_controller
+};
 
-static void *ready_usb_bulk_in_msg_queue_data[16];
-static int ready_usb_bulk_in_msg_queue_id;
-static ipcmessage *pending_usb_bulk_in_msg_queue_data[16];
-static int pending_usb_bulk_in_msg_queue_id;
+/* When a ReadyQ lane is full, messages wait in its deferred stage and are moved
+ * to the lane as soon as the host takes a message out of it. If the deferred stage
+ * is full too, stale HID data reports are dropped to make room. Other messages are
+ * never dropped: injected ones reserve their room when they are allocated. */
+typedef struct {
+	msg_ring_t ring;
+	msg_ring_t deferred;
+} ready_lane_t;
+
+/* The ReadyQ has two lanes: messages on the priority lane (HCI Command Status/Complete events
+ * and L2CAP signaling) are delivered before the ones on the data lane (HID data reports...),
+ * so that the host's command round-trips never have to wait behind queued input reports */
+typedef struct {
+	ready_lane_t prio;
+	ready_lane_t data;
+	bool (*is_prio)(const void *data, int size);
+	/* Can be NULL if the endpoint doesn't carry fragmented packets */
+	bool (*is_fragment)(const void *data, int size);
+	/* Can be NULL if no message can be dropped. Only injected messages are checked */
+	bool (*is_droppable)(const void *data, int size);
+	/* Can be NULL. Used to replace an undelivered droppable message of the same
+	 * connection with a newer one. Returns a negative value if there's no connection */
+	int (*get_con_handle)(const void *data, int size);
+	/* Injected messages allocated but not pushed yet */
+	u32 reserved;
+} ready_queue_t;
 
 /* Function prototypes */
 
 static int ensure_initalized(void);
-static int handle_bulk_intr_pending_message(ipcmessage *recv_msg, u16 size, ipcmessage **ret_msg,
-					    int ready_queue_id, int pending_queue_id,
-					    ipcmessage *hand_down_msg, bool *hand_down_msg_pending,
-					    bool *fwd_to_usb);
-static int handle_bulk_intr_ready_message(void *ready_msg, int pending_queue_id, int ready_queue_id);
+static bool is_hci_event_prio(const void *data, int size);
+static bool is_acl_data_prio(const void *data, int size);
+static bool is_acl_data_fragment(const void *data, int size);
+static bool is_acl_data_droppable(const void *data, int size);
+static int get_acl_data_con_handle(const void *data, int size);
+static int handle_bulk_intr_pending_message(ipcmessage *recv_msg, ipcmessage **ret_msg,
+					    ready_queue_t *ready_queue, msg_ring_t *pending_queue,
+					    hand_down_pool_t *hand_down_pool, bool *fwd_to_usb);
+static int handle_bulk_intr_ready_message(void *ready_msg, msg_ring_t *pending_queue,
+					  ready_queue_t *ready_queue);
+static bool ready_queue_reserve(ready_queue_t *queue, u32 num);
+
+static ready_queue_t ready_usb_intr_msg_queue = {
+	.is_prio = is_hci_event_prio,
+	.is_fragment = NULL,
+	.is_droppable = NULL,
+	.get_con_handle = NULL
+};
+static msg_ring_t pending_usb_intr_msg_queue;
+
+static ready_queue_t ready_usb_bulk_in_msg_queue = {
+	.is_prio = is_acl_data_prio,
+	.is_fragment = is_acl_data_fragment,
+	.is_droppable = is_acl_data_droppable,
+	.get_con_handle = get_acl_data_con_handle
+};
+static msg_ring_t pending_usb_bulk_in_msg_queue;
+
+/* PendingQ message taken by an injection helper to build a message directly into its buffer */
+typedef struct {
+	ipcmessage *msg;
+	u16 size;
+} claimed_msg_t;
+
+static claimed_msg_t claimed_usb_intr_msg;
+static claimed_msg_t claimed_usb_bulk_in_msg;
 
 /* Message injection helpers */
 
+static void *claim_pending_msg(msg_ring_t *pending_queue, claimed_msg_t *claimed,
+			       void **data, u16 size)
+{
+	ipcmessage *pend_msg = msg_ring_peek(pending_queue);
+
+	/* If there's a PendingQ message, the ReadyQ is empty so we can't overtake anything */
+	if (!pend_msg || claimed->msg || (size > pend_msg->ioctlv.vector[2].len))
+		return NULL;
+
+	msg_ring_pop(pending_queue);
+	claimed->msg = pend_msg;
+	claimed->size = size;
+	*data = pend_msg->ioctlv.vector[2].data;
+
+	return pend_msg;
+}
+
+static int ack_claimed_msg(claimed_msg_t *claimed)
+{
+	ipcmessage *pend_msg = claimed->msg;
+
+	claimed->msg = NULL;
+	os_sync_after_write(pend_msg->ioctlv.vector[2].data, claimed->size);
+
+	return os_message_queue_ack(pend_msg, claimed->size);
+}
+
+void *claim_usb_intr_pending_msg(void **data, u16 size)
+{
+	return claim_pending_msg(&pending_usb_intr_msg_queue, &claimed_usb_intr_msg, data, size);
+}
+
+void *claim_usb_bulk_in_pending_msg(void **data, u16 size)
+{
+	return claim_pending_msg(&pending_usb_bulk_in_msg_queue, &claimed_usb_bulk_in_msg,
+				 data, size);
+}
+
+bool usb_intr_ready_queue_reserve(u32 num)
+{
+	return ready_queue_reserve(&ready_usb_intr_msg_queue, num);
+}
+
+bool usb_bulk_in_ready_queue_reserve(u32 num)
+{
+	return ready_queue_reserve(&ready_usb_bulk_in_msg_queue, num);
+}
+
+void usb_intr_ready_queue_unreserve(u32 num)
+{
+	ready_usb_intr_msg_queue.reserved -= num;
+}
+
+void usb_bulk_in_ready_queue_unreserve(u32 num)
+{
+	ready_usb_bulk_in_msg_queue.reserved -= num;
+}
+
 int inject_msg_to_usb_intr_ready_queue(void *msg)
 {
-	return handle_bulk_intr_ready_message(msg, pending_usb_intr_msg_queue_id,
-					      ready_usb_intr_msg_queue_id);
+	if (msg == claimed_usb_intr_msg.msg)
+		return ack_claimed_msg(&claimed_usb_intr_msg);
+
+	/* The room reserved for it is now taken */
+	ready_usb_intr_msg_queue.reserved--;
+	return handle_bulk_intr_ready_message(msg, &pending_usb_intr_msg_queue,
+					      &ready_usb_intr_msg_queue);
 }
 
 int inject_msg_to_usb_bulk_in_ready_queue(void *msg)
 {
-	return handle_bulk_intr_ready_message(msg, pending_usb_bulk_in_msg_queue_id,
-					      ready_usb_bulk_in_msg_queue_id);
+	if (msg == claimed_usb_bulk_in_msg.msg)
+		return ack_claimed_msg(&claimed_usb_bulk_in_msg);
+
+	/* The room reserved for it is now taken */
+	ready_usb_bulk_in_msg_queue.reserved--;
+	return handle_bulk_intr_ready_message(msg, &pending_usb_bulk_in_msg_queue,
+					      &ready_usb_bulk_in_msg_queue);
+}
+
+u32 usb_bulk_in_pending_msgs(void)
+{
+	return msg_ring_count(&pending_usb_bulk_in_msg_queue);
+}
+
+/* Cache helpers */
+
+static inline void invalidate_vector(const ioctlv *vector)
+{
+	cache_invalidate(vector->data, vector->len);
+}
+
+static inline void invalidate_in_buffer_vector(const ioctlv *vector)
+{
+	/* We never read host buffers that we have to fill, but if they don't cover whole
+	 * cache lines, stale lines would overwrite neighbouring data when we flush them */
+	if ((((u32)vector->data | vector->len) & 0x1f) == 0)
+		g_cache_invalidations_skipped++;
+	else
+		invalidate_vector(vector);
+}
+
+/* Passthrough helpers */
+
+/* When no fake Wiimote is connected, there's nothing to inject into host ACL buffers, so
+ * OH1 can fill them directly instead of filling a hand down message that we then copy.
+ * One host buffer is always kept on the PendingQ (which also means that the ReadyQ is
+ * empty), so that a fake Wiimote that connects meanwhile has a buffer to inject into
+ * even if the ones handed down to OH1 don't complete until a real Wiimote sends data. */
+static inline bool can_passthrough_acl_in_msg(void)
+{
+#ifdef FAKEMOTE_STANDALONE
+	return false;
+#else
+	return !msg_ring_is_empty(&pending_usb_bulk_in_msg_queue) &&
+	       (msg_ring_count(&usb_bulk_in_hand_down_pool.passthrough) < ACL_IN_PASSTHROUGH_MSGS_MAX) &&
+	       !fake_wiimote_mgr_any_connected();
+#endif
+}
+
+static bool is_passthrough_msg(hand_down_pool_t *pool, const ipcmessage *msg)
+{
+	u32 count = msg_ring_count(&pool->passthrough);
+
+	for (u32 i = 0; i < count; i++) {
+		if (msg_ring_at(&pool->passthrough, i) == msg) {
+			msg_ring_remove(&pool->passthrough, i);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static int passthrough_msg_complete(hand_down_pool_t *pool, ipcmessage *msg, int retval)
+{
+	/* The buffer was invalidated before handing it down, so we can read it as is.
+	 * The HCI tracker patches it in place. */
+	if (retval > 0)
+		retval = pool->handle_data(msg->ioctlv.vector[2].data, retval,
+					   msg->ioctlv.vector[2].len);
+	cache_dirty_flush();
+
+	return os_message_queue_ack(msg, retval);
 }
 
 /* Main IOCTLV handler */
@@ -156,13 +375,14 @@ static int handle_oh1_dev_ioctlv(ipcmessage *recv_msg, ipcmessage **ret_msg, u32
 	u16 wLength;
 	u8 bEndpoint, bRequest;
 
-	/* Invalidate cache */
-	InvalidateVector(vector, inlen, iolen);
-
+	/* We only invalidate the vectors we read. Unhandled ioctlvs go to OH1 untouched */
 	switch (cmd) {
 	case USBV0_IOCTLV_CTRLMSG: {
+		invalidate_vector(&vector[1]);
 		bRequest = *(u8 *)vector[1].data;
 		if (bRequest == EP_HCI_CTRL) {
+			invalidate_vector(&vector[4]);
+			invalidate_vector(&vector[6]);
 			wLength = le16toh(*(u16 *)vector[4].data);
 			data    = vector[6].data;
 			hci_state_handle_hci_cmd_from_host(data, wLength, fwd_to_usb);
@@ -173,9 +393,12 @@ static int handle_oh1_dev_ioctlv(ipcmessage *recv_msg, ipcmessage **ret_msg, u32
 		break;
 	}
 	case USBV0_IOCTLV_BLKMSG: {
+		invalidate_vector(&vector[0]);
+		invalidate_vector(&vector[1]);
 		bEndpoint = *(u8 *)vector[0].data;
 		if (bEndpoint == EP_ACL_DATA_OUT) {
 			/* This is the ACL datapath from CPU to device (Wiimote) */
+			invalidate_vector(&vector[2]);
 			wLength = *(u16 *)vector[1].data;
 			data    = vector[2].data;
 			hci_state_handle_acl_data_out_request_from_host(data, wLength, fwd_to_usb);
@@ -185,26 +408,34 @@ static int handle_oh1_dev_ioctlv(ipcmessage *recv_msg, ipcmessage **ret_msg, u32
 			}
 		} else if (bEndpoint == EP_ACL_DATA_IN) {
 			/* We are given an ACL buffer to fill */
-			wLength = *(u16 *)vector[1].data;
-			ret = handle_bulk_intr_pending_message(recv_msg, wLength, ret_msg,
-							       ready_usb_bulk_in_msg_queue_id,
-							       pending_usb_bulk_in_msg_queue_id,
-							       &usb_bulk_in_hand_down_msg,
-							       &usb_bulk_in_hand_down_msg_pending,
-							       fwd_to_usb);
+			if (can_passthrough_acl_in_msg()) {
+				/* OH1 fills the host's buffer directly. fwd_to_usb stays set */
+				invalidate_vector(&vector[2]);
+				ret = msg_ring_push(&usb_bulk_in_hand_down_pool.passthrough, recv_msg);
+				assert(ret == IOS_OK);
+				g_acl_in_passthrough++;
+			} else {
+				invalidate_in_buffer_vector(&vector[2]);
+				ret = handle_bulk_intr_pending_message(recv_msg, ret_msg,
+								       &ready_usb_bulk_in_msg_queue,
+								       &pending_usb_bulk_in_msg_queue,
+								       &usb_bulk_in_hand_down_pool,
+								       fwd_to_usb);
+			}
 		}
 		break;
 	}
 	case USBV0_IOCTLV_INTRMSG: {
+		invalidate_vector(&vector[0]);
+		invalidate_vector(&vector[1]);
 		bEndpoint = *(u8 *)vector[0].data;
 		if (bEndpoint == EP_HCI_EVENT) {
-			wLength = *(u16 *)vector[1].data;
+			invalidate_in_buffer_vector(&vector[2]);
 			/* We are given a HCI buffer to fill */
-			ret = handle_bulk_intr_pending_message(recv_msg, wLength, ret_msg,
-							       ready_usb_intr_msg_queue_id,
-							       pending_usb_intr_msg_queue_id,
-							       &usb_intr_hand_down_msg,
-							       &usb_intr_hand_down_msg_pending,
+			ret = handle_bulk_intr_pending_message(recv_msg, ret_msg,
+							       &ready_usb_intr_msg_queue,
+							       &pending_usb_intr_msg_queue,
+							       &usb_intr_hand_down_pool,
 							       fwd_to_usb);
 		}
 		break;
@@ -230,7 +461,6 @@ static inline void copy_data_to_ipcmessage(ipcmessage *dst, const void *src, u16
 
 static inline void configure_hand_down_msg(ipcmessage *msg, int fd, u16 wLength)
 {
-	assert(wLength <= HAND_DOWN_MSG_DATA_SIZE);
 
 	*(u16 *)msg->ioctlv.vector[1].data = wLength;
 	msg->ioctlv.vector[2].len = wLength;
@@ -239,6 +469,135 @@ static inline void configure_hand_down_msg(ipcmessage *msg, int fd, u16 wLength)
 	os_sync_before_read(msg->ioctlv.vector[2].data, wLength);
 }
 
+/* Hand down message pool helpers */
+
+static void hand_down_pool_add_msg(hand_down_pool_t *pool, u32 ioctlv_cmd, u8 endpoint,
+				   void *data, u16 size)
+{
+	hand_down_msg_t *msg;
+
+	assert(pool->num_msgs < HAND_DOWN_MSGS_PER_EP);
+	msg = &pool->msgs[pool->num_msgs++];
+	pool->max_size = MAX2(pool->max_size, size);
+
+	msg->endpoint = endpoint;
+	msg->size = size;
+	msg->vectors[0].data = &msg->endpoint;
+	msg->vectors[0].len = sizeof(msg->endpoint);
+	msg->vectors[1].data = &msg->wLength;
+	msg->vectors[1].len = sizeof(msg->wLength);
+	msg->vectors[2].data = data;
+	msg->vectors[2].len = size;
+	msg->ipc.command = IOS_IOCTLV;
+	msg->ipc.result = IOS_OK;
+	msg->ipc.fd = 0; /* Filled dynamically */
+	msg->ipc.ioctlv.command = ioctlv_cmd;
+	msg->ipc.ioctlv.num_in = 2;
+	msg->ipc.ioctlv.num_io = 1;
+	msg->ipc.ioctlv.vector = msg->vectors;
+	msg->busy = false;
+	msg->completed = false;
+}
+
+static inline bool is_hand_down_msg(const hand_down_pool_t *pool, const void *msg)
+{
+	return ((uintptr_t)msg >= (uintptr_t)&pool->msgs[0]) &&
+	       ((uintptr_t)msg < (uintptr_t)&pool->msgs[pool->num_msgs]);
+}
+
+static inline bool hand_down_pool_can_submit(const hand_down_pool_t *pool,
+					     const msg_ring_t *pending_queue)
+{
+#ifdef FAKEMOTE_STANDALONE
+	/* Host buffers are only filled with injected messages */
+	return false;
+#else
+	/* There's no point in having more transfers in flight than host buffers to fill */
+	return msg_ring_count(&pool->in_flight) < MIN2(msg_ring_count(pending_queue),
+						       pool->num_msgs);
+#endif
+}
+
+/* No message of the pool can take what OH1 might return for this host buffer, so it's
+ * handed down as it is. Only once the messages in flight have completed, so that the
+ * host still gets the data in the order OH1 returns it. */
+static ipcmessage *hand_down_pool_passthrough(hand_down_pool_t *pool, msg_ring_t *pending_queue)
+{
+	ipcmessage *pend_msg;
+
+	if (!msg_ring_is_empty(&pool->in_flight))
+		return NULL;
+
+	pend_msg = msg_ring_peek(pending_queue);
+	if (msg_ring_push(&pool->passthrough, pend_msg) != IOS_OK)
+		return NULL;
+	msg_ring_pop(pending_queue);
+
+	os_sync_before_read(pend_msg->ioctlv.vector[2].data, pend_msg->ioctlv.vector[2].len);
+
+	return pend_msg;
+}
+
+static ipcmessage *hand_down_pool_submit(hand_down_pool_t *pool, msg_ring_t *pending_queue)
+{
+	const ipcmessage *pend_msg;
+	hand_down_msg_t *msg = NULL;
+	hand_down_msg_t *cur;
+	u16 wLength;
+
+	if (!hand_down_pool_can_submit(pool, pending_queue))
+		return NULL;
+
+	/* The messages in flight fill the host buffers queued before this one */
+	pend_msg = msg_ring_at(pending_queue, msg_ring_count(&pool->in_flight));
+	wLength = *(u16 *)pend_msg->ioctlv.vector[1].data;
+	if (wLength > pool->max_size)
+		return hand_down_pool_passthrough(pool, pending_queue);
+
+	/* Use the smallest free message that fits it. If the ones that fit are all busy,
+	 * wait for one of them: completing it posts a refill */
+	for (int i = 0; i < pool->num_msgs; i++) {
+		cur = &pool->msgs[i];
+		if (!cur->busy && (cur->size >= wLength) && (!msg || (cur->size < msg->size)))
+			msg = cur;
+	}
+	if (!msg)
+		return NULL;
+
+	configure_hand_down_msg(&msg->ipc, pend_msg->fd, wLength);
+	msg->busy = true;
+	msg_ring_push(&pool->in_flight, msg);
+
+	return &msg->ipc;
+}
+
+static void hand_down_pool_post_refill(hand_down_pool_t *pool, msg_ring_t *pending_queue)
+{
+	/* Hand downs can only be returned from the IOS_ReceiveMessage hook, so wake it up */
+	if (!pool->refill_posted && hand_down_pool_can_submit(pool, pending_queue)) {
+		if (os_message_queue_send(orig_msg_queueid, pool, IOS_MESSAGE_NOBLOCK) == IOS_OK)
+			pool->refill_posted = true;
+	}
+}
+
+static ipcmessage *hand_down_pool_handle_refill(hand_down_pool_t *pool, msg_ring_t *pending_queue)
+{
+	pool->refill_posted = false;
+
+	return hand_down_pool_submit(pool, pending_queue);
+}
+
+static inline void release_ready_msg(void *ready_msg)
+{
+	if (is_message_injected(ready_msg)) {
+		/* If it was a message we injected ourselves, we have to deallocate it */
+		injmessage_free(ready_msg);
+	} else {
+		/* Otherwise it's a hand down message, which can be handed down again */
+		((hand_down_msg_t *)ready_msg)->busy = false;
+	}
+}
+
 static inline int copy_and_ack_ipcmessage(ipcmessage *pend_msg, void *ready_msg)
 {
 	int retval;
@@ -248,8 +607,6 @@ static inline int copy_and_ack_ipcmessage(ipcmessage *pend_msg, void *ready_msg)
 		ready_data = ((injmessage *)ready_msg)->data;
 		retval = ((injmessage *)ready_msg)->size;
 		copy_data_to_ipcmessage(pend_msg, ready_data, retval);
-		/* If it was a message we injected ourselves, we have to deallocate it */
-		injmessage_free(ready_msg);
 	} else {
 		ready_data = ((ipcmessage *)ready_msg)->ioctlv.vector[2].data;
 		retval = ((ipcmessage *)ready_msg)->result;
@@ -258,58 +615,380 @@ static inline int copy_and_ack_ipcmessage(ipcmessage *pend_msg, void *ready_msg)
 			copy_data_to_ipcmessage(pend_msg, ready_data, retval);
 	}
 
+	release_ready_msg(ready_msg);
+
 	/* Finally, we can ACK the message! */
 	return os_message_queue_ack(pend_msg, retval);
 }
 
-static int handle_bulk_intr_pending_message(ipcmessage *pend_msg, u16 size, ipcmessage **ret_msg,
-					    int ready_queue_id, int pending_queue_id,
-					    ipcmessage *hand_down_msg, bool *hand_down_msg_pending,
-					    bool *fwd_to_usb)
+static inline const void *get_ready_msg_data(const void *ready_msg, int *size)
+{
+	if (is_message_injected(ready_msg)) {
+		*size = ((const injmessage *)ready_msg)->size;
+		return ((const injmessage *)ready_msg)->data;
+	} else {
+		/* If result is positive, it contains the data size, an error otherwise */
+		*size = ((const ipcmessage *)ready_msg)->result;
+		return ((const ipcmessage *)ready_msg)->ioctlv.vector[2].data;
+	}
+}
+
+static bool is_hci_event_prio(const void *data, int size)
+{
+	const hci_event_hdr_t *hdr = data;
+
+	if (size < (int)sizeof(hci_event_hdr_t))
+		return false;
+
+	return (hdr->event == HCI_EVENT_COMMAND_COMPL) || (hdr->event == HCI_EVENT_COMMAND_STATUS);
+}
+
+static bool is_acl_data_prio(const void *data, int size)
+{
+	const hci_acldata_hdr_t *acl_hdr = data;
+	const l2cap_hdr_t *l2cap_hdr = (const void *)((u8 *)data + sizeof(hci_acldata_hdr_t));
+
+	if (size < (int)(sizeof(hci_acldata_hdr_t) + sizeof(l2cap_hdr_t)))
+		return false;
+
+	if (HCI_PB_FLAG(le16toh(acl_hdr->con_handle)) == HCI_PACKET_FRAGMENT)
+		return false;
+
+	/* Only L2CAP signaling packets that fit in a single ACL packet can skip the queue */
+	return (le16toh(l2cap_hdr->dcid) == L2CAP_SIGNAL_CID) &&
+	       ((le16toh(l2cap_hdr->length) + sizeof(l2cap_hdr_t)) == le16toh(acl_hdr->length));
+}
+
+static bool is_acl_data_fragment(const void *data, int size)
+{
+	const hci_acldata_hdr_t *acl_hdr = data;
+
+	if (size < (int)sizeof(hci_acldata_hdr_t))
+		return false;
+
+	return HCI_PB_FLAG(le16toh(acl_hdr->con_handle)) == HCI_PACKET_FRAGMENT;
+}
+
+static bool is_acl_data_droppable(const void *data, int size)
+{
+	const hci_acldata_hdr_t *acl_hdr = data;
+	const l2cap_hdr_t *l2cap_hdr = (const void *)((u8 *)data + sizeof(hci_acldata_hdr_t));
+	const u8 *hid = (const u8 *)l2cap_hdr + sizeof(l2cap_hdr_t);
+
+	if (size < (int)(sizeof(hci_acldata_hdr_t) + sizeof(l2cap_hdr_t) + 2))
+		return false;
+
+	if ((HCI_PB_FLAG(le16toh(acl_hdr->con_handle)) == HCI_PACKET_FRAGMENT) ||
+	    (le16toh(l2cap_hdr->dcid) == L2CAP_SIGNAL_CID))
+		return false;
+
+	/* The first fragment of a frame can't be dropped without its continuations */
+	if ((le16toh(l2cap_hdr->length) + sizeof(l2cap_hdr_t)) != le16toh(acl_hdr->length))
+		return false;
+
+	/* Only data reports (0x30-0x3f) can be dropped: a newer one will follow.
+	 * Acks, status reports and read replies have to reach the host */
+	return (hid[0] == ((HID_TYPE_DATA << 4) | HID_PARAM_INPUT)) &&
+	       ((hid[1] & 0xF0) == INPUT_REPORT_ID_BTN);
+}
+
+static int get_acl_data_con_handle(const void *data, int size)
+{
+	const hci_acldata_hdr_t *acl_hdr = data;
+
+	if (size < (int)sizeof(hci_acldata_hdr_t))
+		return -1;
+
+	return HCI_CON_HANDLE(le16toh(acl_hdr->con_handle));
+}
+
+static inline bool is_ready_msg_droppable(const ready_queue_t *queue, const void *ready_msg)
+{
+	const void *data;
+	int size;
+
+	if (!queue->is_droppable || !is_message_injected(ready_msg))
+		return false;
+
+	data = get_ready_msg_data(ready_msg, &size);
+	return queue->is_droppable(data, size);
+}
+
+static bool msg_ring_drop_oldest_stale(const ready_queue_t *queue, msg_ring_t *ring)
+{
+	void *msg;
+
+	for (u32 i = 0; i < msg_ring_count(ring); i++) {
+		msg = msg_ring_at(ring, i);
+		if (is_ready_msg_droppable(queue, msg)) {
+			msg_ring_remove(ring, i);
+			injmessage_free(msg);
+			g_ready_msgs_dropped++;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static inline int get_ready_msg_con_handle(const ready_queue_t *queue, const void *ready_msg)
+{
+	const void *data;
+	int size;
+
+	data = get_ready_msg_data(ready_msg, &size);
+	return queue->get_con_handle(data, size);
+}
+
+static bool ready_lane_coalesce(const ready_queue_t *queue, ready_lane_t *lane, void *ready_msg)
+{
+	/* Newest messages first */
+	msg_ring_t *rings[] = {&lane->deferred, &lane->ring};
+	int con_handle;
+	void *msg;
+
+	if (!queue->get_con_handle || !is_ready_msg_droppable(queue, ready_msg))
+		return false;
+
+	con_handle = get_ready_msg_con_handle(queue, ready_msg);
+	if (con_handle < 0)
+		return false;
+
+	for (int r = 0; r < ARRAY_SIZE(rings); r++) {
+		for (u32 i = msg_ring_count(rings[r]); i-- > 0;) {
+			msg = msg_ring_at(rings[r], i);
+			if (get_ready_msg_con_handle(queue, msg) != con_handle)
+				continue;
+			/* Only replace the last message of the connection, so that the new
+			 * data report doesn't overtake acks, status reports or read replies */
+			if (!is_ready_msg_droppable(queue, msg))
+				return false;
+			msg_ring_set(rings[r], i, ready_msg);
+			injmessage_free(msg);
+			g_ready_msgs_coalesced++;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static bool ready_lane_make_room(const ready_queue_t *queue, ready_lane_t *lane)
+{
+	/* The messages already in the lane are the most stale ones */
+	if (msg_ring_drop_oldest_stale(queue, &lane->ring)) {
+		msg_ring_push(&lane->ring, msg_ring_pop(&lane->deferred));
+		return true;
+	}
+
+	return msg_ring_drop_oldest_stale(queue, &lane->deferred);
+}
+
+static inline u32 ready_lane_count(const ready_lane_t *lane)
+{
+	return msg_ring_count(&lane->ring) + msg_ring_count(&lane->deferred);
+}
+
+static u32 ready_lane_count_undroppable(const ready_queue_t *queue, const ready_lane_t *lane)
+{
+	const msg_ring_t *rings[] = {&lane->ring, &lane->deferred};
+	u32 count = 0;
+
+	for (int r = 0; r < ARRAY_SIZE(rings); r++) {
+		for (u32 i = 0; i < msg_ring_count(rings[r]); i++) {
+			if (!is_ready_msg_droppable(queue, msg_ring_at(rings[r], i)))
+				count++;
+		}
+	}
+
+	return count;
+}
+
+/* Backpressure: an injected message is only allocated if it's sure to fit in the ReadyQ
+ * once pushed, whichever lane it goes to, without dropping anything but data reports.
+ * Hand down messages don't reserve room, so there's always room for all of them. */
+static bool ready_queue_reserve(ready_queue_t *queue, u32 num)
+{
+	u32 room = 2 * MSG_RING_SIZE - HAND_DOWN_MSGS_PER_EP - queue->reserved;
+	u32 used;
+
+	used = MAX2(ready_lane_count(&queue->prio), ready_lane_count(&queue->data));
+	if (used + num > room) {
+		/* Data reports make room for other messages */
+		used = MAX2(ready_lane_count_undroppable(queue, &queue->prio),
+			    ready_lane_count_undroppable(queue, &queue->data));
+		if (used + num > room)
+			return false;
+	}
+
+	queue->reserved += num;
+	return true;
+}
+
+static int ready_queue_push(ready_queue_t *queue, void *ready_msg)
+{
+	ready_lane_t *lane;
+	const void *data;
+	int size;
+
+	data = get_ready_msg_data(ready_msg, &size);
+	lane = queue->is_prio(data, size) ? &queue->prio : &queue->data;
+
+	/* Latest wins: the host doesn't need an older data report that hasn't been delivered yet */
+	if (ready_lane_coalesce(queue, lane, ready_msg))
+		return IOS_OK;
+
+	/* Messages that have been deferred must be delivered first */
+	if (msg_ring_is_empty(&lane->deferred) && (msg_ring_push(&lane->ring, ready_msg) == IOS_OK))
+		return IOS_OK;
+
+	if (msg_ring_is_full(&lane->deferred) && !ready_lane_make_room(queue, lane)) {
+		/* Everything else had its room reserved, so only a data report can get here */
+		assert(is_ready_msg_droppable(queue, ready_msg));
+		g_ready_msgs_dropped++;
+		injmessage_free(ready_msg);
+		return IOS_EQUEUEFULL;
+	}
+
+	msg_ring_push(&lane->deferred, ready_msg);
+	g_ready_msgs_deferred++;
+
+	return IOS_OK;
+}
+
+static void *ready_lane_pop(ready_lane_t *lane)
+{
+	void *msg = msg_ring_pop(&lane->ring);
+
+	/* There's room now, retry the oldest deferred message */
+	if (msg && !msg_ring_is_empty(&lane->deferred))
+		msg_ring_push(&lane->ring, msg_ring_pop(&lane->deferred));
+
+	return msg;
+}
+
+static void *ready_queue_pop(ready_queue_t *queue)
+{
+	const void *head, *data;
+	int size;
+
+	if (msg_ring_is_empty(&queue->prio.ring))
+		return ready_lane_pop(&queue->data);
+
+	/* Priority messages can't get in between the fragments of a packet
+	 * that we have already started delivering */
+	head = msg_ring_peek(&queue->data.ring);
+	if (head && queue->is_fragment) {
+		data = get_ready_msg_data(head, &size);
+		if (queue->is_fragment(data, size))
+			return ready_lane_pop(&queue->data);
+	}
+
+	return ready_lane_pop(&queue->prio);
+}
+
+static int handle_bulk_intr_pending_message(ipcmessage *pend_msg, ipcmessage **ret_msg,
+					    ready_queue_t *ready_queue, msg_ring_t *pending_queue,
+					    hand_down_pool_t *hand_down_pool, bool *fwd_to_usb)
 {
 	int ret;
 	void *ready_msg;
 
 	/* Fast-path: check if we already have a message ready to be delivered */
-	ret = os_message_queue_receive(ready_queue_id, &ready_msg, IOS_MESSAGE_NOBLOCK);
-	if (ret == IOS_OK) {
+	ready_msg = ready_queue_pop(ready_queue);
+	if (ready_msg) {
 		ret = copy_and_ack_ipcmessage(pend_msg, ready_msg);
 		/* We have already ACKed it, we don't have to hand it down to OH1 */
 		*fwd_to_usb = false;
 	} else {
 		/* Push the received message to the PendingQ */
-		ret = os_message_queue_send(pending_queue_id, pend_msg, IOS_MESSAGE_NOBLOCK);
-		if ((ret == IOS_OK) && !*hand_down_msg_pending) {
+		ret = msg_ring_push(pending_queue, pend_msg);
+		if (ret == IOS_OK) {
 			/* Hand down to OH1 a copy of the message for it to fill it from real USB data */
-			configure_hand_down_msg(hand_down_msg, pend_msg->fd, size);
-			*ret_msg = hand_down_msg;
-			*hand_down_msg_pending = true;
-		} else {
-			/* We already have a hand down message to OH1 USB pending... */
-			*fwd_to_usb = false;
+			*ret_msg = hand_down_pool_submit(hand_down_pool, pending_queue);
 		}
+		/* All the hand down messages to OH1 USB are pending... */
+		if (!*ret_msg)
+			*fwd_to_usb = false;
 	}
 
 	return ret;
 }
 
-static int handle_bulk_intr_ready_message(void *ready_msg, int pending_queue_id, int ready_queue_id)
+static int handle_bulk_intr_ready_message(void *ready_msg, msg_ring_t *pending_queue,
+					  ready_queue_t *ready_queue)
 {
 	int ret;
 	ipcmessage *pend_msg;
 
 	/* Fast-path: check if we have a PendingQ message to fill */
-	ret = os_message_queue_receive(pending_queue_id, &pend_msg, IOS_MESSAGE_NOBLOCK);
-	if (ret == IOS_OK) {
+	pend_msg = msg_ring_pop(pending_queue);
+	if (pend_msg) {
 		ret = copy_and_ack_ipcmessage(pend_msg, ready_msg);
 	} else {
 		/* Push message to ReadyQ. We store the return value/size to the "result" field */
-		ret = os_message_queue_send(ready_queue_id, ready_msg, IOS_MESSAGE_NOBLOCK);
+		ret = ready_queue_push(ready_queue, ready_msg);
 	}
 
 	return ret;
 }
 
+/* Periodic timer rate helpers */
+
+static periodic_timer_rate_e periodic_timer_get_desired_rate(void)
+{
+	if (input_devices_need_tick() || fake_wiimote_mgr_needs_tick())
+		return PERIODIC_TIMER_RATE_FULL;
+	else if (input_devices_any_valid() || fake_wiimote_mgr_any_active())
+		return PERIODIC_TIMER_RATE_IDLE;
+	else
+		return PERIODIC_TIMER_RATE_STOPPED;
+}
+
+static void periodic_timer_update_rate(void)
+{
+	periodic_timer_rate_e rate;
+	u32 elapsed_ms;
+
+	periodic_timer_update_pending = false;
+	g_periodic_timer_rate_updates++;
+
+	rate = periodic_timer_get_desired_rate();
+	if (rate == periodic_timer_rate)
+		return;
+
+	/* Account for the ticks we skipped while the timer was stopped */
+	if (periodic_timer_rate == PERIODIC_TIMER_RATE_STOPPED) {
+		elapsed_ms = ((u32)os_timer_now(periodic_timer_id) - periodic_timer_stop_time) /
+			     STARLET_TIMER_TICKS_PER_MS;
+		g_periodic_timer_ticks_saved += elapsed_ms / (PERIODC_TIMER_PERIOD / 1000);
+	}
+
+	switch (rate) {
+	case PERIODIC_TIMER_RATE_FULL:
+		os_restart_timer(periodic_timer_id, PERIODC_TIMER_PERIOD, PERIODC_TIMER_PERIOD);
+		break;
+	case PERIODIC_TIMER_RATE_IDLE:
+		os_restart_timer(periodic_timer_id, PERIODC_TIMER_IDLE_PERIOD,
+				 PERIODC_TIMER_IDLE_PERIOD);
+		break;
+	case PERIODIC_TIMER_RATE_STOPPED:
+		os_stop_timer(periodic_timer_id);
+		periodic_timer_stop_time = os_timer_now(periodic_timer_id);
+		break;
+	}
+
+	LOG_DEBUG("Periodic timer rate: %d -> %d (ticks saved: %d)\n", periodic_timer_rate,
+		  rate, g_periodic_timer_ticks_saved);
+
+	periodic_timer_rate = rate;
+}
+
+void periodic_timer_request_update(void)
+{
+	periodic_timer_update_pending = true;
+}
+
 /* Hooked functions */
 
 static int OH1_IOS_ReceiveMessage_hook(int queueid, ipcmessage **ret_msg, u32 flags)
@@ -326,6 +1005,10 @@ static int OH1_IOS_ReceiveMessage_hook(int queueid, ipcmessage **ret_msg, u32 fl
 	ensure_initalized();
 
 	while (1) {
+		/* The previous message changed whether we need to tick devices */
+		if (periodic_timer_update_pending)
+			periodic_timer_update_rate();
+
 		ret = os_message_queue_receive(queueid, &recv_data, flags);
 		if (ret != IOS_OK) {
 			LOG_DEBUG("Message queue recv err: %d\n", ret);
@@ -334,9 +1017,25 @@ static int OH1_IOS_ReceiveMessage_hook(int queueid, ipcmessage **ret_msg, u32 fl
 			*ret_msg = (ipcmessage *)0xcafef00d;
 			break;
 		} else if (recv_data == (uintptr_t)&periodic_timer_cookie) {
+			if (periodic_timer_rate == PERIODIC_TIMER_RATE_IDLE)
+				g_periodic_timer_ticks_saved += PERIODC_TIMER_IDLE_PERIOD /
+								PERIODC_TIMER_PERIOD - 1;
 			input_devices_tick();
 			fake_wiimote_mgr_tick_devices();
+			/* Ticks count down the reconnect delays and do the pending work */
+			periodic_timer_request_update();
+			fwd_to_usb = false;
+		} else if (input_device_is_input_event_cookie((void *)recv_data)) {
+			input_device_handle_input_event((input_device_t *)recv_data);
 			fwd_to_usb = false;
+		} else if (recv_data == (uintptr_t)&usb_intr_hand_down_pool) {
+			*ret_msg = hand_down_pool_handle_refill(&usb_intr_hand_down_pool,
+								&pending_usb_intr_msg_queue);
+			fwd_to_usb = (*ret_msg != NULL);
+		} else if (recv_data == (uintptr_t)&usb_bulk_in_hand_down_pool) {
+			*ret_msg = hand_down_pool_handle_refill(&usb_bulk_in_hand_down_pool,
+								&pending_usb_bulk_in_msg_queue);
+			fwd_to_usb = (*ret_msg != NULL);
 		} else {
 			recv_msg = (ipcmessage *)recv_data;
 			*ret_msg = NULL;
@@ -350,6 +1049,8 @@ static int OH1_IOS_ReceiveMessage_hook(int queueid, ipcmessage **ret_msg, u32 fl
 				u32     cmd    = recv_msg->ioctlv.command;
 				ret = handle_oh1_dev_ioctlv(recv_msg, ret_msg, cmd, vector,
 							    inlen, iolen, &fwd_to_usb);
+				/* Flush everything we patched before handing it down to OH1 */
+				cache_dirty_flush();
 			}
 		}
 
@@ -367,43 +1068,56 @@ static int OH1_IOS_ReceiveMessage_hook(int queueid, ipcmessage **ret_msg, u32 fl
 	return ret;
 }
 
-static int OH1_IOS_ResourceReply_hook(ipcmessage *ready_msg, int retval)
+static int hand_down_pool_complete(hand_down_pool_t *pool, const ipcmessage *ready_msg, int retval,
+				   msg_ring_t *pending_queue, ready_queue_t *ready_queue)
 {
-	int ret;
-	ioctlv *vector;
-	void *data;
+	int ret = IOS_OK;
+	hand_down_msg_t *head;
+	hand_down_msg_t *msg = &pool->msgs[((uintptr_t)ready_msg - (uintptr_t)&pool->msgs[0]) /
+					   sizeof(hand_down_msg_t)];
+
+	msg->ipc.result = retval;
+	msg->completed = true;
+
+	/* Deliver the completed messages in the same order they were handed down */
+	while ((head = msg_ring_peek(&pool->in_flight)) && head->completed) {
+		msg_ring_pop(&pool->in_flight);
+		head->completed = false;
+		/* Let the HCI tracker know about this response coming from OH1 */
+		if (head->ipc.result > 0) {
+			head->ipc.result = pool->handle_data(head->vectors[2].data, head->ipc.result,
+							     head->vectors[2].len);
+			cache_dirty_flush();
+		}
+		ret = handle_bulk_intr_ready_message(&head->ipc, pending_queue, ready_queue);
+	}
+
+	/* There might be more host buffers waiting for a transfer */
+	hand_down_pool_post_refill(pool, pending_queue);
+
+	return ret;
+}
 
-	if (ready_msg == &usb_intr_hand_down_msg) {
-		usb_intr_hand_down_msg_pending = 0;
+static int OH1_IOS_ResourceReply_hook(ipcmessage *ready_msg, int retval)
+{
+	if (is_hand_down_msg(&usb_intr_hand_down_pool, ready_msg)) {
 		ensure_initalized();
 		assert(ready_msg->command == IOS_IOCTLV);
 		assert(ready_msg->ioctlv.command == USBV0_IOCTLV_INTRMSG);
-		/* Let the HCI tracker know about this HCI event response coming from OH1 */
-		if (retval > 0) {
-			vector = ready_msg->ioctlv.vector;
-			data = vector[2].data;
-			hci_state_handle_hci_event_from_controller(data, retval);
-		}
-		ready_msg->result = retval;
-		ret = handle_bulk_intr_ready_message(ready_msg, pending_usb_intr_msg_queue_id,
-						     ready_usb_intr_msg_queue_id);
-		return ret;
-	} else if (ready_msg == &usb_bulk_in_hand_down_msg) {
-		usb_bulk_in_hand_down_msg_pending = 0;
+		return hand_down_pool_complete(&usb_intr_hand_down_pool, ready_msg,
+					       retval, &pending_usb_intr_msg_queue,
+					       &ready_usb_intr_msg_queue);
+	} else if (is_hand_down_msg(&usb_bulk_in_hand_down_pool, ready_msg)) {
 		ensure_initalized();
-		vector = ready_msg->ioctlv.vector;
 		assert(ready_msg->command == IOS_IOCTLV);
 		assert(ready_msg->ioctlv.command == USBV0_IOCTLV_BLKMSG);
-		/* Let the HCI tracker know about this HCI ACL IN response coming from OH1 */
-		if (retval > 0) {
-			vector = ready_msg->ioctlv.vector;
-			data = vector[2].data;
-			hci_state_handle_acl_data_in_response_from_controller(data, retval);
-		}
-		ready_msg->result = retval;
-		ret = handle_bulk_intr_ready_message(ready_msg, pending_usb_bulk_in_msg_queue_id,
-						     ready_usb_bulk_in_msg_queue_id);
-		return ret;
+		return hand_down_pool_complete(&usb_bulk_in_hand_down_pool, ready_msg,
+					       retval, &pending_usb_bulk_in_msg_queue,
+					       &ready_usb_bulk_in_msg_queue);
+	} else if (is_passthrough_msg(&usb_intr_hand_down_pool, ready_msg)) {
+		return passthrough_msg_complete(&usb_intr_hand_down_pool, ready_msg, retval);
+	} else if (is_passthrough_msg(&usb_bulk_in_hand_down_pool, ready_msg)) {
+		return passthrough_msg_complete(&usb_bulk_in_hand_down_pool, ready_msg, retval);
 	}
 
 	return os_message_queue_ack(ready_msg, retval);
@@ -415,37 +1129,26 @@ static int ensure_initalized(void)
 	int ret;
 
 	if (!initialized) {
-		/* Message queues can only be used on the process they were created in */
-		ret = os_message_queue_create(ready_usb_intr_msg_queue_data,
-					      ARRAY_SIZE(ready_usb_intr_msg_queue_data));
-		if (ret < 0)
-			return ret;
-		ready_usb_intr_msg_queue_id = ret;
-
-		ret = os_message_queue_create(pending_usb_intr_msg_queue_data,
-					      ARRAY_SIZE(pending_usb_intr_msg_queue_data));
-		if (ret < 0)
-			return ret;
-		pending_usb_intr_msg_queue_id = ret;
-
-		ret = os_message_queue_create(ready_usb_bulk_in_msg_queue_data,
-					      ARRAY_SIZE(ready_usb_bulk_in_msg_queue_data));
-		if (ret < 0)
-			return ret;
-		ready_usb_bulk_in_msg_queue_id = ret;
-
-		ret = os_message_queue_create(pending_usb_bulk_in_msg_queue_data,
-					      ARRAY_SIZE(pending_usb_bulk_in_msg_queue_data));
-		if (ret < 0)
-			return ret;
-		pending_usb_bulk_in_msg_queue_id = ret;
-
-		periodic_timer_id = os_create_timer(PERIODC_TIMER_PERIOD, PERIODC_TIMER_PERIOD,
-						    orig_msg_queueid, (u32)&periodic_timer_cookie);
+		ret = os_create_timer(PERIODC_TIMER_PERIOD, PERIODC_TIMER_PERIOD,
+				      orig_msg_queueid, (u32)&periodic_timer_cookie);
 		if (ret < 0)
 			return ret;
+		periodic_timer_id = ret;
 
 		/* Initialize global state */
+		for (int i = 0; i < ARRAY_SIZE(usb_intr_hand_down_msg_data); i++) {
+			hand_down_pool_add_msg(&usb_intr_hand_down_pool, USBV0_IOCTLV_INTRMSG,
+					       EP_HCI_EVENT, usb_intr_hand_down_msg_data[i],
+					       sizeof(usb_intr_hand_down_msg_data[i]));
+		}
+		for (int i = 0; i < ARRAY_SIZE(usb_bulk_in_hand_down_msg_data); i++) {
+			hand_down_pool_add_msg(&usb_bulk_in_hand_down_pool, USBV0_IOCTLV_BLKMSG,
+					       EP_ACL_DATA_IN, usb_bulk_in_hand_down_msg_data[i],
+					       sizeof(usb_bulk_in_hand_down_msg_data[i]));
+		}
+		hand_down_pool_add_msg(&usb_bulk_in_hand_down_pool, USBV0_IOCTLV_BLKMSG,
+				       EP_ACL_DATA_IN, usb_bulk_in_hand_down_msg_large_data,
+				       sizeof(usb_bulk_in_hand_down_msg_large_data));
 		injmessage_init_heap();
 		hci_state_reset();
 		input_devices_init();
@@ -489,85 +1192,74 @@ static s32 Patch_OH1UsbModule(void)
 	return 0;
 }
 
-static int read_conf(u8 conf_buffer[static 0x4000])
-{
-	int fd, ret;
-
-	fd = os_open("/shared2/sys/SYSCONF", IOS_OPEN_READ);
-	if (fd < 0)
-		return fd;
-
-	ret = os_read(fd, conf_buffer, 0x4000);
-
-	os_close(fd);
-
-	return ret;
-}
-
-static int write_conf(u8 conf_buffer[static 0x4000])
+static int patch_conf_bt_dinf(int conf_fd)
 {
-	int fd, ret;
-
-	fd = os_open("/shared2/sys/SYSCONF", IOS_OPEN_WRITE);
-	if (fd < 0)
-		return fd;
-
-	ret = os_write(fd, conf_buffer, 0x4000);
-
-	os_close(fd);
-
-	return ret;
-}
-
-static int patch_conf_bt_dinf(u8 conf_buffer[static CONF_SIZE])
-{
-	static struct conf_pads_setting conf_pads;
+	static struct conf_pads_setting conf_pads ATTRIBUTE_ALIGN(32);
+	struct conf_pad_device *registered = conf_pads.registered;
 	bdaddr_t bdaddr;
 	int ret;
-	int paired_count;
-	int start, count;
+	int paired_count, first_fake;
+	int before, after;
 
 	/* Get paired Wiimote configuration */
-	ret = conf_get(conf_buffer, "BT.DINF", &conf_pads, sizeof(conf_pads));
+	ret = conf_get(conf_fd, "BT.DINF", &conf_pads, sizeof(conf_pads));
 	LOG_DEBUG("conf_get(): %d\n", ret);
 	if (ret != sizeof(conf_pads))
 		return IOS_EINVAL;
 	LOG_DEBUG("  num_registered: %d\n", conf_pads.num_registered);
 
-	/* Check how many "Fake Wiimotes" are paired */
+	/* Check how many "Fake Wiimotes" are paired. They are always written
+	 * in order and next to each other */
 	paired_count = 0;
+	first_fake = conf_pads.num_registered;
 	for (int i = 0; i < conf_pads.num_registered; i++) {
-		LOG_DEBUG("  registered[%d]: \"%s\"\n", i, conf_pads.registered[i].name);
+		LOG_DEBUG("  registered[%d]: \"%s\"\n", i, registered[i].name);
+		if ((paired_count > 0) && (i != first_fake + paired_count))
+			break;
 		/* Check if the bdaddr matches */
-		baswap(&bdaddr, &conf_pads.registered[i].bdaddr);
-		if (bacmp(&bdaddr, &FAKE_WIIMOTE_BDADDR(paired_count)) == 0)
+		baswap(&bdaddr, &registered[i].bdaddr);
+		if (bacmp(&bdaddr, &FAKE_WIIMOTE_BDADDR(paired_count)) == 0) {
+			if (paired_count == 0)
+				first_fake = i;
 			paired_count++;
+		}
 	}
 	LOG_DEBUG("Found %d paired \"Fake Wiimotes\"\n", paired_count);
 
-	/* Give at least the last two entries (out of 10) for fake Wiimotes */
-	if (paired_count >= 2)
+	if (paired_count >= MAX_FAKE_WIIMOTES)
 		return 0;
-	count = 2 - paired_count;
-	start = MIN2(conf_pads.num_registered, CONF_PAD_MAX_REGISTERED - 2);
 
-	for (int i = 0; i < count; i++) {
+	/* The missing fake Wiimotes go right after the paired ones, and the pads
+	 * registered after those are moved behind them. The last MAX_FAKE_WIIMOTES
+	 * entries (out of 10) are always given to fake Wiimotes if needed: the pads
+	 * after the fake Wiimotes are dropped first, then the ones before them */
+	before = MIN2(first_fake, CONF_PAD_MAX_REGISTERED - MAX_FAKE_WIIMOTES);
+	after = MIN2(conf_pads.num_registered - first_fake - paired_count,
+		     CONF_PAD_MAX_REGISTERED - MAX_FAKE_WIIMOTES - before);
+
+	if (after > 0) {
+		memmove(&registered[before + MAX_FAKE_WIIMOTES],
+			&registered[first_fake + paired_count],
+			after * sizeof(*registered));
+	}
+	if ((paired_count > 0) && (before != first_fake)) {
+		memmove(&registered[before], &registered[first_fake],
+			paired_count * sizeof(*registered));
+	}
+
+	for (int i = paired_count; i < MAX_FAKE_WIIMOTES; i++) {
 		/* Copy MAC address */
-		baswap(&conf_pads.registered[start + i].bdaddr, &FAKE_WIIMOTE_BDADDR(i));
+		baswap(&registered[before + i].bdaddr, &FAKE_WIIMOTE_BDADDR(i));
 		/* Generate and copy the name:
 		 *   Wii memcmps the name with "Nintendo RVL-CNT-01" and size 19 */
-		snprintf(conf_pads.registered[start + i].name,
-			 sizeof(conf_pads.registered[start + i].name),
+		snprintf(registered[before + i].name, sizeof(registered[before + i].name),
 			 "Nintendo RVL-CNT-01 (Fake Wiimote %d)", i);
 	}
-	conf_pads.num_registered = start + count;
-
-	/* Write new paired Wiimote configuration back to the buffer */
-	conf_set(conf_buffer, "BT.DINF", &conf_pads, sizeof(conf_pads));
+	conf_pads.num_registered = before + MAX_FAKE_WIIMOTES + after;
 
-	/* Write updated SYSCONF back */
-	ret = write_conf(conf_buffer);
-	if (ret != CONF_SIZE)
+	/* Write new paired Wiimote configuration back to SYSCONF */
+	ret = conf_set(conf_fd, "BT.DINF", &conf_pads, sizeof(conf_pads));
+	if (ret != sizeof(conf_pads))
 		return IOS_EINVAL;
 
 	return 0;
@@ -575,8 +1267,7 @@ static int patch_conf_bt_dinf(u8 conf_buffer[static CONF_SIZE])
 
 int main(void)
 {
-	static u8 conf_buffer[CONF_SIZE];
-	int ret;
+	int conf_fd, ret;
 
 	/* Print info */
 	svc_write("$IOSVersion: FAKEMOTE:  " __DATE__ " " __TIME__ " 64M "
@@ -585,19 +1276,22 @@ int main(void)
 		  TOSTRING(FAKEMOTE_PATCH) "-"
 		  TOSTRING(FAKEMOTE_HASH) " $\n");
 
-	/* Read SYSCONF */
-	ret = read_conf(conf_buffer);
-	if (ret != CONF_SIZE)
-		return IOS_EINVAL;
+	/* Open SYSCONF */
+	conf_fd = os_open(CONF_PATH, IOS_OPEN_RW);
+	if (conf_fd < 0)
+		return conf_fd;
 
 	/* Read IR sensor bar position */
-	ret = conf_get(conf_buffer, "BT.BAR", &g_sensor_bar_position_top,
+	ret = conf_get(conf_fd, "BT.BAR", &g_sensor_bar_position_top,
 		       sizeof(g_sensor_bar_position_top));
-	if (ret != sizeof(g_sensor_bar_position_top))
+	if (ret != sizeof(g_sensor_bar_position_top)) {
+		os_close(conf_fd);
 		return IOS_EINVAL;
+	}
 
 	/* Patch SYSCONF's BT.DINF */
-	ret = patch_conf_bt_dinf(conf_buffer);
+	ret = patch_conf_bt_dinf(conf_fd);
+	os_close(conf_fd);
 	if (ret < 0)
 		return ret;
 
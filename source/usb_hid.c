@@ -71,7 +71,8 @@ static areply notification_messages[2] = {0};
 static inline usb_input_device_t *get_usb_device_for_dev_id(u32 dev_id)
 {
 	for (int i = 0; i < ARRAY_SIZE(usb_devices); i++) {
-		if (usb_devices[i].valid && (usb_devices[i].dev_id == dev_id))
+		if (usb_devices[i].valid && !usb_devices[i].disconnected &&
+		    (usb_devices[i].dev_id == dev_id))
 			return &usb_devices[i];
 	}
 
@@ -341,12 +342,21 @@ static bool usb_device_ops_report_input(void *usrdata)
 	return device->driver->report_input(device);
 }
 
+static void usb_device_ops_removed(void *usrdata)
+{
+	usb_input_device_t *device = usrdata;
+
+	/* Called from the main loop. The worker can now reuse this slot */
+	device->valid = false;
+}
+
 static const input_device_ops_t input_device_usb_ops = {
 	.resume		= usb_device_ops_resume,
 	.suspend	= usb_device_ops_suspend,
 	.set_leds	= usb_device_ops_set_leds,
 	.set_rumble	= usb_device_ops_set_rumble,
 	.report_input	= usb_device_ops_report_input,
+	.removed	= usb_device_ops_removed,
 };
 
 static void handle_device_change_reply(int host_fd, areply *reply)
@@ -367,7 +377,7 @@ static void handle_device_change_reply(int host_fd, areply *reply)
 	/* First look for disconnections */
 	for (int i = 0; i < ARRAY_SIZE(usb_devices); i++) {
 		device = &usb_devices[i];
-		if (!device->valid)
+		if (!device->valid || device->disconnected)
 			continue;
 
 		found = false;
@@ -385,10 +395,10 @@ static void handle_device_change_reply(int host_fd, areply *reply)
 
 			if (device->driver->disconnect)
 				ret = device->driver->disconnect(device);
-			/* Tell the fake Wiimote manager we got an input device removal */
+			/* Tell the fake Wiimote manager we got an input device removal. The
+			 * slot is given back by the main loop when it's done with the device */
+			device->disconnected = true;
 			input_devices_remove(device->input_device);
-			/* Set this device as not valid */
-			device->valid = false;
 		}
 	}
 
@@ -446,6 +456,7 @@ static void handle_device_change_reply(int host_fd, areply *reply)
 		device->driver = driver;
 		/* We will get a fake Wiimote assigneed at the init() callback */
 		device->wiimote = NULL;
+		device->disconnected = false;
 		device->suspended = false;
 		device->valid = true;
 
@@ -502,9 +513,12 @@ static int usb_hid_worker(void *arg)
 			/* Find if this is the reply to a USB async req issued by a device driver */
 			for (int i = 0; i < ARRAY_SIZE(usb_devices); i++) {
 				device = &usb_devices[i];
-				if (device->valid && (message == &device->usb_async_resp_msg)) {
+				if (device->valid && !device->disconnected &&
+				    (message == &device->usb_async_resp_msg)) {
 					if (device->driver->usb_async_resp)
 						device->driver->usb_async_resp(device);
+					/* Wake up the main loop to report the new input right away */
+					input_device_post_input_event(device->input_device);
 				}
 			}
 		}
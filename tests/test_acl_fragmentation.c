@@ -0,0 +1,248 @@
+#include <string.h>
+#include "fake_wiimote_mgr.h"
+#include "globals.h"
+#include "hci.h"
+#include "hci_state.h"
+#include "injmessage.h"
+#include "l2cap.h"
+#include "syscalls.h"
+#include "test_queues.h"
+#include "utils.h"
+
+/* Replays fragmented ACL traffic in both directions: frames injected to the host
+ * are split at the host's ACL buffer size, and frames sent by the host in several
+ * ACL packets are reassembled before a fake Wiimote handles them */
+
+#define TEST_CON_HANDLE		0x0042
+#define TEST_DCID		0x0040
+
+static void send_host_buffer_size(u16 max_acl_size)
+{
+	hci_host_buffer_size_cp cp = {
+		.max_acl_size = htole16(max_acl_size),
+		.max_sco_size = 64,
+		.num_acl_pkts = htole16(8),
+		.num_sco_pkts = htole16(0)
+	};
+
+	test_send_hci_cmd(HCI_CMD_HOST_BUFFER_SIZE, &cp, sizeof(cp));
+}
+
+static void test_max_acl_size(void)
+{
+	hci_state_reset();
+	CHECK(hci_state_get_max_acl_size() == 339);
+
+	send_host_buffer_size(27);
+	CHECK(hci_state_get_max_acl_size() == 27);
+
+	/* The host has to announce its buffers again after a reset */
+	test_send_hci_cmd(HCI_CMD_RESET, NULL, 0);
+	CHECK(hci_state_get_max_acl_size() == 339);
+}
+
+static void test_fragmentation(void)
+{
+	u8 frame[sizeof(l2cap_hdr_t) + 60];
+	u8 sent[sizeof(frame)];
+	const hci_acldata_hdr_t *acl;
+	u32 offset = 0;
+	u16 handle_pb;
+	int ret;
+
+	hci_state_reset();
+	send_host_buffer_size(27);
+	test_host_clear_msgs();
+	g_acl_fragments_injected = 0;
+
+	for (int i = 0; i < sizeof(frame) - sizeof(l2cap_hdr_t); i++)
+		frame[sizeof(l2cap_hdr_t) + i] = i;
+	ret = inject_l2cap_packet(TEST_CON_HANDLE, TEST_DCID, &frame[sizeof(l2cap_hdr_t)],
+				  sizeof(frame) - sizeof(l2cap_hdr_t));
+	CHECK(ret == IOS_OK);
+
+	/* 64 bytes in fragments of at most 27 bytes */
+	CHECK(test_num_bulk_in_msgs == 3);
+	CHECK(g_acl_fragments_injected == 3);
+	for (u32 i = 0; i < test_num_bulk_in_msgs; i++) {
+		acl = (const void *)test_bulk_in_msgs[i].data;
+		handle_pb = le16toh(acl->con_handle);
+		CHECK(HCI_CON_HANDLE(handle_pb) == TEST_CON_HANDLE);
+		CHECK(HCI_PB_FLAG(handle_pb) == ((i == 0) ? HCI_PACKET_START : HCI_PACKET_FRAGMENT));
+		CHECK(le16toh(acl->length) == MIN2(sizeof(frame) - offset, 27));
+		CHECK(test_bulk_in_msgs[i].size == sizeof(*acl) + le16toh(acl->length));
+		memcpy(&sent[offset], (const u8 *)acl + sizeof(*acl), le16toh(acl->length));
+		offset += le16toh(acl->length);
+	}
+	CHECK(offset == sizeof(frame));
+
+	/* The start packet carries the L2CAP header of the whole frame */
+	CHECK(le16toh(((l2cap_hdr_t *)sent)->length) == sizeof(frame) - sizeof(l2cap_hdr_t));
+	CHECK(le16toh(((l2cap_hdr_t *)sent)->dcid) == TEST_DCID);
+	CHECK(memcmp(&sent[sizeof(l2cap_hdr_t)], &frame[sizeof(l2cap_hdr_t)],
+		     sizeof(frame) - sizeof(l2cap_hdr_t)) == 0);
+}
+
+static void test_fragmentation_out_of_memory(void)
+{
+	u8 data[60] = {0};
+	int ret;
+
+	hci_state_reset();
+	send_host_buffer_size(27);
+	test_host_clear_msgs();
+
+	/* Running out of memory on the last fragment must not queue the others */
+	test_heap_allocs_left = 2;
+	ret = inject_l2cap_packet(TEST_CON_HANDLE, TEST_DCID, data, sizeof(data));
+	test_heap_allocs_left = -1;
+	CHECK(ret == IOS_ENOMEM);
+	CHECK(test_num_bulk_in_msgs == 0);
+	CHECK(test_heap_allocs_live == 0);
+	CHECK(test_bulk_in_reserved == 0);
+}
+
+static void test_fragmentation_queue_full(void)
+{
+	u8 data[60] = {0};
+	u32 injected;
+	int ret;
+
+	hci_state_reset();
+	send_host_buffer_size(27);
+
+	/* The ReadyQ only has room for 2 of the 3 fragments: none of them is allocated */
+	test_host_clear_msgs();
+	test_num_bulk_in_msgs = TEST_MSGS_MAX - 2;
+	test_heap_allocs_left = 0;
+	ret = inject_l2cap_packet(TEST_CON_HANDLE, TEST_DCID, data, sizeof(data));
+	test_heap_allocs_left = -1;
+	CHECK(ret == IOS_ENOMEM);
+	CHECK(test_num_bulk_in_msgs == TEST_MSGS_MAX - 2);
+	CHECK(test_bulk_in_reserved == 0);
+
+	/* The ReadyQ refuses the second fragment: the third one is never submitted */
+	test_host_clear_msgs();
+	injected = g_acl_fragments_injected;
+	test_bulk_in_injects_left = 1;
+	ret = inject_l2cap_packet(TEST_CON_HANDLE, TEST_DCID, data, sizeof(data));
+	test_bulk_in_injects_left = -1;
+	CHECK(ret == IOS_EQUEUEFULL);
+	CHECK(test_num_bulk_in_msgs == 1);
+	CHECK(g_acl_fragments_injected == injected + 1);
+	CHECK(test_bulk_in_reserved == 0);
+	CHECK(test_heap_allocs_live == 0);
+}
+
+/* Sends (part of) an L2CAP frame from the host to a fake Wiimote in ACL packets of at
+ * most max_size bytes. pb is the Packet Boundary flag of the first one */
+static void send_acl_frame(fake_wiimote_t *wiimote, const u8 *frame, u16 size, u16 max_size,
+			   u16 pb)
+{
+	u8 buf[sizeof(hci_acldata_hdr_t) + 255];
+	hci_acldata_hdr_t *acl = (void *)buf;
+	u16 chunk;
+
+	while (size > 0) {
+		chunk = MIN2(size, max_size);
+		acl->con_handle = htole16(HCI_MK_CON_HANDLE(wiimote->hot->hci_con_handle, pb, 0));
+		acl->length = htole16(chunk);
+		memcpy(buf + sizeof(*acl), frame, chunk);
+		fake_wiimote_handle_acl_data_out_request_from_host(wiimote, acl);
+		frame += chunk;
+		size -= chunk;
+		pb = HCI_PACKET_FRAGMENT;
+	}
+}
+
+/* Builds an L2CAP signalling frame with a Disconnection Request for a channel */
+static u16 build_disconnect_req(u8 *frame, u8 ident, u16 dcid, u16 scid)
+{
+	l2cap_hdr_t *hdr = (void *)frame;
+	l2cap_cmd_hdr_t *cmd = (void *)(hdr + 1);
+	l2cap_discon_req_cp *req = (void *)(cmd + 1);
+
+	hdr->length = htole16(sizeof(*cmd) + sizeof(*req));
+	hdr->dcid = htole16(L2CAP_SIGNAL_CID);
+	cmd->code = L2CAP_DISCONNECT_REQ;
+	cmd->ident = ident;
+	cmd->length = htole16(sizeof(*req));
+	req->dcid = htole16(dcid);
+	req->scid = htole16(scid);
+
+	return sizeof(*hdr) + sizeof(*cmd) + sizeof(*req);
+}
+
+/* Checks that the last injected message is the Disconnection Response to the request */
+static void check_disconnect_rsp(u8 ident, u16 dcid, u16 scid)
+{
+	const test_msg_t *msg = &test_bulk_in_msgs[test_num_bulk_in_msgs - 1];
+	const l2cap_cmd_hdr_t *cmd = (const void *)(msg->data + sizeof(hci_acldata_hdr_t) +
+						    sizeof(l2cap_hdr_t));
+	const l2cap_discon_rsp_cp *rsp = (const void *)(cmd + 1);
+
+	CHECK(cmd->code == L2CAP_DISCONNECT_RSP);
+	CHECK(cmd->ident == ident);
+	CHECK(le16toh(rsp->dcid) == dcid);
+	CHECK(le16toh(rsp->scid) == scid);
+}
+
+static void test_reassembly(void)
+{
+	static fake_wiimote_t wiimote;
+	static fake_wiimote_hot_t hot;
+	u8 frame[64];
+	u16 size;
+
+	hci_state_reset();
+	test_host_clear_msgs();
+	g_acl_frames_reassembled = 0;
+
+	/* Connect a fake Wiimote and open its HID control channel */
+	fake_wiimote_init(&wiimote, &hot, &FAKE_WIIMOTE_BDADDR(0));
+	fake_wiimote_init_state(&wiimote, NULL);
+	hot.active = true;
+	fake_wiimote_handle_hci_cmd_accept_con(&wiimote, HCI_ROLE_SLAVE);
+	fake_wiimote_tick(&wiimote);
+	CHECK(wiimote.psm_hid_cntl_chn.valid);
+
+	/* A frame that fits in one ACL packet is handled in place */
+	size = build_disconnect_req(frame, 1, wiimote.psm_hid_cntl_chn.local_cid, 0x0050);
+	test_host_clear_msgs();
+	send_acl_frame(&wiimote, frame, size, 255, HCI_PACKET_START);
+	CHECK(test_num_bulk_in_msgs == 1);
+	check_disconnect_rsp(1, wiimote.psm_hid_cntl_chn.local_cid, 0x0050);
+	CHECK(g_acl_frames_reassembled == 0);
+
+	/* The same request split in 5 byte fragments, the L2CAP header included */
+	wiimote.psm_hid_cntl_chn.valid = true;
+	size = build_disconnect_req(frame, 2, wiimote.psm_hid_cntl_chn.local_cid, 0x0051);
+	test_host_clear_msgs();
+	send_acl_frame(&wiimote, frame, size, 5, HCI_PACKET_START);
+	CHECK(test_num_bulk_in_msgs == 1);
+	check_disconnect_rsp(2, wiimote.psm_hid_cntl_chn.local_cid, 0x0051);
+	CHECK(g_acl_frames_reassembled == 1);
+
+	/* A continuation fragment without a start packet is dropped */
+	wiimote.psm_hid_cntl_chn.valid = true;
+	test_host_clear_msgs();
+	send_acl_frame(&wiimote, frame + 5, size - 5, 5, HCI_PACKET_FRAGMENT);
+	CHECK(test_num_bulk_in_msgs == 0);
+	CHECK(g_acl_frames_reassembled == 1);
+}
+
+int main(void)
+{
+	test_host_init();
+
+	test_max_acl_size();
+	test_fragmentation();
+	test_fragmentation_out_of_memory();
+	test_fragmentation_queue_full();
+	test_reassembly();
+
+	if (test_failures)
+		printf("%d checks failed\n", test_failures);
+
+	return test_failures ? 1 : 0;
+}
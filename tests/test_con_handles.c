@@ -0,0 +1,346 @@
+#include "test_queues.h"
+
+/* The HCI state tracker is built as is, so that its translation helpers can be timed */
+#include "hci_state.c"
+
+/* The connection handle fields of commands and events are found through offset tables,
+ * which are checked and timed against the switches they replace. Identity-mapped
+ * packets are counted once, whatever the number of handles they carry.
+ * HCI connection handle translation of every real connection, in both directions,
+ * with 1, 8 and 32 connections. The linear search over a table of virt/phys pairs
+ * that the translation used to do is timed alongside for comparison. The ACL packets
+ * then go through the whole tracker, to check the translated handles */
+
+#define TEST_BENCH_ITERATIONS	20000
+#define TEST_MAX_CONNECTIONS	32
+/* Commands and events with a connection handle field */
+#define TEST_DISPATCH_CMDS	37
+#define TEST_DISPATCH_EVENTS	21
+
+static const u32 bench_num_connections[] = {1, 8, TEST_MAX_CONNECTIONS};
+
+/* The old map table, searched linearly in both directions */
+static struct {
+	bool valid;
+	u16 virt;
+	u16 phys;
+} linear_table[TEST_MAX_CONNECTIONS];
+
+static bool linear_get_virt(u16 phys, u16 *virt)
+{
+	for (int i = 0; i < ARRAY_SIZE(linear_table); i++) {
+		if (linear_table[i].valid && (linear_table[i].phys == phys)) {
+			*virt = linear_table[i].virt;
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool linear_get_phys(u16 virt, u16 *phys)
+{
+	for (int i = 0; i < ARRAY_SIZE(linear_table); i++) {
+		if (linear_table[i].valid && (linear_table[i].virt == virt)) {
+			*phys = linear_table[i].phys;
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Physical handles handed out by the controller */
+static u16 test_phys_con_handle(int i)
+{
+	return 0x0001 + i * 0x40;
+}
+
+static void controller_con_event(u8 event, u16 con_handle)
+{
+	u8 buf[sizeof(hci_event_hdr_t) + sizeof(hci_con_compl_ep)] = {0};
+	hci_event_hdr_t *hdr = (void *)buf;
+
+	hdr->event = event;
+	if (event == HCI_EVENT_CON_COMPL) {
+		hci_con_compl_ep *ep = (void *)(hdr + 1);
+		hdr->length = sizeof(*ep);
+		ep->con_handle = htole16(con_handle);
+		ep->link_type = HCI_LINK_ACL;
+	} else {
+		hci_discon_compl_ep *ep = (void *)(hdr + 1);
+		hdr->length = sizeof(*ep);
+		ep->con_handle = htole16(con_handle);
+	}
+	hci_state_handle_hci_event_from_controller(buf, sizeof(*hdr) + hdr->length, sizeof(buf));
+}
+
+static void set_acl_con_handle(hci_acldata_hdr_t *hdr, u16 con_handle)
+{
+	hdr->con_handle = htole16(HCI_MK_CON_HANDLE(con_handle, HCI_PACKET_START, 0));
+}
+
+static void check_acl_translation(u32 num_connections)
+{
+	hci_acldata_hdr_t hdr = {0};
+	bool fwd_to_usb = true;
+	u16 phys;
+
+	for (int i = 0; i < num_connections; i++) {
+		phys = test_phys_con_handle(i);
+		set_acl_con_handle(&hdr, phys);
+		hci_state_handle_acl_data_in_response_from_controller(&hdr, sizeof(hdr), sizeof(hdr));
+		/* Real connections keep their handle */
+		CHECK(HCI_CON_HANDLE(le16toh(hdr.con_handle)) == phys);
+		hci_state_handle_acl_data_out_request_from_host(&hdr, sizeof(hdr), &fwd_to_usb);
+		CHECK(fwd_to_usb);
+		CHECK(HCI_CON_HANDLE(le16toh(hdr.con_handle)) == phys);
+	}
+}
+
+/* The switches the connection handle fields used to be found with */
+#define CON_HANDLE_FIELD(code, type) \
+	case code: \
+		return (u8 *)payload + offsetof(type, con_handle);
+
+static u8 *switch_cmd_con_handle_field(u16 opcode, void *payload)
+{
+	switch (opcode) {
+	CON_HANDLE_FIELD(HCI_CMD_DISCONNECT, hci_discon_cp)
+	CON_HANDLE_FIELD(HCI_CMD_ADD_SCO_CON, hci_add_sco_con_cp)
+	CON_HANDLE_FIELD(HCI_CMD_CHANGE_CON_PACKET_TYPE, hci_change_con_pkt_type_cp)
+	CON_HANDLE_FIELD(HCI_CMD_AUTH_REQ, hci_auth_req_cp)
+	CON_HANDLE_FIELD(HCI_CMD_SET_CON_ENCRYPTION, hci_set_con_encryption_cp)
+	CON_HANDLE_FIELD(HCI_CMD_CHANGE_CON_LINK_KEY, hci_change_con_link_key_cp)
+	CON_HANDLE_FIELD(HCI_CMD_READ_REMOTE_FEATURES, hci_read_remote_features_cp)
+	CON_HANDLE_FIELD(HCI_CMD_READ_REMOTE_EXTENDED_FEATURES, hci_read_remote_extended_features_cp)
+	CON_HANDLE_FIELD(HCI_CMD_READ_REMOTE_VER_INFO, hci_read_remote_ver_info_cp)
+	CON_HANDLE_FIELD(HCI_CMD_READ_CLOCK_OFFSET, hci_read_clock_offset_cp)
+	CON_HANDLE_FIELD(HCI_CMD_READ_LMP_HANDLE, hci_read_lmp_handle_cp)
+	CON_HANDLE_FIELD(HCI_CMD_SETUP_SCO_CON, hci_setup_sco_con_cp)
+	CON_HANDLE_FIELD(HCI_CMD_HOLD_MODE, hci_hold_mode_cp)
+	CON_HANDLE_FIELD(HCI_CMD_SNIFF_MODE, hci_sniff_mode_cp)
+	CON_HANDLE_FIELD(HCI_CMD_EXIT_SNIFF_MODE, hci_exit_sniff_mode_cp)
+	CON_HANDLE_FIELD(HCI_CMD_PARK_MODE, hci_park_mode_cp)
+	CON_HANDLE_FIELD(HCI_CMD_EXIT_PARK_MODE, hci_exit_park_mode_cp)
+	CON_HANDLE_FIELD(HCI_CMD_QOS_SETUP, hci_qos_setup_cp)
+	CON_HANDLE_FIELD(HCI_CMD_ROLE_DISCOVERY, hci_role_discovery_cp)
+	CON_HANDLE_FIELD(HCI_CMD_READ_LINK_POLICY_SETTINGS, hci_read_link_policy_settings_cp)
+	CON_HANDLE_FIELD(HCI_CMD_WRITE_LINK_POLICY_SETTINGS, hci_write_link_policy_settings_cp)
+	CON_HANDLE_FIELD(HCI_CMD_FLOW_SPECIFICATION, hci_flow_specification_cp)
+	CON_HANDLE_FIELD(HCI_CMD_SNIFF_SUBRATING, hci_sniff_subrating_cp)
+	CON_HANDLE_FIELD(HCI_CMD_FLUSH, hci_flush_cp)
+	CON_HANDLE_FIELD(HCI_CMD_READ_AUTO_FLUSH_TIMEOUT, hci_read_auto_flush_timeout_cp)
+	CON_HANDLE_FIELD(HCI_CMD_WRITE_AUTO_FLUSH_TIMEOUT, hci_write_auto_flush_timeout_cp)
+	CON_HANDLE_FIELD(HCI_CMD_READ_XMIT_LEVEL, hci_read_xmit_level_cp)
+	CON_HANDLE_FIELD(HCI_CMD_READ_LINK_SUPERVISION_TIMEOUT, hci_read_link_supervision_timeout_cp)
+	CON_HANDLE_FIELD(HCI_CMD_WRITE_LINK_SUPERVISION_TIMEOUT, hci_write_link_supervision_timeout_cp)
+	CON_HANDLE_FIELD(HCI_CMD_REFRESH_ENCRYPTION_KEY, hci_refresh_encryption_key_cp)
+	CON_HANDLE_FIELD(HCI_CMD_ENHANCED_FLUSH, hci_enhanced_flush_cp)
+	CON_HANDLE_FIELD(HCI_CMD_READ_FAILED_CONTACT_CNTR, hci_read_failed_contact_cntr_cp)
+	CON_HANDLE_FIELD(HCI_CMD_RESET_FAILED_CONTACT_CNTR, hci_reset_failed_contact_cntr_cp)
+	CON_HANDLE_FIELD(HCI_CMD_READ_LINK_QUALITY, hci_read_link_quality_cp)
+	CON_HANDLE_FIELD(HCI_CMD_READ_RSSI, hci_read_rssi_cp)
+	CON_HANDLE_FIELD(HCI_CMD_READ_AFH_CHANNEL_MAP, hci_read_afh_channel_map_cp)
+	CON_HANDLE_FIELD(HCI_CMD_READ_CLOCK, hci_read_clock_cp)
+	default:
+		return NULL;
+	}
+}
+
+static u8 *switch_event_con_handle_field(u8 event, void *payload)
+{
+	switch (event) {
+	CON_HANDLE_FIELD(HCI_EVENT_AUTH_COMPL, hci_auth_compl_ep)
+	CON_HANDLE_FIELD(HCI_EVENT_ENCRYPTION_CHANGE, hci_encryption_change_ep)
+	CON_HANDLE_FIELD(HCI_EVENT_CHANGE_CON_LINK_KEY_COMPL, hci_change_con_link_key_compl_ep)
+	CON_HANDLE_FIELD(HCI_EVENT_MASTER_LINK_KEY_COMPL, hci_master_link_key_compl_ep)
+	CON_HANDLE_FIELD(HCI_EVENT_READ_REMOTE_FEATURES_COMPL, hci_read_remote_features_compl_ep)
+	CON_HANDLE_FIELD(HCI_EVENT_READ_REMOTE_VER_INFO_COMPL, hci_read_remote_ver_info_compl_ep)
+	CON_HANDLE_FIELD(HCI_EVENT_QOS_SETUP_COMPL, hci_qos_setup_compl_ep)
+	CON_HANDLE_FIELD(HCI_EVENT_FLUSH_OCCUR, hci_flush_occur_ep)
+	CON_HANDLE_FIELD(HCI_EVENT_MODE_CHANGE, hci_mode_change_ep)
+	CON_HANDLE_FIELD(HCI_EVENT_MAX_SLOT_CHANGE, hci_max_slot_change_ep)
+	CON_HANDLE_FIELD(HCI_EVENT_READ_CLOCK_OFFSET_COMPL, hci_read_clock_offset_compl_ep)
+	CON_HANDLE_FIELD(HCI_EVENT_CON_PKT_TYPE_CHANGED, hci_con_pkt_type_changed_ep)
+	CON_HANDLE_FIELD(HCI_EVENT_QOS_VIOLATION, hci_qos_violation_ep)
+	CON_HANDLE_FIELD(HCI_EVENT_FLOW_SPECIFICATION_COMPL, hci_flow_specification_compl_ep)
+	CON_HANDLE_FIELD(HCI_EVENT_READ_REMOTE_EXTENDED_FEATURES, hci_read_remote_extended_features_ep)
+	CON_HANDLE_FIELD(HCI_EVENT_SCO_CON_COMPL, hci_sco_con_compl_ep)
+	CON_HANDLE_FIELD(HCI_EVENT_SCO_CON_CHANGED, hci_sco_con_changed_ep)
+	CON_HANDLE_FIELD(HCI_EVENT_SNIFF_SUBRATING, hci_sniff_subrating_ep)
+	CON_HANDLE_FIELD(HCI_EVENT_ENCRYPTION_KEY_REFRESH, hci_encryption_key_refresh_ep)
+	CON_HANDLE_FIELD(HCI_EVENT_LINK_SUPERVISION_TO_CHANGED, hci_link_supervision_to_changed_ep)
+	CON_HANDLE_FIELD(HCI_EVENT_ENHANCED_FLUSH_COMPL, hci_enhanced_flush_compl_ep)
+	default:
+		return NULL;
+	}
+}
+#undef CON_HANDLE_FIELD
+
+/* Every command and event finds the same field as with the switches */
+static void test_con_handle_fields(void)
+{
+	u8 payload[255];
+
+	for (u32 opcode = 0; opcode <= 0xFFFF; opcode++)
+		CHECK(hci_cmd_con_handle_field(opcode, payload) ==
+		      switch_cmd_con_handle_field(opcode, payload));
+
+	for (u32 event = 0; event <= 0xFF; event++)
+		CHECK(hci_event_con_handle_field(event, payload) ==
+		      switch_event_con_handle_field(event, payload));
+}
+
+/* Finds the field of every command and event carrying a connection handle,
+ * and of as many that don't, like the host mostly sends and receives */
+static void bench_con_handle_fields(void)
+{
+	static const u16 no_con_handle_opcodes[] = {
+		HCI_CMD_INQUIRY, HCI_CMD_ACCEPT_CON, HCI_CMD_WRITE_SCAN_ENABLE,
+		HCI_CMD_READ_STORED_LINK_KEY, HCI_CMD_WRITE_PAGE_TIMEOUT, HCI_CMD_READ_BDADDR,
+	};
+	u16 opcodes[TEST_DISPATCH_CMDS + ARRAY_SIZE(no_con_handle_opcodes)];
+	u8 events[TEST_DISPATCH_EVENTS + 2];
+	u32 num_opcodes = 0, num_events = 0;
+	u8 payload[255];
+	uintptr_t sum = 0;
+	u64 start, table_ns, switch_ns;
+
+	for (u32 opcode = 0; opcode <= 0xFFFF; opcode++) {
+		if (switch_cmd_con_handle_field(opcode, payload))
+			opcodes[num_opcodes++] = opcode;
+	}
+	for (int i = 0; i < ARRAY_SIZE(no_con_handle_opcodes); i++)
+		opcodes[num_opcodes++] = no_con_handle_opcodes[i];
+	for (u32 event = 0; event <= 0xFF; event++) {
+		if (switch_event_con_handle_field(event, payload))
+			events[num_events++] = event;
+	}
+	events[num_events++] = HCI_EVENT_COMMAND_COMPL;
+	events[num_events++] = HCI_EVENT_COMMAND_STATUS;
+	CHECK(num_opcodes == ARRAY_SIZE(opcodes));
+	CHECK(num_events == ARRAY_SIZE(events));
+
+	start = test_time_ns();
+	for (int n = 0; n < TEST_BENCH_ITERATIONS; n++) {
+		for (int i = 0; i < num_opcodes; i++)
+			sum += (uintptr_t)hci_cmd_con_handle_field(opcodes[i], payload);
+		for (int i = 0; i < num_events; i++)
+			sum += (uintptr_t)hci_event_con_handle_field(events[i], payload);
+	}
+	table_ns = test_time_ns() - start;
+
+	start = test_time_ns();
+	for (int n = 0; n < TEST_BENCH_ITERATIONS; n++) {
+		for (int i = 0; i < num_opcodes; i++)
+			sum -= (uintptr_t)switch_cmd_con_handle_field(opcodes[i], payload);
+		for (int i = 0; i < num_events; i++)
+			sum -= (uintptr_t)switch_event_con_handle_field(events[i], payload);
+	}
+	switch_ns = test_time_ns() - start;
+	CHECK(sum == 0);
+
+	printf("Connection handle field lookup per packet: %.1f ns (offset tables), "
+	       "%.1f ns (switches)\n",
+	       (double)table_ns / (TEST_BENCH_ITERATIONS * (num_opcodes + num_events)),
+	       (double)switch_ns / (TEST_BENCH_ITERATIONS * (num_opcodes + num_events)));
+}
+
+static void test_identity_count(void)
+{
+	u8 buf[sizeof(hci_event_hdr_t) + sizeof(hci_num_compl_pkts_ep) +
+	       TEST_MAX_CONNECTIONS * sizeof(hci_num_compl_pkts_info)] = {0};
+	hci_event_hdr_t *hdr = (void *)buf;
+	hci_num_compl_pkts_ep *ep = (void *)(hdr + 1);
+	hci_num_compl_pkts_info *info = (void *)(ep + 1);
+	u32 identity;
+	u32 length;
+
+	hci_state_reset();
+	for (int i = 0; i < TEST_MAX_CONNECTIONS; i++)
+		controller_con_event(HCI_EVENT_CON_COMPL, test_phys_con_handle(i));
+
+	identity = g_hci_con_handles_identity;
+	check_acl_translation(1);
+	CHECK(g_hci_con_handles_identity == identity + 2);
+
+	/* Number Of Completed Packets for every connection */
+	hdr->event = HCI_EVENT_NUM_COMPL_PKTS;
+	hdr->length = sizeof(*ep) + TEST_MAX_CONNECTIONS * sizeof(*info);
+	ep->num_con_handles = TEST_MAX_CONNECTIONS;
+	for (int i = 0; i < TEST_MAX_CONNECTIONS; i++) {
+		info[i].con_handle = htole16(test_phys_con_handle(i));
+		info[i].compl_pkts = htole16(1);
+	}
+	length = sizeof(*hdr) + hdr->length;
+	identity = g_hci_con_handles_identity;
+	CHECK(hci_state_handle_hci_event_from_controller(buf, length, length) == length);
+	CHECK(g_hci_con_handles_identity == identity + 1);
+
+	for (int i = 0; i < TEST_MAX_CONNECTIONS; i++)
+		controller_con_event(HCI_EVENT_DISCON_COMPL, test_phys_con_handle(i));
+}
+
+static void bench_translation(u32 num_connections)
+{
+	u16 virt = 0, phys = 0;
+	u32 sum = 0;
+	u64 start, table_ns, linear_ns;
+
+	hci_state_reset();
+	memset(linear_table, 0, sizeof(linear_table));
+	for (int i = 0; i < num_connections; i++) {
+		controller_con_event(HCI_EVENT_CON_COMPL, test_phys_con_handle(i));
+		linear_table[i].valid = true;
+		linear_table[i].virt = test_phys_con_handle(i);
+		linear_table[i].phys = test_phys_con_handle(i);
+	}
+
+	check_acl_translation(num_connections);
+
+	start = test_time_ns();
+	for (int n = 0; n < TEST_BENCH_ITERATIONS; n++) {
+		for (int i = 0; i < num_connections; i++) {
+			hci_virt_con_handle_get_virt(test_phys_con_handle(i), &virt);
+			hci_virt_con_handle_get_phys(virt, &phys);
+			sum += phys;
+		}
+	}
+	table_ns = test_time_ns() - start;
+
+	start = test_time_ns();
+	for (int n = 0; n < TEST_BENCH_ITERATIONS; n++) {
+		for (int i = 0; i < num_connections; i++) {
+			linear_get_virt(test_phys_con_handle(i), &virt);
+			linear_get_phys(virt, &phys);
+			sum -= phys;
+		}
+	}
+	linear_ns = test_time_ns() - start;
+
+	/* Both found the same handles */
+	CHECK(sum == 0);
+
+	for (int i = 0; i < num_connections; i++)
+		controller_con_event(HCI_EVENT_DISCON_COMPL, test_phys_con_handle(i));
+
+	printf("%2u connections: phys->virt->phys translation: %.1f ns (tables), "
+	       "%.1f ns (linear search)\n", num_connections,
+	       (double)table_ns / (TEST_BENCH_ITERATIONS * num_connections),
+	       (double)linear_ns / (TEST_BENCH_ITERATIONS * num_connections));
+}
+
+int main(void)
+{
+	test_host_init();
+
+	test_con_handle_fields();
+	bench_con_handle_fields();
+	test_identity_count();
+	for (int i = 0; i < ARRAY_SIZE(bench_num_connections); i++)
+		bench_translation(bench_num_connections[i]);
+
+	if (test_failures)
+		printf("%d checks failed\n", test_failures);
+
+	return test_failures ? 1 : 0;
+}
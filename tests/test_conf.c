@@ -0,0 +1,166 @@
+#include <string.h>
+#include "conf.h"
+#include "test_host.h"
+#include "utils.h"
+
+/* SYSCONF items accessed in place through the file. Finding an item reads the offset
+ * table at once and the item headers a window at a time, not one header per read */
+
+#define TEST_CONF_SIZE		0x4000
+#define TEST_CONF_ITEMS		80
+/* More items than conf_find reads with the count */
+#define TEST_CONF_MANY_ITEMS	200
+
+static u8 conf[TEST_CONF_SIZE];
+static u32 conf_pos;
+static u32 conf_count;
+
+static void conf_put_be16(u32 offset, u16 value)
+{
+	conf[offset] = value >> 8;
+	conf[offset + 1] = value & 0xFF;
+}
+
+static void conf_begin(u32 count)
+{
+	memset(conf, 0, sizeof(conf));
+	memcpy(conf, "SCv0", 4);
+	conf_put_be16(4, count);
+	conf_count = 0;
+	/* Items follow the offset table and its end offset */
+	conf_pos = 6 + (count + 1) * sizeof(u16);
+	test_file_data = conf;
+	test_file_size = sizeof(conf);
+}
+
+static void conf_add(const char *name, u8 type, const void *data, u16 length)
+{
+	int nlen = strlen(name);
+
+	conf_put_be16(6 + conf_count * sizeof(u16), conf_pos);
+	conf_count++;
+
+	conf[conf_pos++] = (type << 5) | (nlen - 1);
+	memcpy(&conf[conf_pos], name, nlen);
+	conf_pos += nlen;
+	if (type == CONF_BIGARRAY) {
+		conf_put_be16(conf_pos, length - 1);
+		conf_pos += 2;
+	} else if (type == CONF_SMALLARRAY) {
+		conf[conf_pos++] = length - 1;
+	}
+	memcpy(&conf[conf_pos], data, length);
+	conf_pos += length;
+}
+
+static void conf_end(void)
+{
+	conf_put_be16(6 + conf_count * sizeof(u16), conf_pos);
+	memcpy(&conf[TEST_CONF_SIZE - 4], "SCed", 4);
+}
+
+/* Small items first, like in a real SYSCONF, and the pads last */
+static void build_conf(void)
+{
+	static struct conf_pads_setting pads;
+	char name[16];
+
+	conf_begin(TEST_CONF_ITEMS);
+	for (int i = 0; i < TEST_CONF_ITEMS - 3; i++) {
+		snprintf(name, sizeof(name), "IPL.I%02d", i);
+		conf_add(name, (i % 2) ? CONF_BYTE : CONF_LONG, "\0\0\0\0", (i % 2) ? 1 : 4);
+	}
+	conf_add("BT.BAR", CONF_BYTE, "\1", 1);
+	conf_add("BT.SENS", CONF_LONG, "\0\0\0\3", 4);
+	memset(&pads, 0, sizeof(pads));
+	pads.num_registered = 1;
+	memcpy(pads.registered[0].name, "Nintendo RVL-CNT-01", 20);
+	conf_add("BT.DINF", CONF_BIGARRAY, &pads, sizeof(pads));
+	conf_end();
+}
+
+static void test_conf_get(void)
+{
+	static struct conf_pads_setting pads ATTRIBUTE_ALIGN(32);
+	u32 sens = 0, bar = ~0;
+	u32 calls;
+
+	build_conf();
+
+	/* Scalars are zero-extended to the size of the buffer */
+	CHECK(conf_get(3, "BT.BAR", &bar, sizeof(bar)) == 1);
+	CHECK(!memcmp(&bar, "\1\0\0\0", sizeof(bar)));
+	CHECK(conf_get(3, "BT.SENS", &sens, sizeof(sens)) == 4);
+	CHECK(!memcmp(&sens, "\0\0\0\3", sizeof(sens)));
+
+	/* The last item: a seek and a read for the table, for each header window
+	 * and for the data */
+	test_file_calls = 0;
+	CHECK(conf_get(3, "BT.DINF", &pads, sizeof(pads)) == sizeof(pads));
+	calls = test_file_calls;
+	CHECK((pads.num_registered == 1) &&
+	      !strcmp(pads.registered[0].name, "Nintendo RVL-CNT-01"));
+	CHECK(calls < TEST_CONF_ITEMS / 4);
+	/* Reading the count, 32 offsets and each header on their own took 170 */
+	printf("BT.DINF (item %d of %d): %u file calls\n", TEST_CONF_ITEMS, TEST_CONF_ITEMS, calls);
+
+	CHECK(conf_get(3, "IPL.NONE", &bar, sizeof(bar)) == CONF_ENOENT);
+	CHECK(conf_get(3, "BT.DINF", &bar, sizeof(bar)) == CONF_ETOOBIG);
+}
+
+static void test_conf_set(void)
+{
+	static struct conf_pads_setting pads ATTRIBUTE_ALIGN(32);
+	u8 before[TEST_CONF_SIZE];
+
+	build_conf();
+	memcpy(before, conf, sizeof(conf));
+
+	CHECK(conf_get(3, "BT.DINF", &pads, sizeof(pads)) == sizeof(pads));
+	pads.num_registered = 2;
+	memcpy(pads.registered[1].name, "Fake Wiimote 0", 15);
+	CHECK(conf_set(3, "BT.DINF", &pads, sizeof(pads)) == sizeof(pads));
+
+	/* Only the item's data changes */
+	memset(&pads, 0, sizeof(pads));
+	CHECK(conf_get(3, "BT.DINF", &pads, sizeof(pads)) == sizeof(pads));
+	CHECK((pads.num_registered == 2) && !strcmp(pads.registered[1].name, "Fake Wiimote 0"));
+	CHECK(!memcmp(before, conf, conf_pos - sizeof(pads)));
+	CHECK(!memcmp(&before[conf_pos], &conf[conf_pos], TEST_CONF_SIZE - conf_pos));
+}
+
+static void test_conf_large_table(void)
+{
+	char name[16];
+	u8 value;
+
+	/* The table is read a part at a time past what comes with the count */
+	conf_begin(TEST_CONF_MANY_ITEMS);
+	for (int i = 0; i < TEST_CONF_MANY_ITEMS; i++) {
+		snprintf(name, sizeof(name), "IPL.I%03d", i);
+		value = i;
+		conf_add(name, CONF_BYTE, &value, 1);
+	}
+	conf_end();
+
+	for (int i = 0; i < TEST_CONF_MANY_ITEMS; i += 37) {
+		snprintf(name, sizeof(name), "IPL.I%03d", i);
+		value = 0;
+		CHECK(conf_get(3, name, &value, sizeof(value)) == 1);
+		CHECK(value == (u8)i);
+	}
+	CHECK(conf_get(3, "IPL.I199", &value, sizeof(value)) == 1);
+	CHECK(value == 199);
+}
+
+int main(void)
+{
+	test_conf_get();
+	test_conf_set();
+	test_conf_large_table();
+
+	if (test_failures)
+		printf("%d checks failed\n", test_failures);
+
+	return test_failures ? 1 : 0;
+}
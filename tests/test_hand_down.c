@@ -0,0 +1,231 @@
+#include "test_oh1.h"
+
+/* The main loop is built as is, with its OH1 hooks driven by the test */
+#define main fakemote_main
+#include "main.c"
+#undef main
+
+/* Hand down pools: the message used for a host buffer, and the host buffers that
+ * OH1 fills directly: ACL buffers while no fake Wiimote is connected, and the ones
+ * no message of the pool can take */
+
+#define TEST_HOST_BUFFERS	4
+#define TEST_SMALL_WLENGTH	64
+#define TEST_LARGE_WLENGTH	700
+#define TEST_HUGE_WLENGTH	2048
+#define TEST_CON_HANDLE		0x0001
+
+static u8 host_endpoints[TEST_HOST_BUFFERS];
+static u16 host_wLengths[TEST_HOST_BUFFERS];
+static u8 host_data[TEST_HOST_BUFFERS][TEST_HUGE_WLENGTH];
+static ioctlv host_vectors[TEST_HOST_BUFFERS][3];
+static ipcmessage host_msgs[TEST_HOST_BUFFERS];
+
+static ipcmessage *init_host_buffer(int i, u8 endpoint, u16 wLength)
+{
+	host_endpoints[i] = endpoint;
+	host_wLengths[i] = wLength;
+	host_vectors[i][0] = (ioctlv){&host_endpoints[i], sizeof(host_endpoints[i])};
+	host_vectors[i][1] = (ioctlv){&host_wLengths[i], sizeof(host_wLengths[i])};
+	host_vectors[i][2] = (ioctlv){host_data[i], wLength};
+	host_msgs[i].command = IOS_IOCTLV;
+	host_msgs[i].ioctlv.command = (endpoint == EP_HCI_EVENT) ? USBV0_IOCTLV_INTRMSG :
+								    USBV0_IOCTLV_BLKMSG;
+	host_msgs[i].ioctlv.num_in = 2;
+	host_msgs[i].ioctlv.num_io = 1;
+	host_msgs[i].ioctlv.vector = host_vectors[i];
+	return &host_msgs[i];
+}
+
+/* Returns the message handed down to OH1, if any */
+static ipcmessage *run_oh1(void)
+{
+	ipcmessage *msg = NULL;
+
+	OH1_IOS_ReceiveMessage_hook(orig_msg_queueid, &msg, 0);
+	return msg;
+}
+
+/* OH1 completes a transfer with an HCI Command Status event */
+static int complete_hci_event(ipcmessage *msg)
+{
+	hci_event_hdr_t *hdr = msg->ioctlv.vector[2].data;
+	hci_command_status_ep *ep = (void *)(hdr + 1);
+
+	hdr->event = HCI_EVENT_COMMAND_STATUS;
+	hdr->length = sizeof(*ep);
+	ep->status = 0;
+	ep->num_cmd_pkts = 1;
+	ep->opcode = htole16(HCI_CMD_WRITE_SCAN_ENABLE);
+	return OH1_IOS_ResourceReply_hook(msg, sizeof(*hdr) + sizeof(*ep));
+}
+
+/* The controller reports a connection to a real device */
+static void connect_real_device(u16 con_handle)
+{
+	struct {
+		hci_event_hdr_t hdr;
+		hci_con_compl_ep ep;
+	} __packed event = {0};
+
+	event.hdr.event = HCI_EVENT_CON_COMPL;
+	event.hdr.length = sizeof(event.ep);
+	event.ep.con_handle = htole16(con_handle);
+	event.ep.link_type = HCI_LINK_ACL;
+	hci_state_handle_hci_event_from_controller(&event, sizeof(event), sizeof(event));
+}
+
+/* OH1 completes a transfer with an ACL packet of the real device */
+static int complete_acl_data(ipcmessage *msg, u16 con_handle)
+{
+	hci_acldata_hdr_t *hdr = msg->ioctlv.vector[2].data;
+	l2cap_hdr_t *l2cap = (void *)(hdr + 1);
+
+	hdr->con_handle = htole16(HCI_MK_CON_HANDLE(con_handle, HCI_PACKET_START, 0));
+	hdr->length = htole16(sizeof(*l2cap));
+	l2cap->length = 0;
+	l2cap->dcid = htole16(L2CAP_SIGNAL_CID);
+	return OH1_IOS_ResourceReply_hook(msg, sizeof(*hdr) + sizeof(*l2cap));
+}
+
+static hand_down_msg_t *submit(hand_down_pool_t *pool, msg_ring_t *pending_queue)
+{
+	void *msg = hand_down_pool_submit(pool, pending_queue);
+
+	return msg;
+}
+
+static void reset_pool(hand_down_pool_t *pool, msg_ring_t *pending_queue)
+{
+	for (int i = 0; i < pool->num_msgs; i++)
+		pool->msgs[i].busy = false;
+	pool->in_flight = (msg_ring_t){0};
+	pool->passthrough = (msg_ring_t){0};
+	*pending_queue = (msg_ring_t){0};
+}
+
+static void test_smallest_fit(void)
+{
+	hand_down_pool_t *pool = &usb_bulk_in_hand_down_pool;
+	msg_ring_t *pending_queue = &pending_usb_bulk_in_msg_queue;
+	hand_down_msg_t *msg;
+
+	/* The smallest message that fits, with the transfer length the host asked for */
+	msg_ring_push(pending_queue, init_host_buffer(0, EP_ACL_DATA_IN, TEST_SMALL_WLENGTH));
+	msg = submit(pool, pending_queue);
+	CHECK(msg && (msg->size == ACL_IN_HAND_DOWN_MSG_SIZE));
+	CHECK(msg && (msg->wLength == TEST_SMALL_WLENGTH) &&
+	      (msg->vectors[2].len == TEST_SMALL_WLENGTH));
+
+	msg_ring_push(pending_queue, init_host_buffer(1, EP_ACL_DATA_IN, TEST_LARGE_WLENGTH));
+	msg = submit(pool, pending_queue);
+	CHECK(msg && (msg->size == ACL_IN_HAND_DOWN_MSG_LARGE_SIZE));
+	CHECK(msg && (msg->vectors[2].len == TEST_LARGE_WLENGTH));
+
+	/* A small message is free, but it would truncate the transfer: wait for the large one */
+	msg_ring_push(pending_queue, init_host_buffer(2, EP_ACL_DATA_IN, TEST_LARGE_WLENGTH));
+	CHECK(hand_down_pool_submit(pool, pending_queue) == NULL);
+	/* Buffers queued after it are filled after it */
+	msg_ring_push(pending_queue, init_host_buffer(3, EP_ACL_DATA_IN, TEST_SMALL_WLENGTH));
+	CHECK(hand_down_pool_submit(pool, pending_queue) == NULL);
+	CHECK(msg_ring_count(&pool->in_flight) == 2);
+
+	reset_pool(pool, pending_queue);
+}
+
+static void test_passthrough_too_large(void)
+{
+	hand_down_pool_t *pool = &usb_intr_hand_down_pool;
+	ipcmessage *msg;
+
+	test_oh1_reset();
+
+	/* While a message is in flight, a host buffer too large for the pool waits for it */
+	test_oh1_post(init_host_buffer(0, EP_HCI_EVENT, TEST_SMALL_WLENGTH));
+	msg = run_oh1();
+	CHECK(is_hand_down_msg(pool, msg) && (msg->ioctlv.vector[2].len == TEST_SMALL_WLENGTH));
+	test_oh1_post(init_host_buffer(1, EP_HCI_EVENT, TEST_HUGE_WLENGTH));
+	CHECK(run_oh1() == NULL);
+	CHECK(msg_ring_count(&pending_usb_intr_msg_queue) == 2);
+
+	/* Then it's handed down as it is */
+	CHECK(complete_hci_event(msg) == IOS_OK);
+	CHECK((test_oh1_num_acks == 1) && (test_oh1_acks[0].msg == &host_msgs[0]));
+	CHECK(run_oh1() == &host_msgs[1]);
+	CHECK(msg_ring_is_empty(&pending_usb_intr_msg_queue));
+	CHECK(complete_hci_event(&host_msgs[1]) == IOS_OK);
+	CHECK((test_oh1_num_acks == 2) && (test_oh1_acks[1].msg == &host_msgs[1]) &&
+	      (test_oh1_acks[1].result == sizeof(hci_event_hdr_t) + sizeof(hci_command_status_ep)));
+
+	/* Right away if nothing is in flight */
+	test_oh1_post(init_host_buffer(2, EP_HCI_EVENT, TEST_HUGE_WLENGTH));
+	CHECK(run_oh1() == &host_msgs[2]);
+	CHECK(complete_hci_event(&host_msgs[2]) == IOS_OK);
+	CHECK((test_oh1_num_acks == 3) && (test_oh1_acks[2].msg == &host_msgs[2]));
+
+	CHECK(msg_ring_is_empty(&pool->in_flight) && msg_ring_is_empty(&pool->passthrough));
+	test_oh1_reset();
+}
+
+static void test_acl_passthrough(void)
+{
+	hand_down_pool_t *pool = &usb_bulk_in_hand_down_pool;
+	u32 passthrough = g_acl_in_passthrough;
+	ipcmessage *msg, *next_msg;
+
+	test_oh1_reset();
+	connect_real_device(TEST_CON_HANDLE);
+	CHECK(!fake_wiimote_mgr_any_connected());
+
+	/* One host buffer is kept on the PendingQ, a hand down message is used for it */
+	test_oh1_post(init_host_buffer(0, EP_ACL_DATA_IN, TEST_SMALL_WLENGTH));
+	msg = run_oh1();
+	CHECK(is_hand_down_msg(pool, msg));
+
+	/* No fake Wiimote can inject into the next ones, so OH1 fills them directly */
+	for (int i = 1; i <= ACL_IN_PASSTHROUGH_MSGS_MAX; i++) {
+		test_oh1_post(init_host_buffer(i, EP_ACL_DATA_IN, TEST_SMALL_WLENGTH));
+		CHECK(run_oh1() == &host_msgs[i]);
+	}
+	CHECK(g_acl_in_passthrough == passthrough + ACL_IN_PASSTHROUGH_MSGS_MAX);
+
+	/* Up to ACL_IN_PASSTHROUGH_MSGS_MAX at a time */
+	test_oh1_post(init_host_buffer(3, EP_ACL_DATA_IN, TEST_SMALL_WLENGTH));
+	next_msg = run_oh1();
+	CHECK(is_hand_down_msg(pool, next_msg));
+	CHECK(g_acl_in_passthrough == passthrough + ACL_IN_PASSTHROUGH_MSGS_MAX);
+
+	/* Completed host buffers are ACKed as they are, without a copy */
+	CHECK(complete_acl_data(&host_msgs[1], TEST_CON_HANDLE) == IOS_OK);
+	CHECK((test_oh1_num_acks == 1) && (test_oh1_acks[0].msg == &host_msgs[1]) &&
+	      (test_oh1_acks[0].result == sizeof(hci_acldata_hdr_t) + sizeof(l2cap_hdr_t)));
+	CHECK(HCI_CON_HANDLE(le16toh(((hci_acldata_hdr_t *)host_data[1])->con_handle)) ==
+	      TEST_CON_HANDLE);
+	CHECK(complete_acl_data(&host_msgs[2], TEST_CON_HANDLE) == IOS_OK);
+	CHECK((test_oh1_num_acks == 2) && (test_oh1_acks[1].msg == &host_msgs[2]));
+	CHECK(msg_ring_is_empty(&pool->passthrough));
+
+	/* The hand down messages are copied to the host buffers in the PendingQ */
+	CHECK(complete_acl_data(msg, TEST_CON_HANDLE) == IOS_OK);
+	CHECK(complete_acl_data(next_msg, TEST_CON_HANDLE) == IOS_OK);
+	CHECK((test_oh1_num_acks == 4) && (test_oh1_acks[2].msg == &host_msgs[0]) &&
+	      (test_oh1_acks[3].msg == &host_msgs[3]));
+	CHECK(msg_ring_is_empty(&pool->in_flight));
+	CHECK(msg_ring_is_empty(&pending_usb_bulk_in_msg_queue));
+	test_oh1_reset();
+}
+
+int main(void)
+{
+	test_oh1_reset();
+	ensure_initalized();
+
+	test_smallest_fit();
+	test_passthrough_too_large();
+	test_acl_passthrough();
+
+	if (test_failures)
+		printf("%d checks failed\n", test_failures);
+
+	return test_failures ? 1 : 0;
+}
@@ -0,0 +1,140 @@
+#include <string.h>
+#include <time.h>
+#include "syscalls.h"
+#include "test_host.h"
+#include "utils.h"
+
+int test_heap_allocs_left = -1;
+int test_heap_allocs_live;
+
+u8 *test_file_data;
+u32 test_file_size;
+u32 test_file_calls;
+static u32 test_file_pos;
+
+int test_failures;
+
+u64 test_time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* IOS heap: first fit over the memory given to os_heap_create, so that the module can
+ * still tell its heap allocations apart by their address. Blocks are 32-byte aligned */
+
+#define HEAP_ALIGN	32
+
+typedef struct {
+	u32 size; /* Including this header */
+	bool used;
+} ATTRIBUTE_ALIGN(HEAP_ALIGN) heap_block_t;
+
+static u8 *heap_start, *heap_end;
+
+s32 os_heap_create(void *ptr, s32 size)
+{
+	heap_block_t *block = ptr;
+
+	heap_start = ptr;
+	heap_end = heap_start + (size & ~(HEAP_ALIGN - 1));
+	block->size = heap_end - heap_start;
+	block->used = false;
+	test_heap_allocs_live = 0;
+
+	return 1;
+}
+
+void *os_heap_alloc(s32 heap, u32 size)
+{
+	heap_block_t *block, *next;
+
+	if (test_heap_allocs_left == 0)
+		return NULL;
+
+	size = sizeof(heap_block_t) + ((size + HEAP_ALIGN - 1) & ~(HEAP_ALIGN - 1));
+	for (u8 *p = heap_start; p < heap_end; p += block->size) {
+		block = (heap_block_t *)p;
+		if (block->used || (block->size < size))
+			continue;
+
+		if (block->size > size) {
+			next = (heap_block_t *)(p + size);
+			next->size = block->size - size;
+			next->used = false;
+			block->size = size;
+		}
+		block->used = true;
+
+		if (test_heap_allocs_left > 0)
+			test_heap_allocs_left--;
+		test_heap_allocs_live++;
+		return block + 1;
+	}
+
+	return NULL;
+}
+
+void os_heap_free(s32 heap, void *ptr)
+{
+	heap_block_t *block, *next;
+
+	((heap_block_t *)ptr - 1)->used = false;
+	test_heap_allocs_live--;
+
+	/* Merge the free neighbours */
+	for (u8 *p = heap_start; p < heap_end; p += block->size) {
+		block = (heap_block_t *)p;
+		while (!block->used && (p + block->size < heap_end)) {
+			next = (heap_block_t *)(p + block->size);
+			if (next->used)
+				break;
+			block->size += next->size;
+		}
+	}
+}
+
+/* IOS file system */
+
+s32 os_open(const char *device, s32 mode)
+{
+	test_file_pos = 0;
+	return 3;
+}
+
+s32 os_close(s32 fd)
+{
+	return IOS_OK;
+}
+
+s32 os_seek(s32 fd, s32 offset, s32 mode)
+{
+	test_file_calls++;
+	if ((offset < 0) || (offset > test_file_size))
+		return IOS_EINVAL;
+
+	test_file_pos = offset;
+	return offset;
+}
+
+s32 os_read(s32 fd, void *d, s32 len)
+{
+	u32 size = MIN2(len, test_file_size - test_file_pos);
+
+	test_file_calls++;
+	memcpy(d, test_file_data + test_file_pos, size);
+	test_file_pos += size;
+	return size;
+}
+
+s32 os_write(s32 fd, void *s, s32 len)
+{
+	u32 size = MIN2(len, test_file_size - test_file_pos);
+
+	test_file_calls++;
+	memcpy(test_file_data + test_file_pos, s, size);
+	test_file_pos += size;
+	return size;
+}
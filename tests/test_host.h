@@ -0,0 +1,32 @@
+#ifndef TEST_HOST_H
+#define TEST_HOST_H
+
+#include <stdio.h>
+#include "types.h"
+
+/* Host replacements of the IOS heap and file services, and test helpers */
+
+/* Heap allocations that succeed before os_heap_alloc starts failing, -1 for no limit */
+extern int test_heap_allocs_left;
+/* Live heap allocations */
+extern int test_heap_allocs_live;
+
+/* File accessed through os_seek/os_read/os_write, whatever the fd, and the number of calls */
+extern u8 *test_file_data;
+extern u32 test_file_size;
+extern u32 test_file_calls;
+
+extern int test_failures;
+
+/* Monotonic host time, for the benchmarks */
+u64 test_time_ns(void);
+
+#define CHECK(exp)								\
+	do {									\
+		if (!(exp)) {							\
+			printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #exp);	\
+			test_failures++;					\
+		}								\
+	} while (0)
+
+#endif
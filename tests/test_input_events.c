@@ -0,0 +1,208 @@
+#include "test_oh1.h"
+
+/* The main loop is built as is, with its OH1 hooks driven by the test */
+#define main fakemote_main
+#include "main.c"
+#undef main
+
+/* Input events posted by the USB HID worker to the main loop. They are measured from the
+ * worker getting new input to the data report reaching a host buffer: the report doesn't
+ * have to wait for the next periodic tick */
+
+#define TEST_ITERATIONS		1000
+
+static fake_wiimote_t wiimote;
+static fake_wiimote_hot_t hot;
+static input_device_t *input_device;
+static u16 buttons;
+static bool removed;
+
+static int test_resume(void *usrdata, fake_wiimote_t *wiimote)
+{
+	return 0;
+}
+
+static int test_suspend(void *usrdata)
+{
+	return 0;
+}
+
+static int test_set_leds(void *usrdata, int leds)
+{
+	return 0;
+}
+
+static int test_set_rumble(void *usrdata, bool rumble_on)
+{
+	return 0;
+}
+
+static bool test_report_input(void *usrdata)
+{
+	fake_wiimote_report_input(&wiimote, buttons);
+	return true;
+}
+
+static void test_removed(void *usrdata)
+{
+	removed = true;
+}
+
+static const input_device_ops_t test_input_device_ops = {
+	.resume		= test_resume,
+	.suspend	= test_suspend,
+	.set_leds	= test_set_leds,
+	.set_rumble	= test_set_rumble,
+	.report_input	= test_report_input,
+	.removed	= test_removed,
+};
+
+/* ACL IN buffer given by the host */
+static u8 host_endpoint = EP_ACL_DATA_IN;
+static u16 host_wLength;
+static u8 host_data[64];
+static ioctlv host_vectors[3];
+static ipcmessage host_msg;
+
+static void post_host_acl_in_buffer(void)
+{
+	host_wLength = sizeof(host_data);
+	host_vectors[0] = (ioctlv){&host_endpoint, sizeof(host_endpoint)};
+	host_vectors[1] = (ioctlv){&host_wLength, sizeof(host_wLength)};
+	host_vectors[2] = (ioctlv){host_data, sizeof(host_data)};
+	host_msg.command = IOS_IOCTLV;
+	host_msg.ioctlv.command = USBV0_IOCTLV_BLKMSG;
+	host_msg.ioctlv.num_in = 2;
+	host_msg.ioctlv.num_io = 1;
+	host_msg.ioctlv.vector = host_vectors;
+	test_oh1_post(&host_msg);
+}
+
+static void run_oh1(void)
+{
+	ipcmessage *msg = NULL;
+
+	OH1_IOS_ReceiveMessage_hook(orig_msg_queueid, &msg, 0);
+}
+
+static void setup(void)
+{
+	test_oh1_reset();
+	ensure_initalized();
+
+	CHECK(input_devices_add(NULL, &test_input_device_ops, &input_device));
+	run_oh1();
+
+	/* A fake Wiimote with its HID channels open */
+	fake_wiimote_init(&wiimote, &hot, &FAKE_WIIMOTE_BDADDR(0));
+	fake_wiimote_init_state(&wiimote, input_device);
+	hot.active = true;
+	fake_wiimote_handle_hci_cmd_accept_con(&wiimote, HCI_ROLE_SLAVE);
+	wiimote.psm_hid_intr_chn.valid = true;
+	wiimote.psm_hid_intr_chn.state = L2CAP_CHANNEL_STATE_COMPLETE;
+	wiimote.psm_hid_intr_chn.remote_cid = 0x0041;
+	hot.acl_state = ACL_STATE_INACTIVE;
+	hot.work = 0;
+	input_device_assign_wiimote(input_device, &wiimote);
+}
+
+static void test_input_latency(void)
+{
+	const hci_acldata_hdr_t *acl = (const void *)host_data;
+	u64 start, latency, total = 0, max = 0;
+	u32 reports = 0;
+	u32 copied;
+
+	setup();
+	copied = g_l2cap_bytes_copied;
+
+	for (int i = 0; i < TEST_ITERATIONS; i++) {
+		post_host_acl_in_buffer();
+		run_oh1();
+		test_oh1_reset();
+
+		/* New input on the USB HID worker */
+		buttons ^= BIT(i % 13);
+		start = test_time_ns();
+		input_device_post_input_event(input_device);
+		run_oh1();
+		latency = test_time_ns() - start;
+
+		if ((test_oh1_num_acks == 1) && (test_oh1_acks[0].msg == &host_msg) &&
+		    (HCI_CON_HANDLE(le16toh(acl->con_handle)) == hot.hci_con_handle))
+			reports++;
+		total += latency;
+		max = MAX2(max, latency);
+	}
+
+	/* Every input change is reported from the input event alone */
+	CHECK(reports == TEST_ITERATIONS);
+	/* The reports are built in the host buffers, without copying them from elsewhere */
+	CHECK(g_l2cap_bytes_copied == copied);
+
+	printf("input to report: %llu ns average, %llu ns max over %d reports "
+	       "(with 5 ms ticks, the input would wait 2500000 ns on average)\n",
+	       (unsigned long long)(total / TEST_ITERATIONS), (unsigned long long)max,
+	       TEST_ITERATIONS);
+}
+
+static void test_input_coalescing(void)
+{
+	const u8 *hid = host_data + sizeof(hci_acldata_hdr_t) + sizeof(l2cap_hdr_t);
+	u32 coalesced;
+	int allocs;
+	u16 reported;
+
+	setup();
+	coalesced = g_ready_msgs_coalesced;
+	allocs = test_heap_allocs_live;
+
+	/* The host is slow to give us ACL buffers: the reports wait in the ReadyQ */
+	for (int i = 0; i < 10; i++) {
+		buttons ^= BIT(i);
+		input_device_post_input_event(input_device);
+		run_oh1();
+	}
+
+	/* Only the newest one is kept */
+	CHECK(g_ready_msgs_coalesced == coalesced + 9);
+	CHECK(ready_lane_count(&ready_usb_bulk_in_msg_queue.data) == 1);
+
+	post_host_acl_in_buffer();
+	run_oh1();
+	memcpy(&reported, &hid[2], sizeof(reported));
+	CHECK((test_oh1_num_acks == 1) && (test_oh1_acks[0].msg == &host_msg));
+	CHECK((hid[1] == INPUT_REPORT_ID_BTN) && (reported == buttons));
+	CHECK(test_heap_allocs_live == allocs);
+	test_oh1_reset();
+}
+
+static void test_input_device_removal(void)
+{
+	setup();
+	removed = false;
+
+	/* The worker only flags the removal, the main loop does it */
+	input_devices_remove(input_device);
+	CHECK(!removed);
+	CHECK(input_devices_any_valid());
+
+	/* The usrdata is handed back once the fake Wiimote has been disconnected */
+	run_oh1();
+	CHECK(removed);
+	CHECK(!input_devices_any_valid());
+	CHECK(!fake_wiimote_is_connected(&wiimote));
+	CHECK(wiimote.input_device == NULL);
+}
+
+int main(void)
+{
+	test_input_device_removal();
+	test_input_coalescing();
+	test_input_latency();
+
+	if (test_failures)
+		printf("%d checks failed\n", test_failures);
+
+	return test_failures ? 1 : 0;
+}
@@ -0,0 +1,122 @@
+#include "ios.h"
+#include "syscalls.h"
+#include "test_oh1.h"
+
+test_oh1_ack_t test_oh1_acks[TEST_OH1_ACKS_MAX];
+u32 test_oh1_num_acks;
+u32 test_oh1_num_sends;
+s32 test_oh1_timer_period;
+u32 test_oh1_timer_changes;
+u32 test_oh1_timer_now;
+
+static void *queue[TEST_OH1_QUEUE_SIZE];
+static u32 queue_head, queue_tail;
+static s32 timer_message;
+
+void test_oh1_reset(void)
+{
+	queue_head = queue_tail = 0;
+	test_oh1_num_acks = 0;
+	test_oh1_num_sends = 0;
+	test_oh1_timer_changes = 0;
+}
+
+int test_oh1_post(void *msg)
+{
+	if (queue_tail - queue_head == TEST_OH1_QUEUE_SIZE)
+		return IOS_EQUEUEFULL;
+
+	queue[queue_tail++ % TEST_OH1_QUEUE_SIZE] = msg;
+	return IOS_OK;
+}
+
+int test_oh1_post_timer(void)
+{
+	/* The timer message is a 32-bit value. Tests are linked without PIE,
+	 * so that the addresses of static variables fit in it */
+	return test_oh1_post((void *)(uintptr_t)(u32)timer_message);
+}
+
+/* IOS message queues: there's a single one, OH1's */
+
+s32 os_message_queue_receive(s32 queueid, void *message, u32 flags)
+{
+	if (queue_head == queue_tail)
+		return IOS_EQUEUEEMPTY;
+
+	*(uintptr_t *)message = (uintptr_t)queue[queue_head++ % TEST_OH1_QUEUE_SIZE];
+	return IOS_OK;
+}
+
+s32 os_message_queue_send(s32 queueid, void *message, s32 flags)
+{
+	test_oh1_num_sends++;
+	return test_oh1_post(message);
+}
+
+s32 os_message_queue_ack(void *message, s32 result)
+{
+	if (test_oh1_num_acks < TEST_OH1_ACKS_MAX) {
+		test_oh1_acks[test_oh1_num_acks].msg = message;
+		test_oh1_acks[test_oh1_num_acks].result = result;
+		test_oh1_num_acks++;
+	}
+
+	return IOS_OK;
+}
+
+/* IOS timers: there's a single one, the periodic timer */
+
+s32 os_create_timer(s32 time_us, s32 repeat_time_us, s32 message_queue, s32 message)
+{
+	test_oh1_timer_period = repeat_time_us;
+	timer_message = message;
+	return 1;
+}
+
+s32 os_stop_timer(s32 timer_id)
+{
+	test_oh1_timer_period = 0;
+	test_oh1_timer_changes++;
+	return IOS_OK;
+}
+
+s32 os_restart_timer(s32 timer_id, s32 time_us, s32 repeat_time_us)
+{
+	test_oh1_timer_period = repeat_time_us;
+	test_oh1_timer_changes++;
+	return IOS_OK;
+}
+
+s32 os_timer_now(s32 time_id)
+{
+	return test_oh1_timer_now;
+}
+
+/* Cache maintenance and other services the module uses */
+
+void __os_sync_before_read(void *ptr, s32 size)
+{
+}
+
+void __os_sync_after_write(void *ptr, s32 size)
+{
+}
+
+void DCFlushRange(void *ptr, int size)
+{
+}
+
+void svc_write(const char *str)
+{
+}
+
+s32 IOS_InitSystem(patcher patchers[], u32 size)
+{
+	return IOS_OK;
+}
+
+int usb_hid_init(void)
+{
+	return 0;
+}
@@ -0,0 +1,36 @@
+#ifndef TEST_OH1_H
+#define TEST_OH1_H
+
+#include "test_host.h"
+#include "types.h"
+
+/* Host replacements of the IOS message queue, timer and cache services used by the
+ * main loop. The tests include source/main.c to drive its OH1 hooks directly: a hook
+ * handles the posted messages until the queue is empty or it returns one to OH1 */
+
+#define TEST_OH1_QUEUE_SIZE	64
+#define TEST_OH1_ACKS_MAX	64
+
+typedef struct {
+	void *msg;
+	s32 result;
+} test_oh1_ack_t;
+
+/* Messages ACKed back to the host (os_message_queue_ack) */
+extern test_oh1_ack_t test_oh1_acks[TEST_OH1_ACKS_MAX];
+extern u32 test_oh1_num_acks;
+/* Number of messages posted to the OH1 queue (os_message_queue_send) */
+extern u32 test_oh1_num_sends;
+/* Repeat time of the periodic timer in us (0 while stopped), and number of rate changes */
+extern s32 test_oh1_timer_period;
+extern u32 test_oh1_timer_changes;
+/* Value returned by os_timer_now */
+extern u32 test_oh1_timer_now;
+
+void test_oh1_reset(void);
+/* Posts a message to the OH1 queue, like the host or a timer would */
+int test_oh1_post(void *msg);
+/* Posts the message of the periodic timer */
+int test_oh1_post_timer(void);
+
+#endif
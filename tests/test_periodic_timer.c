@@ -0,0 +1,164 @@
+#include "test_oh1.h"
+
+/* The main loop is built as is, with its OH1 hooks driven by the test */
+#define main fakemote_main
+#include "main.c"
+#undef main
+
+/* The periodic timer rate only has to be re-evaluated when the tick work changes: messages
+ * that don't touch it (host buffers, input without new work...) must not pay for it */
+
+#define TEST_HOST_BUFFERS	100
+
+static input_device_t *input_device;
+
+static int test_resume(void *usrdata, fake_wiimote_t *wiimote)
+{
+	return 0;
+}
+
+static int test_suspend(void *usrdata)
+{
+	return 0;
+}
+
+static int test_set_leds(void *usrdata, int leds)
+{
+	return 0;
+}
+
+static int test_set_rumble(void *usrdata, bool rumble_on)
+{
+	return 0;
+}
+
+static bool test_report_input(void *usrdata)
+{
+	return true;
+}
+
+static void test_removed(void *usrdata)
+{
+}
+
+static const input_device_ops_t test_input_device_ops = {
+	.resume		= test_resume,
+	.suspend	= test_suspend,
+	.set_leds	= test_set_leds,
+	.set_rumble	= test_set_rumble,
+	.report_input	= test_report_input,
+	.removed	= test_removed,
+};
+
+static void run_oh1(void)
+{
+	ipcmessage *msg = NULL;
+
+	OH1_IOS_ReceiveMessage_hook(orig_msg_queueid, &msg, 0);
+}
+
+/* HCI event buffer given by the host */
+static u8 host_endpoint = EP_HCI_EVENT;
+static u16 host_wLength;
+static u8 host_data[64];
+static ioctlv host_vectors[3];
+static ipcmessage host_msgs[TEST_HOST_BUFFERS];
+
+static void post_host_hci_event_buffer(ipcmessage *msg)
+{
+	host_wLength = sizeof(host_data);
+	host_vectors[0] = (ioctlv){&host_endpoint, sizeof(host_endpoint)};
+	host_vectors[1] = (ioctlv){&host_wLength, sizeof(host_wLength)};
+	host_vectors[2] = (ioctlv){host_data, sizeof(host_data)};
+	msg->command = IOS_IOCTLV;
+	msg->ioctlv.command = USBV0_IOCTLV_INTRMSG;
+	msg->ioctlv.num_in = 2;
+	msg->ioctlv.num_io = 1;
+	msg->ioctlv.vector = host_vectors;
+	test_oh1_post(msg);
+}
+
+/* HCI Write Scan Enable sent by the host */
+static u8 cmd_bRequest = EP_HCI_CTRL;
+static u16 cmd_wLength;
+static u8 cmd_data[sizeof(hci_cmd_hdr_t) + sizeof(hci_write_scan_enable_cp)];
+static ioctlv cmd_vectors[7];
+static ipcmessage cmd_msg;
+
+static void post_host_write_scan_enable(u8 scan_enable)
+{
+	hci_cmd_hdr_t *hdr = (void *)cmd_data;
+	hci_write_scan_enable_cp *cp = (void *)(hdr + 1);
+
+	hdr->opcode = htole16(HCI_CMD_WRITE_SCAN_ENABLE);
+	hdr->length = sizeof(*cp);
+	cp->scan_enable = scan_enable;
+	cmd_wLength = htole16(sizeof(cmd_data));
+	cmd_vectors[1] = (ioctlv){&cmd_bRequest, sizeof(cmd_bRequest)};
+	cmd_vectors[4] = (ioctlv){&cmd_wLength, sizeof(cmd_wLength)};
+	cmd_vectors[6] = (ioctlv){cmd_data, sizeof(cmd_data)};
+	cmd_msg.command = IOS_IOCTLV;
+	cmd_msg.ioctlv.command = USBV0_IOCTLV_CTRLMSG;
+	cmd_msg.ioctlv.num_in = 6;
+	cmd_msg.ioctlv.num_io = 1;
+	cmd_msg.ioctlv.vector = cmd_vectors;
+	test_oh1_post(&cmd_msg);
+}
+
+static void test_rate_updates(void)
+{
+	u32 updates;
+
+	test_oh1_reset();
+	ensure_initalized();
+
+	/* No input devices: the timer is stopped */
+	run_oh1();
+	CHECK(test_oh1_timer_period == 0);
+	updates = g_periodic_timer_rate_updates;
+
+	/* Host buffers don't change the tick work */
+	for (int i = 0; i < TEST_HOST_BUFFERS; i++) {
+		post_host_hci_event_buffer(&host_msgs[i]);
+		run_oh1();
+	}
+	CHECK(g_periodic_timer_rate_updates == updates);
+
+	/* A new input device has to be ticked, slowly while the host doesn't allow connections */
+	CHECK(input_devices_add(NULL, &test_input_device_ops, &input_device));
+	run_oh1();
+	CHECK(g_periodic_timer_rate_updates == updates + 1);
+	CHECK(test_oh1_timer_period == PERIODC_TIMER_IDLE_PERIOD);
+
+	/* Once it does, the fake Wiimote has to request the connection at full rate */
+	post_host_write_scan_enable(HCI_PAGE_SCAN_ENABLE);
+	run_oh1();
+	/* The command is handed down to OH1, the rate is updated once OH1 waits again */
+	run_oh1();
+	CHECK(g_periodic_timer_rate_updates == updates + 2);
+	CHECK(test_oh1_timer_period == PERIODC_TIMER_PERIOD);
+
+	/* Ticks re-evaluate it too, and stop the timer once the device is gone */
+	test_oh1_post_timer();
+	run_oh1();
+	CHECK(g_periodic_timer_rate_updates == updates + 3);
+	CHECK(fake_wiimote_mgr_any_active());
+
+	input_devices_remove(input_device);
+	run_oh1();
+	CHECK(!fake_wiimote_mgr_any_active());
+	CHECK(test_oh1_timer_period == 0);
+
+	printf("periodic timer rate: %u evaluations for %d host buffers and %d other messages\n",
+	       g_periodic_timer_rate_updates - updates, TEST_HOST_BUFFERS, 4);
+}
+
+int main(void)
+{
+	test_rate_updates();
+
+	if (test_failures)
+		printf("%d checks failed\n", test_failures);
+
+	return test_failures ? 1 : 0;
+}
@@ -0,0 +1,195 @@
+#include <stdlib.h>
+#include <string.h>
+#include "fake_wiimote_mgr.h"
+#include "hci_state.h"
+#include "injmessage.h"
+#include "input_device.h"
+#include "syscalls.h"
+#include "test_queues.h"
+
+test_msg_t test_intr_msgs[TEST_MSGS_MAX];
+u32 test_num_intr_msgs;
+test_msg_t test_bulk_in_msgs[TEST_MSGS_MAX];
+u32 test_num_bulk_in_msgs;
+u32 test_intr_reserved;
+u32 test_bulk_in_reserved;
+int test_bulk_in_injects_left;
+
+u8 g_sensor_bar_position_top;
+
+void test_host_init(void)
+{
+	injmessage_init_heap();
+	test_host_clear_msgs();
+	test_heap_allocs_left = -1;
+	test_bulk_in_injects_left = -1;
+}
+
+void test_host_clear_msgs(void)
+{
+	test_num_intr_msgs = 0;
+	test_num_bulk_in_msgs = 0;
+	test_intr_reserved = 0;
+	test_bulk_in_reserved = 0;
+}
+
+void my_assert_func(const char *file, int line, const char *func, const char *failedexpr)
+{
+	printf("assertion \"%s\" failed: file \"%s\", line %d, function %s\n",
+	       failedexpr, file, line, func);
+	abort();
+}
+
+bool test_send_hci_cmd(u16 opcode, const void *payload, u8 size)
+{
+	u8 buf[sizeof(hci_cmd_hdr_t) + 255];
+	hci_cmd_hdr_t *hdr = (void *)buf;
+	bool fwd_to_usb = true;
+
+	hdr->opcode = htole16(opcode);
+	hdr->length = size;
+	if (size > 0)
+		memcpy(buf + sizeof(*hdr), payload, size);
+	hci_state_handle_hci_cmd_from_host(buf, sizeof(*hdr) + size, &fwd_to_usb);
+
+	return fwd_to_usb;
+}
+
+/* Main loop queues: the host never has a buffer pending, so every injected
+ * message goes through the ReadyQ, where it gets recorded */
+
+static int record_msg(test_msg_t *msgs, u32 *num_msgs, void *msg)
+{
+	injmessage *inj = msg;
+
+	if ((*num_msgs >= TEST_MSGS_MAX) || (inj->size > TEST_MSG_MAX_SIZE)) {
+		injmessage_free(msg);
+		return IOS_EQUEUEFULL;
+	}
+
+	msgs[*num_msgs].size = inj->size;
+	memcpy(msgs[*num_msgs].data, inj->data, inj->size);
+	(*num_msgs)++;
+	injmessage_free(msg);
+
+	return IOS_OK;
+}
+
+void *claim_usb_intr_pending_msg(void **data, u16 size)
+{
+	return NULL;
+}
+
+void *claim_usb_bulk_in_pending_msg(void **data, u16 size)
+{
+	return NULL;
+}
+
+static bool reserve(u32 num_msgs, u32 *reserved, u32 num)
+{
+	if (num_msgs + *reserved + num > TEST_MSGS_MAX)
+		return false;
+
+	*reserved += num;
+	return true;
+}
+
+bool usb_intr_ready_queue_reserve(u32 num)
+{
+	return reserve(test_num_intr_msgs, &test_intr_reserved, num);
+}
+
+bool usb_bulk_in_ready_queue_reserve(u32 num)
+{
+	return reserve(test_num_bulk_in_msgs, &test_bulk_in_reserved, num);
+}
+
+void usb_intr_ready_queue_unreserve(u32 num)
+{
+	test_intr_reserved -= num;
+}
+
+void usb_bulk_in_ready_queue_unreserve(u32 num)
+{
+	test_bulk_in_reserved -= num;
+}
+
+int inject_msg_to_usb_intr_ready_queue(void *msg)
+{
+	test_intr_reserved--;
+	return record_msg(test_intr_msgs, &test_num_intr_msgs, msg);
+}
+
+int inject_msg_to_usb_bulk_in_ready_queue(void *msg)
+{
+	test_bulk_in_reserved--;
+	if (test_bulk_in_injects_left == 0) {
+		injmessage_free(msg);
+		return IOS_EQUEUEFULL;
+	}
+	if (test_bulk_in_injects_left > 0)
+		test_bulk_in_injects_left--;
+	return record_msg(test_bulk_in_msgs, &test_num_bulk_in_msgs, msg);
+}
+
+u32 usb_bulk_in_pending_msgs(void)
+{
+	return 0;
+}
+
+void periodic_timer_request_update(void)
+{
+}
+
+void cache_dirty_add(const void *addr, u32 size)
+{
+}
+
+/* Fake Wiimote manager: no fake Wiimote is connected */
+
+bool fake_wiimote_mgr_handle_hci_cmd_from_host(const hci_cmd_hdr_t *hdr)
+{
+	return false;
+}
+
+bool fake_wiimote_mgr_handle_acl_data_out_request_from_host(u16 hci_con_handle,
+							     const hci_acldata_hdr_t *hdr)
+{
+	return false;
+}
+
+u32 fake_wiimote_mgr_num_connected(void)
+{
+	return 0;
+}
+
+u8 fake_wiimote_mgr_piggyback_num_compl_pkts(hci_num_compl_pkts_info *info, u8 max_entries)
+{
+	return 0;
+}
+
+/* Input devices */
+
+void input_device_release_wiimote(input_device_t *input_device)
+{
+}
+
+int input_device_resume(input_device_t *input_device)
+{
+	return 0;
+}
+
+int input_device_set_leds(input_device_t *input_device, int leds)
+{
+	return 0;
+}
+
+int input_device_set_rumble(input_device_t *input_device, bool rumble_on)
+{
+	return 0;
+}
+
+bool input_device_report_input(input_device_t *input_device)
+{
+	return false;
+}
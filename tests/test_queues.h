@@ -0,0 +1,35 @@
+#ifndef TEST_QUEUES_H
+#define TEST_QUEUES_H
+
+#include "test_host.h"
+#include "types.h"
+
+/* Host replacements of the main loop's queues, so that the HCI and L2CAP code
+ * can be driven from a regular program without the main loop */
+
+#define TEST_MSG_MAX_SIZE	512
+#define TEST_MSGS_MAX		32
+
+typedef struct {
+	u16 size;
+	u8 data[TEST_MSG_MAX_SIZE];
+} test_msg_t;
+
+/* Messages injected to the interrupt (HCI events) and bulk in (ACL data) ReadyQs */
+extern test_msg_t test_intr_msgs[TEST_MSGS_MAX];
+extern u32 test_num_intr_msgs;
+extern test_msg_t test_bulk_in_msgs[TEST_MSGS_MAX];
+extern u32 test_num_bulk_in_msgs;
+/* Room reserved in them by messages that haven't been injected yet */
+extern u32 test_intr_reserved;
+extern u32 test_bulk_in_reserved;
+/* Bulk in injections that succeed before they start failing, -1 for no limit */
+extern int test_bulk_in_injects_left;
+
+void test_host_init(void);
+void test_host_clear_msgs(void);
+/* Sends an HCI command from the host to the HCI state tracker.
+ * Returns true if it would be handed down to the controller */
+bool test_send_hci_cmd(u16 opcode, const void *payload, u8 size);
+
+#endif
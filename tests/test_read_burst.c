@@ -0,0 +1,330 @@
+#include "test_oh1.h"
+
+/* The main loop is built as is, with its OH1 hooks driven by the test */
+#define main fakemote_main
+#include "main.c"
+#undef main
+/* And the manager, to connect its fake Wiimotes without a host doing the HCI handshake */
+#include "fake_wiimote_mgr.c"
+
+/* Memory reads answered with a burst of replies per tick. A burst is bounded by the host
+ * buffers waiting on the PendingQ, shared with the other connected fake Wiimotes, and by
+ * the number of ACL packets the host can buffer. The time to complete the usual reads is
+ * measured in ticks, with the host giving a number of ACL buffers per tick */
+
+#define TEST_HOST_BUFFERS	16
+#define TEST_TICKS_MAX		1000
+#define TEST_LOCAL_CID		0x0040
+#define TEST_REMOTE_CID		0x0041
+/* READ_REPLY_BURST_MAX */
+#define TEST_BURST_MAX		8
+
+typedef struct {
+	const char *name;
+	u8 space;
+	u8 slave_address;
+	u16 address;
+	u16 size;
+} test_read_t;
+
+static const test_read_t test_reads[] = {
+	{"Mii block",		ADDRESS_SPACE_EEPROM,	0,			0x0000,	EEPROM_FREE_SIZE},
+	{"calibration",		ADDRESS_SPACE_EEPROM,	0,			0x0016,	10},
+	{"extension ID",	ADDRESS_SPACE_I2C_BUS,	EXTENSION_I2C_ADDR,	0x00FA,	6},
+};
+
+static const u32 test_host_buffers_per_tick[] = {1, 2, 4, 8};
+
+static input_device_t *input_devices[MAX_FAKE_WIIMOTES];
+
+static int test_resume(void *usrdata, fake_wiimote_t *wiimote)
+{
+	return 0;
+}
+
+static int test_suspend(void *usrdata)
+{
+	return 0;
+}
+
+static int test_set_leds(void *usrdata, int leds)
+{
+	return 0;
+}
+
+static int test_set_rumble(void *usrdata, bool rumble_on)
+{
+	return 0;
+}
+
+static bool test_report_input(void *usrdata)
+{
+	return true;
+}
+
+static void test_removed(void *usrdata)
+{
+}
+
+static const input_device_ops_t test_input_device_ops = {
+	.resume		= test_resume,
+	.suspend	= test_suspend,
+	.set_leds	= test_set_leds,
+	.set_rumble	= test_set_rumble,
+	.report_input	= test_report_input,
+	.removed	= test_removed,
+};
+
+/* ACL IN buffers given by the host. The ones not filled on a tick stay on the PendingQ */
+static u8 host_endpoint = EP_ACL_DATA_IN;
+static u16 host_wLength;
+static u8 host_data[TEST_HOST_BUFFERS][64];
+static ioctlv host_vectors[TEST_HOST_BUFFERS][3];
+static ipcmessage host_msgs[TEST_HOST_BUFFERS];
+static bool host_posted[TEST_HOST_BUFFERS];
+static u32 host_num_posted;
+
+/* What the host got on each tick */
+static u32 num_replies;
+static u16 next_reply_address;
+static bool replies_in_order;
+static u32 num_input_reports[MAX_FAKE_WIIMOTES];
+
+static void run_oh1(void)
+{
+	ipcmessage *msg = NULL;
+
+	OH1_IOS_ReceiveMessage_hook(orig_msg_queueid, &msg, 0);
+}
+
+static void post_host_acl_in_buffers(u32 num)
+{
+	host_wLength = sizeof(host_data[0]);
+
+	for (int i = 0; (i < TEST_HOST_BUFFERS) && (host_num_posted < num); i++) {
+		if (host_posted[i])
+			continue;
+
+		host_vectors[i][0] = (ioctlv){&host_endpoint, sizeof(host_endpoint)};
+		host_vectors[i][1] = (ioctlv){&host_wLength, sizeof(host_wLength)};
+		host_vectors[i][2] = (ioctlv){host_data[i], sizeof(host_data[i])};
+		host_msgs[i].command = IOS_IOCTLV;
+		host_msgs[i].ioctlv.command = USBV0_IOCTLV_BLKMSG;
+		host_msgs[i].ioctlv.num_in = 2;
+		host_msgs[i].ioctlv.num_io = 1;
+		host_msgs[i].ioctlv.vector = host_vectors[i];
+		host_posted[i] = true;
+		host_num_posted++;
+		test_oh1_post(&host_msgs[i]);
+		run_oh1();
+	}
+}
+
+/* The host buffers filled since the last call */
+static void receive_host_acl_in_buffers(void)
+{
+	for (int i = 0; i < test_oh1_num_acks; i++) {
+		ipcmessage *msg = test_oh1_acks[i].msg;
+		int index = msg - host_msgs;
+		const hci_acldata_hdr_t *acl = (const void *)host_data[index];
+		const u8 *hid = host_data[index] + sizeof(*acl) + sizeof(l2cap_hdr_t);
+		const struct wiimote_input_report_read_data_t *reply = (const void *)&hid[2];
+		u16 con_handle = HCI_CON_HANDLE(le16toh(acl->con_handle));
+
+		CHECK((index >= 0) && (index < TEST_HOST_BUFFERS) && host_posted[index]);
+		host_posted[index] = false;
+		host_num_posted--;
+
+		if (hid[1] == INPUT_REPORT_ID_READ_DATA_REPLY) {
+			if (reply->address != next_reply_address)
+				replies_in_order = false;
+			next_reply_address += reply->size_minus_one + 1;
+			num_replies++;
+		} else {
+			for (int j = 0; j < MAX_FAKE_WIIMOTES; j++) {
+				if (fake_wiimotes_hot[j].hci_con_handle == con_handle)
+					num_input_reports[j]++;
+			}
+		}
+	}
+	test_oh1_reset();
+}
+
+static void send_output_report(fake_wiimote_t *wiimote, u8 report_id, const void *data, u8 size)
+{
+	struct {
+		hci_acldata_hdr_t acl;
+		l2cap_hdr_t l2cap;
+		u8 hid;
+		u8 report_id;
+		u8 data[16];
+	} __packed out = {0};
+	u16 length = sizeof(out.l2cap) + 2 + size;
+
+	out.acl.con_handle = htole16(HCI_MK_CON_HANDLE(wiimote->hot->hci_con_handle,
+						       HCI_PACKET_START, 0));
+	out.acl.length = htole16(length);
+	out.l2cap.length = htole16(length - sizeof(out.l2cap));
+	out.l2cap.dcid = htole16(TEST_LOCAL_CID);
+	out.hid = (HID_TYPE_DATA << 4) | HID_PARAM_OUTPUT;
+	out.report_id = report_id;
+	memcpy(out.data, data, size);
+	fake_wiimote_handle_acl_data_out_request_from_host(wiimote, &out.acl);
+	wiimote->hot->num_completed_acl_data_packets = 0;
+}
+
+/* A fake Wiimote with its HID channels open */
+static void connect_fake_wiimote(int i, bool continuous)
+{
+	fake_wiimote_t *wiimote = &fake_wiimotes[i];
+
+	CHECK(input_devices_add(NULL, &test_input_device_ops, &input_devices[i]));
+	run_oh1();
+
+	input_device_assign_wiimote(input_devices[i], wiimote);
+	fake_wiimote_init_state(wiimote, input_devices[i]);
+	fake_wiimotes_hot[i].active = true;
+	CHECK(fake_wiimote_mgr_handle_hci_cmd_accept_con(&wiimote->bdaddr, HCI_ROLE_SLAVE));
+	wiimote->psm_hid_intr_chn = (l2cap_channel_info_t){
+		.valid		= true,
+		.state		= L2CAP_CHANNEL_STATE_COMPLETE,
+		.psm		= L2CAP_PSM_HID_INTR,
+		.local_cid	= TEST_LOCAL_CID,
+		.remote_cid	= TEST_REMOTE_CID,
+	};
+	fake_wiimotes_hot[i].acl_state = ACL_STATE_INACTIVE;
+	fake_wiimotes_hot[i].work = 0;
+
+	if (continuous) {
+		struct wiimote_output_report_mode_t mode = {0};
+
+		mode.continuous = 1;
+		mode.mode = INPUT_REPORT_ID_BTN_ACC;
+		send_output_report(wiimote, OUTPUT_REPORT_ID_REPORT_MODE, &mode, sizeof(mode));
+	}
+}
+
+/* Host ACL buffers are given before each tick, the read request comes before the first
+ * one. Returns the number of ticks until the host got every reply */
+static u32 run_read(const test_read_t *read, u32 host_buffers)
+{
+	struct wiimote_output_report_read_data_t cp = {0};
+	u32 expected = (read->size + 15) / 16;
+	u32 ticks = 0;
+
+	cp.space = read->space;
+	cp.slave_address = read->slave_address;
+	cp.address = read->address;
+	cp.size = read->size;
+
+	num_replies = 0;
+	next_reply_address = read->address;
+	replies_in_order = true;
+	memset(num_input_reports, 0, sizeof(num_input_reports));
+
+	post_host_acl_in_buffers(host_buffers);
+	send_output_report(&fake_wiimotes[0], OUTPUT_REPORT_ID_READ_DATA, &cp, sizeof(cp));
+	receive_host_acl_in_buffers();
+
+	while ((num_replies < expected) && (ticks < TEST_TICKS_MAX)) {
+		post_host_acl_in_buffers(host_buffers);
+		test_oh1_post_timer();
+		run_oh1();
+		ticks++;
+		receive_host_acl_in_buffers();
+	}
+
+	CHECK(num_replies == expected);
+	CHECK(replies_in_order);
+	CHECK(fake_wiimotes[0].read_request.size == 0);
+
+	return ticks;
+}
+
+static void test_read_completion(void)
+{
+	u32 ticks;
+
+	for (int i = 0; i < ARRAY_SIZE(test_reads); i++) {
+		const test_read_t *read = &test_reads[i];
+		u32 replies = (read->size + 15) / 16;
+
+		for (int j = 0; j < ARRAY_SIZE(test_host_buffers_per_tick); j++) {
+			u32 host_buffers = test_host_buffers_per_tick[j];
+			u32 burst = MIN2(host_buffers, TEST_BURST_MAX);
+
+			ticks = run_read(read, host_buffers);
+			/* The request sends the first burst, each tick sends the next one */
+			CHECK(ticks == (replies - 1) / burst);
+			printf("%s (%d replies), %d host buffers: %d ticks after the request (%d ms)\n",
+			       read->name, replies, host_buffers, ticks,
+			       ticks * PERIODC_TIMER_PERIOD / 1000);
+		}
+	}
+}
+
+static bool test_send_hci_cmd(u16 opcode, const void *payload, u8 size)
+{
+	u8 buf[sizeof(hci_cmd_hdr_t) + 255];
+	hci_cmd_hdr_t *hdr = (void *)buf;
+	bool fwd_to_usb = true;
+
+	hdr->opcode = htole16(opcode);
+	hdr->length = size;
+	memcpy(buf + sizeof(*hdr), payload, size);
+	hci_state_handle_hci_cmd_from_host(buf, sizeof(*hdr) + size, &fwd_to_usb);
+
+	return fwd_to_usb;
+}
+
+static void test_read_host_num_acl_pkts(void)
+{
+	hci_host_buffer_size_cp cp = {0};
+	const test_read_t *read = &test_reads[0];
+	u32 replies = (read->size + 15) / 16;
+
+	/* The host can only buffer 2 ACL packets, even if it gave more buffers */
+	cp.max_acl_size = htole16(sizeof(host_data[0]));
+	cp.num_acl_pkts = htole16(2);
+	CHECK(test_send_hci_cmd(HCI_CMD_HOST_BUFFER_SIZE, &cp, sizeof(cp)));
+	CHECK(run_read(read, 8) == (replies - 1) / 2);
+
+	cp.num_acl_pkts = 0;
+	CHECK(test_send_hci_cmd(HCI_CMD_HOST_BUFFER_SIZE, &cp, sizeof(cp)));
+}
+
+static void test_read_shared(void)
+{
+	const test_read_t *read = &test_reads[0];
+	u32 replies = (read->size + 15) / 16;
+	u32 ticks;
+
+	/* The other fake Wiimotes keep sending continuous input reports during the read */
+	for (int i = 1; i < MAX_FAKE_WIIMOTES; i++)
+		connect_fake_wiimote(i, true);
+
+	ticks = run_read(read, 8);
+	/* The reader gets its share of the host buffers, 8 / 4 */
+	CHECK(ticks == (replies - 1) / 2);
+	/* And none of the input reports had to wait */
+	for (int i = 1; i < MAX_FAKE_WIIMOTES; i++)
+		CHECK(num_input_reports[i] == ticks);
+	printf("%s with %d fake Wiimotes, 8 host buffers: %d ticks (%d ms)\n", read->name,
+	       MAX_FAKE_WIIMOTES, ticks, ticks * PERIODC_TIMER_PERIOD / 1000);
+}
+
+int main(void)
+{
+	test_oh1_reset();
+	ensure_initalized();
+	connect_fake_wiimote(0, false);
+
+	test_read_completion();
+	test_read_host_num_acl_pkts();
+	test_read_shared();
+
+	if (test_failures)
+		printf("%d checks failed\n", test_failures);
+
+	return test_failures ? 1 : 0;
+}
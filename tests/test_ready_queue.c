@@ -0,0 +1,392 @@
+#include "test_oh1.h"
+
+/* The main loop is built as is, so that its queues can be driven directly */
+#define main fakemote_main
+#include "main.c"
+#undef main
+
+/* ReadyQ and PendingQ ring buffers: ordering, the priority lane, deferred stage, coalescing,
+ * overflow and the backpressure on injected messages */
+
+#define TEST_BENCH_ITERATIONS	100000
+#define TEST_BENCH_BATCH	8
+
+#define TEST_CON_HANDLE		0x0100
+#define TEST_HID_INTR_CID	0x0041
+
+/* Injected ACL message carrying an HID input report, tagged with a sequence number.
+ * With no host buffer pending, it waits in the ReadyQ: it is injected into an empty one
+ * and taken back, and then the ReadyQ under test is restored */
+static void *new_packet(u16 con_handle, u16 dcid, u8 report_id, u8 seq)
+{
+	const u8 payload[] = {(HID_TYPE_DATA << 4) | HID_PARAM_INPUT, report_id, seq};
+	ready_queue_t *queue = &ready_usb_bulk_in_msg_queue;
+	ready_queue_t saved = *queue;
+	void *msg = NULL;
+
+	memset(&queue->prio, 0, sizeof(queue->prio));
+	memset(&queue->data, 0, sizeof(queue->data));
+	if (inject_l2cap_packet(con_handle, dcid, payload, sizeof(payload)) == IOS_OK)
+		msg = ready_queue_pop(queue);
+	*queue = saved;
+
+	return msg;
+}
+
+static void *new_report(u16 con_handle, u8 report_id, u8 seq)
+{
+	return new_packet(con_handle, TEST_HID_INTR_CID, report_id, seq);
+}
+
+/* The same, injected into the ReadyQ under test */
+static int inject_report(u16 con_handle, u8 report_id, u8 seq)
+{
+	const u8 payload[] = {(HID_TYPE_DATA << 4) | HID_PARAM_INPUT, report_id, seq};
+
+	return inject_l2cap_packet(con_handle, TEST_HID_INTR_CID, payload, sizeof(payload));
+}
+
+static u8 msg_seq(const void *msg)
+{
+	int size;
+	const u8 *data = get_ready_msg_data(msg, &size);
+
+	return data[sizeof(hci_acldata_hdr_t) + sizeof(l2cap_hdr_t) + 2];
+}
+
+static u8 msg_report_id(const void *msg)
+{
+	int size;
+	const u8 *data = get_ready_msg_data(msg, &size);
+
+	return data[sizeof(hci_acldata_hdr_t) + sizeof(l2cap_hdr_t) + 1];
+}
+
+/* Host buffers, posted through the OH1 hook */
+static u8 host_endpoints[] = {EP_HCI_EVENT, EP_ACL_DATA_IN};
+static u16 host_wLengths[ARRAY_SIZE(host_endpoints)];
+static u8 host_data[ARRAY_SIZE(host_endpoints)][64];
+static ioctlv host_vectors[ARRAY_SIZE(host_endpoints)][3];
+static ipcmessage host_msgs[ARRAY_SIZE(host_endpoints)];
+
+static void post_host_buffer(int i)
+{
+	ipcmessage *msg = NULL;
+
+	host_wLengths[i] = sizeof(host_data[i]);
+	host_vectors[i][0] = (ioctlv){&host_endpoints[i], sizeof(host_endpoints[i])};
+	host_vectors[i][1] = (ioctlv){&host_wLengths[i], sizeof(host_wLengths[i])};
+	host_vectors[i][2] = (ioctlv){host_data[i], sizeof(host_data[i])};
+	host_msgs[i].command = IOS_IOCTLV;
+	host_msgs[i].ioctlv.command = (host_endpoints[i] == EP_HCI_EVENT) ? USBV0_IOCTLV_INTRMSG :
+									      USBV0_IOCTLV_BLKMSG;
+	host_msgs[i].ioctlv.num_in = 2;
+	host_msgs[i].ioctlv.num_io = 1;
+	host_msgs[i].ioctlv.vector = host_vectors[i];
+	test_oh1_post(&host_msgs[i]);
+	OH1_IOS_ReceiveMessage_hook(orig_msg_queueid, &msg, 0);
+}
+
+static void drain(ready_queue_t *queue)
+{
+	void *msg;
+
+	while ((msg = ready_queue_pop(queue)))
+		injmessage_free(msg);
+}
+
+static void test_msg_ring(void)
+{
+	msg_ring_t ring = {0};
+	uintptr_t next_push = 1, next_pop = 1;
+
+	CHECK(msg_ring_is_empty(&ring));
+	CHECK(msg_ring_peek(&ring) == NULL);
+	CHECK(msg_ring_pop(&ring) == NULL);
+
+	/* Full */
+	for (int i = 0; i < MSG_RING_SIZE; i++)
+		CHECK(msg_ring_push(&ring, (void *)next_push++) == IOS_OK);
+	CHECK(msg_ring_is_full(&ring));
+	CHECK(msg_ring_push(&ring, (void *)next_push) == IOS_EQUEUEFULL);
+	CHECK(msg_ring_count(&ring) == MSG_RING_SIZE);
+
+	/* The free running u8 indices wrap around several times */
+	for (int i = 0; i < 1000; i++) {
+		CHECK(msg_ring_pop(&ring) == (void *)next_pop++);
+		CHECK(msg_ring_push(&ring, (void *)next_push++) == IOS_OK);
+		CHECK(msg_ring_count(&ring) == MSG_RING_SIZE);
+	}
+
+	/* Removing an entry keeps the order of the rest */
+	CHECK(msg_ring_at(&ring, 3) == (void *)(next_pop + 3));
+	msg_ring_remove(&ring, 3);
+	CHECK(msg_ring_count(&ring) == MSG_RING_SIZE - 1);
+	for (int i = 0; i < MSG_RING_SIZE - 1; i++) {
+		if (i == 3)
+			next_pop++;
+		CHECK(msg_ring_pop(&ring) == (void *)next_pop++);
+	}
+	CHECK(msg_ring_is_empty(&ring));
+}
+
+static void test_prio_lane(void)
+{
+	ready_queue_t *queue = &ready_usb_bulk_in_msg_queue;
+	void *reports[3], *signal;
+
+	for (int i = 0; i < ARRAY_SIZE(reports); i++)
+		reports[i] = new_report(TEST_CON_HANDLE + i, INPUT_REPORT_ID_BTN, i);
+	signal = new_packet(TEST_CON_HANDLE, L2CAP_SIGNAL_CID, 0, 0xff);
+
+	/* L2CAP signaling skips the data reports, which keep their order */
+	for (int i = 0; i < ARRAY_SIZE(reports); i++)
+		CHECK(ready_queue_push(queue, reports[i]) == IOS_OK);
+	CHECK(ready_queue_push(queue, signal) == IOS_OK);
+
+	CHECK(ready_queue_pop(queue) == signal);
+	for (int i = 0; i < ARRAY_SIZE(reports); i++)
+		CHECK(ready_queue_pop(queue) == reports[i]);
+	CHECK(ready_queue_pop(queue) == NULL);
+
+	injmessage_free(signal);
+	for (int i = 0; i < ARRAY_SIZE(reports); i++)
+		injmessage_free(reports[i]);
+}
+
+static void test_deferred_order(void)
+{
+	ready_queue_t *queue = &ready_usb_bulk_in_msg_queue;
+	u32 deferred = g_ready_msgs_deferred;
+	void *msg;
+	u8 seq = 0;
+
+	/* Acks can't be dropped nor coalesced: the ones that don't fit wait in the deferred stage */
+	for (int i = 0; i < MSG_RING_SIZE + 10; i++)
+		CHECK(ready_queue_push(queue, new_report(TEST_CON_HANDLE, INPUT_REPORT_ID_ACK, i)) ==
+		      IOS_OK);
+	CHECK(g_ready_msgs_deferred == deferred + 10);
+
+	/* They are delivered in the order they were pushed */
+	while ((msg = ready_queue_pop(queue))) {
+		CHECK(msg_seq(msg) == seq++);
+		injmessage_free(msg);
+	}
+	CHECK(seq == MSG_RING_SIZE + 10);
+}
+
+static void test_coalesce_newest(void)
+{
+	ready_queue_t *queue = &ready_usb_bulk_in_msg_queue;
+	u32 coalesced = g_ready_msgs_coalesced;
+	const u8 expected[] = {3, 2, 4, 5};
+	void *msg;
+	int i = 0;
+
+	ready_queue_push(queue, new_report(TEST_CON_HANDLE, INPUT_REPORT_ID_BTN, 1));
+	ready_queue_push(queue, new_report(TEST_CON_HANDLE + 1, INPUT_REPORT_ID_BTN, 2));
+	/* Replaces the undelivered data report of the same connection, in place */
+	ready_queue_push(queue, new_report(TEST_CON_HANDLE, INPUT_REPORT_ID_BTN, 3));
+	CHECK(g_ready_msgs_coalesced == coalesced + 1);
+
+	/* A data report can't overtake an ack of its connection */
+	ready_queue_push(queue, new_report(TEST_CON_HANDLE, INPUT_REPORT_ID_ACK, 4));
+	ready_queue_push(queue, new_report(TEST_CON_HANDLE, INPUT_REPORT_ID_BTN, 5));
+	CHECK(g_ready_msgs_coalesced == coalesced + 1);
+
+	while ((msg = ready_queue_pop(queue))) {
+		CHECK((i < ARRAY_SIZE(expected)) && (msg_seq(msg) == expected[i]));
+		i++;
+		injmessage_free(msg);
+	}
+	CHECK(i == ARRAY_SIZE(expected));
+}
+
+static void test_overflow(void)
+{
+	ready_queue_t *queue = &ready_usb_bulk_in_msg_queue;
+	u32 dropped = g_ready_msgs_dropped;
+	int allocs = test_heap_allocs_live;
+	void *msg;
+	u8 seq = 1;
+
+	/* Fill the lane and its deferred stage with data reports of different connections */
+	for (int i = 0; i < 2 * MSG_RING_SIZE; i++)
+		CHECK(ready_queue_push(queue, new_report(TEST_CON_HANDLE + i,
+							 INPUT_REPORT_ID_BTN, i)) == IOS_OK);
+
+	/* An ack takes the place of the oldest data report */
+	CHECK(ready_queue_push(queue, new_report(TEST_CON_HANDLE, INPUT_REPORT_ID_ACK, 0xff)) ==
+	      IOS_OK);
+	CHECK(g_ready_msgs_dropped == dropped + 1);
+
+	while ((msg = ready_queue_pop(queue))) {
+		if (msg_report_id(msg) == INPUT_REPORT_ID_ACK)
+			CHECK(seq == 2 * MSG_RING_SIZE);
+		else
+			CHECK(msg_seq(msg) == seq++);
+		injmessage_free(msg);
+	}
+	CHECK(test_heap_allocs_live == allocs);
+}
+
+static void test_backpressure(void)
+{
+	ready_queue_t *queue = &ready_usb_bulk_in_msg_queue;
+	u32 dropped = g_ready_msgs_dropped;
+	int allocs = test_heap_allocs_live;
+	void *msg, *report, *hand_down_msgs[HAND_DOWN_MSGS_PER_EP];
+	int num_acks = 0;
+	u8 seq = 0;
+
+	/* Stand-ins for the hand down messages, which don't reserve room */
+	for (int i = 0; i < HAND_DOWN_MSGS_PER_EP; i++)
+		hand_down_msgs[i] = new_report(TEST_CON_HANDLE, INPUT_REPORT_ID_ACK,
+					       2 * MSG_RING_SIZE - HAND_DOWN_MSGS_PER_EP + i);
+	report = new_report(TEST_CON_HANDLE, INPUT_REPORT_ID_BTN, 0);
+
+	/* Messages that can't be dropped are refused once the ReadyQ can't take them anymore */
+	while (inject_report(TEST_CON_HANDLE, INPUT_REPORT_ID_ACK, num_acks) == IOS_OK)
+		num_acks++;
+	CHECK(num_acks == 2 * MSG_RING_SIZE - HAND_DOWN_MSGS_PER_EP);
+	CHECK(queue->reserved == 0);
+	CHECK(inject_report(TEST_CON_HANDLE + 1, INPUT_REPORT_ID_BTN, 0) == IOS_ENOMEM);
+
+	/* The hand down messages still fit */
+	for (int i = 0; i < HAND_DOWN_MSGS_PER_EP; i++, num_acks++)
+		CHECK(ready_queue_push(queue, hand_down_msgs[i]) == IOS_OK);
+	CHECK(g_ready_msgs_dropped == dropped);
+
+	/* Only a data report can overflow the ReadyQ */
+	CHECK(ready_queue_push(queue, report) == IOS_EQUEUEFULL);
+	CHECK(g_ready_msgs_dropped == dropped + 1);
+
+	/* Nothing else was lost */
+	while ((msg = ready_queue_pop(queue))) {
+		CHECK(msg_seq(msg) == seq++);
+		injmessage_free(msg);
+	}
+	CHECK(seq == num_acks);
+	CHECK(test_heap_allocs_live == allocs);
+}
+
+static void test_claim_pending(void)
+{
+	const hci_acldata_hdr_t *acl = (const void *)host_data[1];
+	const u8 l2cap_payload[] = {0xa1, INPUT_REPORT_ID_ACK, 0x00, 0x00, 0x12, 0x00};
+	u32 copied = g_l2cap_bytes_copied;
+
+	test_oh1_reset();
+	post_host_buffer(0);
+	post_host_buffer(1);
+	CHECK(msg_ring_count(&pending_usb_intr_msg_queue) == 1);
+	CHECK(msg_ring_count(&pending_usb_bulk_in_msg_queue) == 1);
+
+	/* The messages are built in the host buffers, the heap isn't touched */
+	test_heap_allocs_left = 0;
+	CHECK(inject_hci_event_command_status(HCI_CMD_ACCEPT_CON) == IOS_OK);
+	CHECK(inject_l2cap_packet(TEST_CON_HANDLE, TEST_HID_INTR_CID, l2cap_payload,
+				  sizeof(l2cap_payload)) == IOS_OK);
+	test_heap_allocs_left = -1;
+
+	CHECK(test_oh1_num_acks == 2);
+	CHECK((test_oh1_acks[0].msg == &host_msgs[0]) &&
+	      (test_oh1_acks[0].result == sizeof(hci_event_hdr_t) + sizeof(hci_command_status_ep)));
+	CHECK(host_data[0][0] == HCI_EVENT_COMMAND_STATUS);
+	CHECK((test_oh1_acks[1].msg == &host_msgs[1]) &&
+	      (test_oh1_acks[1].result == sizeof(*acl) + sizeof(l2cap_hdr_t) + sizeof(l2cap_payload)));
+	CHECK(HCI_CON_HANDLE(le16toh(acl->con_handle)) == TEST_CON_HANDLE);
+	CHECK(memcmp(host_data[1] + sizeof(*acl) + sizeof(l2cap_hdr_t), l2cap_payload,
+		     sizeof(l2cap_payload)) == 0);
+	/* The payload was copied once, from our buffer */
+	CHECK(g_l2cap_bytes_copied == copied + sizeof(l2cap_payload));
+	CHECK(msg_ring_is_empty(&pending_usb_intr_msg_queue));
+	CHECK(msg_ring_is_empty(&pending_usb_bulk_in_msg_queue));
+	CHECK(!claimed_usb_intr_msg.msg && !claimed_usb_bulk_in_msg.msg);
+
+	/* Without a host buffer, they go through the heap and the ReadyQ */
+	CHECK(inject_hci_event_command_status(HCI_CMD_ACCEPT_CON) == IOS_OK);
+	CHECK(ready_lane_count(&ready_usb_intr_msg_queue.prio) == 1);
+	test_oh1_reset();
+}
+
+static void bench_ready_queue(void)
+{
+	ready_queue_t *queue = &ready_usb_bulk_in_msg_queue;
+	void *msgs[TEST_BENCH_BATCH];
+	u64 start, queue_ns, ring_ns, mq_ns;
+	msg_ring_t ring = {0};
+	uintptr_t recv;
+
+	for (int i = 0; i < TEST_BENCH_BATCH; i++)
+		msgs[i] = new_report(TEST_CON_HANDLE, INPUT_REPORT_ID_ACK, i);
+
+	start = test_time_ns();
+	for (int n = 0; n < TEST_BENCH_ITERATIONS; n++) {
+		for (int i = 0; i < TEST_BENCH_BATCH; i++)
+			ready_queue_push(queue, msgs[i]);
+		for (int i = 0; i < TEST_BENCH_BATCH; i++)
+			CHECK(ready_queue_pop(queue) == msgs[i]);
+	}
+	queue_ns = test_time_ns() - start;
+
+	/* The same without classifying the messages into lanes */
+	start = test_time_ns();
+	for (int n = 0; n < TEST_BENCH_ITERATIONS; n++) {
+		for (int i = 0; i < TEST_BENCH_BATCH; i++)
+			msg_ring_push(&ring, msgs[i]);
+		for (int i = 0; i < TEST_BENCH_BATCH; i++)
+			CHECK(msg_ring_pop(&ring) == msgs[i]);
+	}
+	ring_ns = test_time_ns() - start;
+
+	/* What the ReadyQ used to do, through the host stubs of the IOS message queue */
+	test_oh1_reset();
+	start = test_time_ns();
+	for (int n = 0; n < TEST_BENCH_ITERATIONS; n++) {
+		for (int i = 0; i < TEST_BENCH_BATCH; i++)
+			os_message_queue_send(orig_msg_queueid, msgs[i], IOS_MESSAGE_NOBLOCK);
+		for (int i = 0; i < TEST_BENCH_BATCH; i++) {
+			os_message_queue_receive(orig_msg_queueid, &recv, IOS_MESSAGE_NOBLOCK);
+			CHECK(recv == (uintptr_t)msgs[i]);
+		}
+	}
+	mq_ns = test_time_ns() - start;
+	test_oh1_reset();
+
+	for (int i = 0; i < TEST_BENCH_BATCH; i++)
+		injmessage_free(msgs[i]);
+
+	/* The stubs don't trap into the kernel like the IOS syscalls do,
+	 * so the message queue figure is a lower bound */
+	printf("ReadyQ push+pop per message: %.1f ns (lanes, coalescing checks), %.1f ns (bare ring), "
+	       "%.1f ns (message queue stubs, without the syscalls)\n",
+	       (double)queue_ns / (TEST_BENCH_ITERATIONS * TEST_BENCH_BATCH),
+	       (double)ring_ns / (TEST_BENCH_ITERATIONS * TEST_BENCH_BATCH),
+	       (double)mq_ns / (TEST_BENCH_ITERATIONS * TEST_BENCH_BATCH));
+}
+
+int main(void)
+{
+	test_oh1_reset();
+	ensure_initalized();
+
+	test_msg_ring();
+	test_prio_lane();
+	drain(&ready_usb_bulk_in_msg_queue);
+	test_deferred_order();
+	drain(&ready_usb_bulk_in_msg_queue);
+	test_coalesce_newest();
+	drain(&ready_usb_bulk_in_msg_queue);
+	test_overflow();
+	drain(&ready_usb_bulk_in_msg_queue);
+	test_backpressure();
+	test_claim_pending();
+	drain(&ready_usb_intr_msg_queue);
+	bench_ready_queue();
+
+	if (test_failures)
+		printf("%d checks failed\n", test_failures);
+
+	return test_failures ? 1 : 0;
+}
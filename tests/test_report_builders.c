@@ -0,0 +1,300 @@
+#include "test_queues.h"
+
+/* The report builders are static: the fake Wiimote is built in. And the key generation,
+ * to write an extension key the bruteforce finds like a game would */
+#include "fake_wiimote.c"
+#include "wiimote_crypto.c"
+
+/* Data reports of every reporting mode, built by the per-mode builders from the layout
+ * table and, as a reference, the way they were built before: the report layout looked up
+ * through a switch per section, and every section encoded again for each report */
+
+#define TEST_REPORTS		1000
+#define BENCH_REPORTS		200000
+#define TEST_EXT_SIZE		MIN2(CONTROLLER_DATA_BYTES, 21)
+
+/* Layout helpers from before the layout table */
+
+static inline bool old_input_report_has_btn(u8 rpt_id)
+{
+	switch (rpt_id) {
+	case INPUT_REPORT_ID_EXP21:
+		return false;
+	default:
+		return true;
+	}
+}
+
+static inline u8 old_input_report_acc_size(u8 rpt_id)
+{
+	switch (rpt_id) {
+	case INPUT_REPORT_ID_BTN_ACC:
+	case INPUT_REPORT_ID_BTN_ACC_IR:
+	case INPUT_REPORT_ID_BTN_ACC_EXP:
+	case INPUT_REPORT_ID_BTN_ACC_IR_EXP:
+		return 3;
+	default:
+		return 0;
+	}
+}
+
+static inline u8 old_input_report_acc_offset(u8 rpt_id)
+{
+	switch (rpt_id) {
+	case INPUT_REPORT_ID_BTN_ACC:
+	case INPUT_REPORT_ID_BTN_ACC_IR:
+	case INPUT_REPORT_ID_BTN_ACC_EXP:
+	case INPUT_REPORT_ID_BTN_ACC_IR_EXP:
+		return 2;
+	default:
+		return 0;
+	}
+}
+
+static inline u8 old_input_report_ext_size(u8 rpt_id)
+{
+	switch (rpt_id) {
+	case INPUT_REPORT_ID_BTN_EXP8:
+		return 8;
+	case INPUT_REPORT_ID_BTN_EXP19:
+		return 19;
+	case INPUT_REPORT_ID_BTN_ACC_EXP:
+		return 16;
+	case INPUT_REPORT_ID_BTN_IR_EXP:
+		return 9;
+	case INPUT_REPORT_ID_BTN_ACC_IR_EXP:
+		return 6;
+	case INPUT_REPORT_ID_EXP21:
+		return 21;
+	default:
+		return 0;
+	}
+}
+
+static inline u8 old_input_report_ext_offset(u8 rpt_id)
+{
+	switch (rpt_id) {
+	case INPUT_REPORT_ID_BTN_EXP8:
+	case INPUT_REPORT_ID_BTN_EXP19:
+		return 2;
+	case INPUT_REPORT_ID_BTN_ACC_EXP:
+		return 5;
+	case INPUT_REPORT_ID_BTN_IR_EXP:
+		return 12;
+	case INPUT_REPORT_ID_BTN_ACC_IR_EXP:
+		return 15;
+	case INPUT_REPORT_ID_EXP21:
+	default:
+		return 0;
+	}
+}
+
+static inline u8 old_input_report_ir_size(u8 rpt_id)
+{
+	switch (rpt_id) {
+	case INPUT_REPORT_ID_BTN_ACC_IR:
+		return 12;
+	case INPUT_REPORT_ID_BTN_IR_EXP:
+	case INPUT_REPORT_ID_BTN_ACC_IR_EXP:
+		return 10;
+	default:
+		return 0;
+	}
+}
+
+static inline u8 old_input_report_ir_offset(u8 rpt_id)
+{
+	switch (rpt_id) {
+	case INPUT_REPORT_ID_BTN_ACC_IR:
+	case INPUT_REPORT_ID_BTN_ACC_IR_EXP:
+		return 5;
+	case INPUT_REPORT_ID_BTN_IR_EXP:
+		return 2;
+	default:
+		return 0;
+	}
+}
+
+/* The report data built by fake_wiimote_send_data_report before the builders.
+ * Returns the report size */
+static u8 old_build_data_report(fake_wiimote_t *wiimote, u8 *report_data)
+{
+	u8 mode = wiimote->hot->reporting_mode;
+	u16 buttons = wiimote->hot->buttons;
+	bool has_btn = old_input_report_has_btn(mode);
+	u8 acc_size = old_input_report_acc_size(mode);
+	u8 acc_offset = old_input_report_acc_offset(mode);
+	u8 ext_size = old_input_report_ext_size(mode);
+	u8 ext_offset = old_input_report_ext_offset(mode);
+	u8 ir_size = old_input_report_ir_size(mode);
+	u8 ir_offset = old_input_report_ir_offset(mode);
+
+	if (acc_size) {
+		report_data[acc_offset + 0] = (wiimote->acc_x >> 2) & 0xFF;
+		report_data[acc_offset + 1] = (wiimote->acc_y >> 2) & 0xFF;
+		report_data[acc_offset + 2] = (wiimote->acc_z >> 2) & 0xFF;
+		buttons |= ((wiimote->acc_x & 3) << 13) |
+			   ((wiimote->acc_y & 2) << 4)  |
+			   ((wiimote->acc_z & 2) << 5);
+	}
+
+	if (ir_size)
+		memcpy(&report_data[ir_offset], wiimote->ir_regs.camera_data, ir_size);
+
+	if (ext_size)
+		extension_read_data(wiimote, report_data + ext_offset, 0, ext_size);
+
+	if (has_btn)
+		memcpy(report_data, &buttons, sizeof(buttons));
+
+	return (has_btn ? 2 : 0) + acc_size + ext_size + ir_size;
+}
+
+static fake_wiimote_t wiimote;
+static fake_wiimote_hot_t hot;
+static u32 rand_state = 1;
+
+static u32 test_rand(void)
+{
+	rand_state = rand_state * 1103515245 + 12345;
+	return rand_state >> 8;
+}
+
+static void setup(u8 mode)
+{
+	u8 key_data[sizeof(wiimote.extension_regs.encryption_key_data)];
+	u8 rand[10], key[6];
+
+	fake_wiimote_init(&wiimote, &hot, &FAKE_WIIMOTE_BDADDR(0));
+	fake_wiimote_init_state(&wiimote, NULL);
+	hot.active = true;
+
+	/* A Nunchuk with encryption enabled, the extension bytes are reported encrypted */
+	wiimote.cur_extension = wiimote.new_extension = WIIMOTE_EXT_NUNCHUK;
+	fake_wiimote_reset_extension_state(&wiimote);
+	for (int i = 0; i < sizeof(rand); i++)
+		rand[i] = test_rand();
+	generate_key_data(key, rand, test_rand() % 7);
+	reverse_memcpy(key_data, rand, sizeof(rand));
+	reverse_memcpy(key_data + sizeof(rand), key, sizeof(key));
+	extension_write_data(&wiimote, key_data, offsetof(struct wiimote_extension_registers_t,
+							  encryption_key_data), sizeof(key_data));
+	wiimote.extension_regs.encryption = ENCRYPTION_ENABLED;
+
+	wiimote.ir_regs.mode = (old_input_report_ir_size(mode) == 12) ? IR_MODE_EXTENDED :
+									 IR_MODE_BASIC;
+	fake_wiimote_set_reporting_mode(&wiimote, mode);
+}
+
+/* Changes some of the inputs, like the input device would between reports */
+static void change_inputs(void)
+{
+	u32 changes = test_rand();
+	u16 buttons = hot.buttons;
+	u8 ext[TEST_EXT_SIZE];
+
+	if (changes & BIT(0))
+		buttons = test_rand() & 0x9F1F;
+	if (changes & BIT(1))
+		fake_wiimote_report_accelerometer(&wiimote, test_rand(), test_rand(), test_rand());
+	if (changes & BIT(2)) {
+		struct ir_dot_t dots[IR_MAX_DOTS] = {0};
+
+		for (int i = 0; i < IR_MAX_DOTS; i++)
+			dots[i] = (struct ir_dot_t){test_rand() & 0x3FF, test_rand() & 0x3FF};
+		fake_wiimote_report_ir_dots(&wiimote, dots);
+	}
+	if (changes & BIT(3)) {
+		for (int i = 0; i < sizeof(ext); i++)
+			ext[i] = test_rand();
+		fake_wiimote_report_input_ext(&wiimote, buttons, ext, sizeof(ext));
+	} else {
+		fake_wiimote_report_input(&wiimote, buttons);
+	}
+}
+
+static void test_layouts(void)
+{
+	/* Every report ID, the ones without a layout only carry the buttons */
+	for (int id = 0; id <= 0xFF; id++) {
+		const struct input_report_layout_t *layout = input_report_layout(id);
+
+		CHECK(layout->has_btn == old_input_report_has_btn(id));
+		CHECK(layout->acc_size == old_input_report_acc_size(id));
+		CHECK(layout->ext_size == old_input_report_ext_size(id));
+		CHECK(layout->ir_size == old_input_report_ir_size(id));
+		CHECK(!layout->acc_size || (layout->acc_offset == old_input_report_acc_offset(id)));
+		CHECK(!layout->ext_size || (layout->ext_offset == old_input_report_ext_offset(id)));
+		CHECK(!layout->ir_size || (layout->ir_offset == old_input_report_ir_offset(id)));
+	}
+}
+
+static void test_builders(void)
+{
+	u8 report[FAKE_WIIMOTE_REPORT_MAX_SIZE];
+	u8 old_report[FAKE_WIIMOTE_REPORT_MAX_SIZE];
+	u8 old_size;
+
+	for (u8 mode = INPUT_REPORT_ID_BTN; mode <= INPUT_REPORT_ID_BTN + 0x0F; mode++) {
+		setup(mode);
+
+		for (int i = 0; i < TEST_REPORTS; i++) {
+			change_inputs();
+			wiimote.build_report(&wiimote, report);
+			old_size = old_build_data_report(&wiimote, old_report);
+			CHECK(wiimote.report_size == old_size);
+			CHECK(!memcmp(report, old_report, old_size));
+		}
+	}
+}
+
+static void bench_builders(void)
+{
+	u8 report[FAKE_WIIMOTE_REPORT_MAX_SIZE];
+	u64 start, builder_ns, old_ns;
+	u16 buttons = 0;
+
+	/* Each report has new buttons and accelerometer data: the other sections are kept */
+	for (int i = 0; i < ARRAY_SIZE(data_report_builders); i++) {
+		u8 mode = INPUT_REPORT_ID_BTN + i;
+
+		if (!data_report_builders[i])
+			continue;
+		setup(mode);
+
+		start = test_time_ns();
+		for (int j = 0; j < BENCH_REPORTS; j++) {
+			fake_wiimote_report_input(&wiimote, buttons++ & 0x9F1F);
+			fake_wiimote_report_accelerometer(&wiimote, j, j + 1, j + 2);
+			wiimote.build_report(&wiimote, report);
+		}
+		builder_ns = test_time_ns() - start;
+
+		start = test_time_ns();
+		for (int j = 0; j < BENCH_REPORTS; j++) {
+			fake_wiimote_report_input(&wiimote, buttons++ & 0x9F1F);
+			fake_wiimote_report_accelerometer(&wiimote, j, j + 1, j + 2);
+			old_build_data_report(&wiimote, report);
+		}
+		old_ns = test_time_ns() - start;
+
+		printf("mode 0x%02x (%2d bytes): builder %llu ns, switches %llu ns per report\n",
+		       mode, wiimote.report_size,
+		       (unsigned long long)(builder_ns / BENCH_REPORTS),
+		       (unsigned long long)(old_ns / BENCH_REPORTS));
+	}
+}
+
+int main(void)
+{
+	test_host_init();
+
+	test_layouts();
+	test_builders();
+	bench_builders();
+
+	if (test_failures)
+		printf("%d checks failed\n", test_failures);
+
+	return test_failures ? 1 : 0;
+}
@@ -0,0 +1,239 @@
+#include <string.h>
+#include "fake_wiimote_mgr.h"
+#include "globals.h"
+#include "hci.h"
+#include "hci_state.h"
+#include "syscalls.h"
+#include "test_queues.h"
+#include "utils.h"
+
+/* Feeds the HCI commands WPAD sends when it initializes the Bluetooth stack through
+ * the standalone mode handler, and checks that each one gets the Command Complete
+ * reply the Wii's controller would send. Built without FAKEMOTE_STANDALONE, it checks
+ * which commands of the sequence are answered from the controller info cache instead */
+
+#define TEST_CACHED_CMDS	4
+
+typedef struct {
+	u16 opcode;
+	u8 payload_size;
+	u8 payload[16];
+	/* Size of the return parameters of the Command Complete event */
+	u8 rp_size;
+} test_hci_cmd_t;
+
+static const test_hci_cmd_t wpad_init_cmds[] = {
+	{HCI_CMD_RESET, 0, {0}, sizeof(hci_status_rp)},
+	{HCI_CMD_READ_BUFFER_SIZE, 0, {0}, sizeof(hci_read_buffer_size_rp)},
+	{HCI_CMD_READ_BDADDR, 0, {0}, sizeof(hci_read_bdaddr_rp)},
+	{HCI_CMD_READ_LOCAL_VER, 0, {0}, sizeof(hci_read_local_ver_rp)},
+	{HCI_CMD_READ_LOCAL_FEATURES, 0, {0}, sizeof(hci_read_local_features_rp)},
+	{HCI_CMD_SET_EVENT_FILTER, 3, {0x02, 0x00, 0x03}, sizeof(hci_status_rp)},
+	{HCI_CMD_WRITE_PIN_TYPE, 1, {0x00}, sizeof(hci_status_rp)},
+	{HCI_CMD_WRITE_PAGE_TIMEOUT, 2, {0x00, 0x20}, sizeof(hci_status_rp)},
+	{HCI_CMD_WRITE_UNIT_CLASS, 3, {0x00, 0x04, 0x48}, sizeof(hci_status_rp)},
+	{HCI_CMD_WRITE_LOCAL_NAME, 4, {'W', 'i', 'i', 0}, sizeof(hci_status_rp)},
+	{HCI_CMD_HOST_BUFFER_SIZE, 7, {0x53, 0x01, 0x40, 0x0A, 0x00, 0x00, 0x00},
+	 sizeof(hci_status_rp)},
+	{HCI_CMD_WRITE_INQUIRY_SCAN_TYPE, 1, {0x01}, sizeof(hci_status_rp)},
+	{HCI_CMD_WRITE_INQUIRY_MODE, 1, {0x01}, sizeof(hci_status_rp)},
+	{HCI_CMD_WRITE_PAGE_SCAN_TYPE, 1, {0x01}, sizeof(hci_status_rp)},
+	{HCI_CMD_READ_STORED_LINK_KEY, 7, {0, 0, 0, 0, 0, 0, 0x01},
+	 sizeof(hci_read_stored_link_key_rp)},
+	{HCI_CMD_WRITE_SCAN_ENABLE, 1, {HCI_PAGE_SCAN_ENABLE}, sizeof(hci_status_rp)},
+};
+
+/* Returns the return parameters of the Command Complete event for opcode in msg */
+static const u8 *check_command_compl(const test_msg_t *msg, u16 opcode, u8 rp_size)
+{
+	const hci_event_hdr_t *hdr = (const void *)msg->data;
+	const hci_command_compl_ep *ep = (const void *)(hdr + 1);
+
+	CHECK(hdr->event == HCI_EVENT_COMMAND_COMPL);
+	CHECK(hdr->length == sizeof(*ep) + rp_size);
+	CHECK(msg->size == sizeof(*hdr) + hdr->length);
+	CHECK(ep->num_cmd_pkts == 1);
+	CHECK(le16toh(ep->opcode) == opcode);
+
+	return (const u8 *)(ep + 1);
+}
+
+#ifdef FAKEMOTE_STANDALONE
+static void test_wpad_init_sequence(void)
+{
+	const test_hci_cmd_t *cmd;
+	const u8 *rp;
+
+	hci_state_reset();
+
+	for (int i = 0; i < ARRAY_SIZE(wpad_init_cmds); i++) {
+		cmd = &wpad_init_cmds[i];
+		test_host_clear_msgs();
+
+		/* Nothing is handed down, there's no controller */
+		CHECK(!test_send_hci_cmd(cmd->opcode, cmd->payload, cmd->payload_size));
+		CHECK(test_num_intr_msgs == 1);
+		CHECK(test_num_bulk_in_msgs == 0);
+		if (test_num_intr_msgs != 1)
+			continue;
+
+		rp = check_command_compl(&test_intr_msgs[0], cmd->opcode, cmd->rp_size);
+		CHECK(((const hci_status_rp *)rp)->status == 0x00);
+
+		switch (cmd->opcode) {
+		case HCI_CMD_READ_BUFFER_SIZE: {
+			const hci_read_buffer_size_rp *buf_rp = (const void *)rp;
+			CHECK(le16toh(buf_rp->max_acl_size) == 339);
+			CHECK(le16toh(buf_rp->num_acl_pkts) > 0);
+			break;
+		}
+		case HCI_CMD_READ_LOCAL_VER: {
+			const hci_read_local_ver_rp *ver_rp = (const void *)rp;
+			/* Broadcom */
+			CHECK(le16toh(ver_rp->manufacturer) == 0x000F);
+			break;
+		}
+		case HCI_CMD_READ_STORED_LINK_KEY: {
+			const hci_read_stored_link_key_rp *key_rp = (const void *)rp;
+			/* The link keys of the fake Wiimotes are sent by the fake Wiimote manager */
+			CHECK(le16toh(key_rp->num_keys_read) == MAX_FAKE_WIIMOTES);
+			CHECK(le16toh(key_rp->max_num_keys) == MAX_FAKE_WIIMOTES);
+			break;
+		}
+		}
+	}
+
+	/* Host_Buffer_Size sized the ACL packets we can inject */
+	CHECK(hci_state_get_max_acl_size() == 0x153);
+	/* Page scan is enabled, the fake Wiimotes can connect */
+	CHECK(hci_can_request_connection());
+}
+
+static void test_inquiry(void)
+{
+	const hci_event_hdr_t *hdr;
+	const hci_command_status_ep *ep;
+	u8 cp[5] = {0x33, 0x8B, 0x9E, 0x03, 0x00};
+
+	test_host_clear_msgs();
+	CHECK(!test_send_hci_cmd(HCI_CMD_INQUIRY, cp, sizeof(cp)));
+
+	/* Command Status, then an Inquiry Complete without any result */
+	CHECK(test_num_intr_msgs == 2);
+	if (test_num_intr_msgs != 2)
+		return;
+
+	hdr = (const void *)test_intr_msgs[0].data;
+	ep = (const void *)(hdr + 1);
+	CHECK(hdr->event == HCI_EVENT_COMMAND_STATUS);
+	CHECK(ep->status == 0x00);
+	CHECK(le16toh(ep->opcode) == HCI_CMD_INQUIRY);
+
+	hdr = (const void *)test_intr_msgs[1].data;
+	CHECK(hdr->event == HCI_EVENT_INQUIRY_COMPL);
+	CHECK(test_intr_msgs[1].data[sizeof(*hdr)] == 0x00);
+}
+
+static void test_unknown_command(void)
+{
+	const u8 *rp;
+
+	test_host_clear_msgs();
+	CHECK(!test_send_hci_cmd(HCI_CMD_READ_LOCAL_NAME, NULL, 0));
+	CHECK(test_num_intr_msgs == 1);
+	if (test_num_intr_msgs != 1)
+		return;
+
+	rp = check_command_compl(&test_intr_msgs[0], HCI_CMD_READ_LOCAL_NAME,
+				 sizeof(hci_status_rp));
+	/* Unknown HCI Command */
+	CHECK(((const hci_status_rp *)rp)->status == 0x01);
+}
+
+#else
+static const u8 test_bdaddr[] = {0x11, 0x22, 0x33, 0x44, 0x55, 0x66};
+
+/* The controller answers a command handed down to it with a successful Command Complete */
+static void controller_command_compl(u16 opcode, u8 rp_size)
+{
+	u8 buf[sizeof(hci_event_hdr_t) + sizeof(hci_command_compl_ep) + 255] = {0};
+	hci_event_hdr_t *hdr = (void *)buf;
+	hci_command_compl_ep *ep = (void *)(hdr + 1);
+	u8 *rp = (u8 *)(ep + 1);
+
+	hdr->event = HCI_EVENT_COMMAND_COMPL;
+	hdr->length = sizeof(*ep) + rp_size;
+	ep->num_cmd_pkts = 1;
+	ep->opcode = htole16(opcode);
+	if (opcode == HCI_CMD_READ_BDADDR)
+		memcpy(&((hci_read_bdaddr_rp *)rp)->bdaddr, test_bdaddr, sizeof(test_bdaddr));
+	else if (opcode == HCI_CMD_READ_BUFFER_SIZE)
+		((hci_read_buffer_size_rp *)rp)->max_acl_size = htole16(339);
+	hci_state_handle_hci_event_from_controller(buf, sizeof(*hdr) + hdr->length, sizeof(buf));
+}
+
+static void test_cmd_cache(void)
+{
+	const test_hci_cmd_t *cmd;
+	const u8 *rp;
+	u32 hits = g_hci_cmd_cache_hits;
+	u32 handed_down[2] = {0};
+
+	hci_state_reset();
+
+	/* The sequence starts with an HCI reset, which keeps the cache */
+	for (int init = 0; init < ARRAY_SIZE(handed_down); init++) {
+		for (int i = 0; i < ARRAY_SIZE(wpad_init_cmds); i++) {
+			cmd = &wpad_init_cmds[i];
+			test_host_clear_msgs();
+
+			if (test_send_hci_cmd(cmd->opcode, cmd->payload, cmd->payload_size)) {
+				CHECK(test_num_intr_msgs == 0);
+				handed_down[init]++;
+				controller_command_compl(cmd->opcode, cmd->rp_size);
+				continue;
+			}
+
+			/* Answered from the cache, with what the controller replied */
+			CHECK(init > 0);
+			CHECK(test_num_intr_msgs == 1);
+			if (test_num_intr_msgs != 1)
+				continue;
+			rp = check_command_compl(&test_intr_msgs[0], cmd->opcode, cmd->rp_size);
+			CHECK(((const hci_status_rp *)rp)->status == 0x00);
+			if (cmd->opcode == HCI_CMD_READ_BDADDR)
+				CHECK(!memcmp(&((const hci_read_bdaddr_rp *)rp)->bdaddr, test_bdaddr,
+					      sizeof(test_bdaddr)));
+		}
+	}
+
+	CHECK(handed_down[0] == ARRAY_SIZE(wpad_init_cmds));
+	CHECK(handed_down[1] == ARRAY_SIZE(wpad_init_cmds) - TEST_CACHED_CMDS);
+	CHECK(g_hci_cmd_cache_hits == hits + TEST_CACHED_CMDS);
+	/* The max. size of the injected ACL packets comes from Host_Buffer_Size first */
+	CHECK(hci_state_get_max_acl_size() == 0x153);
+
+	/* Each command answered locally saves a control transfer and an interrupt
+	 * transfer through OH1 */
+	printf("WPAD init: %u HCI commands handed down the first time, %u after an HCI reset\n",
+	       handed_down[0], handed_down[1]);
+}
+#endif
+
+int main(void)
+{
+	test_host_init();
+
+#ifdef FAKEMOTE_STANDALONE
+	test_wpad_init_sequence();
+	test_inquiry();
+	test_unknown_command();
+#else
+	test_cmd_cache();
+#endif
+
+	if (test_failures)
+		printf("%d checks failed\n", test_failures);
+
+	return test_failures ? 1 : 0;
+}
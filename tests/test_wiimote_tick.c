@@ -0,0 +1,186 @@
+#include "test_oh1.h"
+
+/* The main loop is built as is, with its OH1 hooks driven by the test */
+#define main fakemote_main
+#include "main.c"
+#undef main
+/* And the manager, to connect its fake Wiimotes without a host doing the HCI handshake */
+#include "fake_wiimote_mgr.c"
+
+/* Periodic ticks with one through four fake Wiimotes in continuous reporting mode. Each
+ * tick visits the connected ones through their hot state and sends a report for each */
+
+#define TEST_TICKS		2000
+#define TEST_LOCAL_CID		0x0040
+#define TEST_REMOTE_CID		0x0041
+
+static input_device_t *input_devices[MAX_FAKE_WIIMOTES];
+
+static int test_resume(void *usrdata, fake_wiimote_t *wiimote)
+{
+	return 0;
+}
+
+static int test_suspend(void *usrdata)
+{
+	return 0;
+}
+
+static int test_set_leds(void *usrdata, int leds)
+{
+	return 0;
+}
+
+static int test_set_rumble(void *usrdata, bool rumble_on)
+{
+	return 0;
+}
+
+static bool test_report_input(void *usrdata)
+{
+	return true;
+}
+
+static void test_removed(void *usrdata)
+{
+}
+
+static const input_device_ops_t test_input_device_ops = {
+	.resume		= test_resume,
+	.suspend	= test_suspend,
+	.set_leds	= test_set_leds,
+	.set_rumble	= test_set_rumble,
+	.report_input	= test_report_input,
+	.removed	= test_removed,
+};
+
+/* ACL IN buffers given by the host, one per fake Wiimote and tick */
+static u8 host_endpoint = EP_ACL_DATA_IN;
+static u16 host_wLength;
+static u8 host_data[MAX_FAKE_WIIMOTES][64];
+static ioctlv host_vectors[MAX_FAKE_WIIMOTES][3];
+static ipcmessage host_msgs[MAX_FAKE_WIIMOTES];
+
+static void post_host_acl_in_buffer(int i)
+{
+	host_wLength = sizeof(host_data[i]);
+	host_vectors[i][0] = (ioctlv){&host_endpoint, sizeof(host_endpoint)};
+	host_vectors[i][1] = (ioctlv){&host_wLength, sizeof(host_wLength)};
+	host_vectors[i][2] = (ioctlv){host_data[i], sizeof(host_data[i])};
+	host_msgs[i].command = IOS_IOCTLV;
+	host_msgs[i].ioctlv.command = USBV0_IOCTLV_BLKMSG;
+	host_msgs[i].ioctlv.num_in = 2;
+	host_msgs[i].ioctlv.num_io = 1;
+	host_msgs[i].ioctlv.vector = host_vectors[i];
+	test_oh1_post(&host_msgs[i]);
+}
+
+static void run_oh1(void)
+{
+	ipcmessage *msg = NULL;
+
+	OH1_IOS_ReceiveMessage_hook(orig_msg_queueid, &msg, 0);
+}
+
+/* The host sets the reporting mode with an output report on the HID interrupt channel */
+static void set_continuous_reporting(fake_wiimote_t *wiimote, u8 mode)
+{
+	struct {
+		hci_acldata_hdr_t acl;
+		l2cap_hdr_t l2cap;
+		u8 hid;
+		u8 report_id;
+		struct wiimote_output_report_mode_t mode;
+	} __packed out = {0};
+
+	out.acl.con_handle = htole16(HCI_MK_CON_HANDLE(wiimote->hot->hci_con_handle,
+						       HCI_PACKET_START, 0));
+	out.acl.length = htole16(sizeof(out) - sizeof(out.acl));
+	out.l2cap.length = htole16(sizeof(out) - sizeof(out.acl) - sizeof(out.l2cap));
+	out.l2cap.dcid = htole16(TEST_LOCAL_CID);
+	out.hid = (HID_TYPE_DATA << 4) | HID_PARAM_OUTPUT;
+	out.report_id = OUTPUT_REPORT_ID_REPORT_MODE;
+	out.mode.continuous = 1;
+	out.mode.mode = mode;
+	fake_wiimote_handle_acl_data_out_request_from_host(wiimote, &out.acl);
+	wiimote->hot->num_completed_acl_data_packets = 0;
+}
+
+/* A fake Wiimote with its HID channels open */
+static void connect_fake_wiimote(int i)
+{
+	fake_wiimote_t *wiimote = &fake_wiimotes[i];
+
+	CHECK(input_devices_add(NULL, &test_input_device_ops, &input_devices[i]));
+	run_oh1();
+
+	input_device_assign_wiimote(input_devices[i], wiimote);
+	fake_wiimote_init_state(wiimote, input_devices[i]);
+	fake_wiimotes_hot[i].active = true;
+	CHECK(fake_wiimote_mgr_handle_hci_cmd_accept_con(&wiimote->bdaddr, HCI_ROLE_SLAVE));
+	wiimote->psm_hid_intr_chn = (l2cap_channel_info_t){
+		.valid		= true,
+		.state		= L2CAP_CHANNEL_STATE_COMPLETE,
+		.psm		= L2CAP_PSM_HID_INTR,
+		.local_cid	= TEST_LOCAL_CID,
+		.remote_cid	= TEST_REMOTE_CID,
+	};
+	fake_wiimotes_hot[i].acl_state = ACL_STATE_INACTIVE;
+	fake_wiimotes_hot[i].work = 0;
+	set_continuous_reporting(wiimote, INPUT_REPORT_ID_BTN_ACC);
+}
+
+static void bench_tick(int num_wiimotes)
+{
+	u64 start, total = 0;
+	u32 reports = 0;
+
+	for (int t = 0; t < TEST_TICKS; t++) {
+		test_oh1_reset();
+		for (int i = 0; i < num_wiimotes; i++) {
+			post_host_acl_in_buffer(i);
+			run_oh1();
+		}
+		test_oh1_reset();
+
+		start = test_time_ns();
+		test_oh1_post_timer();
+		run_oh1();
+		total += test_time_ns() - start;
+
+		/* Every connected fake Wiimote is visited and reports into a host buffer */
+		CHECK(g_fake_wiimote_last_tick_visits == num_wiimotes);
+		for (int i = 0; i < test_oh1_num_acks; i++) {
+			const hci_acldata_hdr_t *acl = (const void *)host_data[i];
+			const u8 *hid = host_data[i] + sizeof(*acl) + sizeof(l2cap_hdr_t);
+
+			if ((test_oh1_acks[i].msg == &host_msgs[i]) &&
+			    (hid[1] == INPUT_REPORT_ID_BTN_ACC))
+				reports++;
+		}
+	}
+
+	CHECK(reports == num_wiimotes * TEST_TICKS);
+	printf("%d fake Wiimote(s): %llu ns per tick, %llu ns per Wiimote\n", num_wiimotes,
+	       (unsigned long long)(total / TEST_TICKS),
+	       (unsigned long long)(total / TEST_TICKS / num_wiimotes));
+}
+
+int main(void)
+{
+	test_oh1_reset();
+	ensure_initalized();
+
+	for (int i = 0; i < MAX_FAKE_WIIMOTES; i++) {
+		connect_fake_wiimote(i);
+		bench_tick(i + 1);
+	}
+
+	printf("hot state of %d fake Wiimotes: %zu bytes (%zu bytes each for the rest)\n",
+	       MAX_FAKE_WIIMOTES, sizeof(fake_wiimotes_hot), sizeof(fake_wiimote_t));
+
+	if (test_failures)
+		printf("%d checks failed\n", test_failures);
+
+	return test_failures ? 1 : 0;
+}